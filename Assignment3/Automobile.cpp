@@ -29,9 +29,7 @@ void Automobile::addFuel(double _liters)
     fuelInTank += _liters;
     if(fuelInTank>50) {
         fuelInTank=50;//Cap at 50 liters
-	char message[64];
-	sprintf(message, "The %s %d %s %s is full of gas. Discarding the rest...\n", colour.c_str(), year, make.c_str(), model.c_str());
-	Log(WARNING, __FILE__, __func__, __LINE__, message);
+	LOGF_WARNING("The %s %d %s %s is full of gas. Discarding the rest...", colour.c_str(), year, make.c_str(), model.c_str());
     }
 }
 
@@ -43,9 +41,7 @@ void Automobile::drive(double _distance)
     fuelInTank -= fuelConsumed;
     if(fuelInTank < 0) {
         fuelInTank = 0;
-	char message[64];
-	sprintf(message, "The %s %d %s %s has no gas left in the tank\n", colour.c_str(), year, make.c_str(), model.c_str());
-	Log(ERROR, __FILE__, __func__, __LINE__, message);
+	LOGF_ERROR("The %s %d %s %s has no gas left in the tank", colour.c_str(), year, make.c_str(), model.c_str());
     }
 }
 
@@ -0,0 +1,278 @@
+//LogArgs.cpp - Arguments of a formatted log call, captured instead of formatted
+
+#include "LogArgs.h"
+#include "LogRecord.h"
+#include <cstdio>
+#include <endian.h>
+
+const size_t MAX_SPEC_LEN = 32;
+
+size_t EncodeLogArgString(char* out, size_t room, const char* value) {
+    if (room < 3) {
+        return 0;
+    }
+    if (value == nullptr) {
+        value = "(null)";
+    }
+    size_t len = strlen(value);
+    if (len > room - 3) {
+        len = room - 3;
+    }
+    if (len > UINT16_MAX) {
+        len = UINT16_MAX;
+    }
+    uint16_t n = htole16(static_cast<uint16_t>(len));
+    out[0] = LOG_ARG_STRING;
+    memcpy(out + 1, &n, 2);
+    memcpy(out + 3, value, len);
+    return 3 + len;
+}
+
+// One decoded argument. Only the members of its tag are set; i, u and d
+// convert numbers into each other, and are 0 for strings.
+struct LogArg {
+    char tag;
+    int64_t i;
+    uint64_t u;
+    double d;
+    const char* s;
+    size_t s_len;
+
+    LogArg() : tag(0), i(0), u(0), d(0), s(nullptr), s_len(0) {}
+};
+
+// A double as an integer, saturated at the ends of the range and 0 for NaN
+static int64_t double_to_int(double d) {
+    if (d != d) {
+        return 0;
+    }
+    if (d <= -9223372036854775808.0) {
+        return INT64_MIN;
+    }
+    if (d >= 9223372036854775808.0) {
+        return INT64_MAX;
+    }
+    return static_cast<int64_t>(d);
+}
+
+// Takes the next argument off args. Returns false once there is none left.
+static bool next_arg(const char*& args, const char* end, LogArg& arg) {
+    arg = LogArg();
+    if (args >= end) {
+        return false;
+    }
+    arg.tag = *args++;
+    if (arg.tag == LOG_ARG_STRING) {
+        uint16_t len;
+        if (end - args < 2) {
+            return false;
+        }
+        memcpy(&len, args, 2);
+        len = le16toh(len);
+        args += 2;
+        if (static_cast<size_t>(end - args) < len) {
+            return false;
+        }
+        arg.s = args;
+        arg.s_len = len;
+        args += len;
+        return true;
+    }
+    if (end - args < 8) {
+        return false;
+    }
+    uint64_t bits;
+    memcpy(&bits, args, 8);
+    args += 8;
+    bits = le64toh(bits);
+    if (arg.tag == LOG_ARG_DOUBLE) {
+        memcpy(&arg.d, &bits, 8);
+        arg.i = double_to_int(arg.d);
+        arg.u = static_cast<uint64_t>(arg.i);
+    } else {
+        arg.u = bits;
+        arg.i = static_cast<int64_t>(bits);
+        arg.d = arg.tag == LOG_ARG_INT ? static_cast<double>(arg.i) : static_cast<double>(arg.u);
+    }
+    return true;
+}
+
+// Appends what snprintf wrote into the rest of out
+static size_t appended(int written, size_t pos, size_t out_len) {
+    if (written < 0) {
+        return pos;
+    }
+    return pos + written < out_len ? pos + written : out_len - 1;
+}
+
+// A width or precision, whether written out or taken from an argument, kept
+// to what a record can show
+static int field_value(int64_t value) {
+    const int64_t MAX_FIELD = LOG_RECORD_MAX_LEN;
+    return static_cast<int>(value < -MAX_FIELD ? -MAX_FIELD : (value > MAX_FIELD ? MAX_FIELD : value));
+}
+
+// Reads a width or precision at p: digits, or a '*' taking the next
+// argument. Returns false if that argument is missing or not a number.
+static bool read_field(const char*& p, const char*& args, const char* end, int& value) {
+    if (*p == '*') {
+        ++p;
+        LogArg star;
+        if (!next_arg(args, end, star) || star.tag == LOG_ARG_STRING) {
+            return false;
+        }
+        value = field_value(star.i);
+        return true;
+    }
+    int64_t digits = 0;
+    while (*p >= '0' && *p <= '9') {
+        digits = digits * 10 + (*p++ - '0');
+        if (digits > static_cast<int64_t>(LOG_RECORD_MAX_LEN)) {
+            digits = LOG_RECORD_MAX_LEN;
+        }
+    }
+    value = static_cast<int>(digits);
+    return true;
+}
+
+size_t FormatLogArgs(char* out, size_t out_len, const char* format, const char* args, size_t args_len) {
+    if (out_len == 0) {
+        return 0;
+    }
+    const char* end = args + args_len;
+    size_t pos = 0;
+    const char* p = format;
+    while (*p != '\0' && pos + 1 < out_len) {
+        if (*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[pos++] = '%';
+            p += 2;
+            continue;
+        }
+
+        // Flags, width and precision. Widths and precisions taken from
+        // arguments are written into the spec, so snprintf is always passed
+        // exactly one value.
+        ++p;
+        char flags[8];
+        size_t flags_len = 0;
+        for (; *p != '\0' && strchr("-+ #0", *p) != nullptr; ++p) {
+            if (flags_len < sizeof(flags) - 1 && memchr(flags, *p, flags_len) == nullptr) {
+                flags[flags_len++] = *p;
+            }
+        }
+        bool missing = false;
+        int width = 0;
+        if (!read_field(p, args, end, width)) {
+            missing = true;
+        }
+        if (width < 0) {
+            // A negative width from an argument left-justifies
+            width = -width;
+            if (memchr(flags, '-', flags_len) == nullptr && flags_len < sizeof(flags) - 1) {
+                flags[flags_len++] = '-';
+            }
+        }
+        int precision = -1;
+        if (*p == '.') {
+            ++p;
+            if (!read_field(p, args, end, precision)) {
+                missing = true;
+            }
+        }
+
+        // The length modifiers are dropped: every argument was widened to
+        // 64 bits when it was captured
+        while (*p != '\0' && strchr("hlLqjzt", *p) != nullptr) {
+            ++p;
+        }
+        char conversion = *p;
+        if (conversion == '\0') {
+            break;
+        }
+        ++p;
+        if (conversion == 'n') {
+            continue;
+        }
+        LogArg arg;
+        if (missing || !next_arg(args, end, arg)) {
+            int written = snprintf(out + pos, out_len - pos, "(missing)");
+            pos = appended(written, pos, out_len);
+            continue;
+        }
+
+        bool integer = strchr("diouxX", conversion) != nullptr;
+        bool floating = strchr("fFeEgGaA", conversion) != nullptr;
+        bool text = conversion == 's' || conversion == 'c' || conversion == 'p';
+        if (!integer && !floating && !text) {
+            continue;
+        }
+        if (arg.tag == LOG_ARG_STRING && conversion != 's') {
+            arg.s = "(not a number)";
+            arg.s_len = strlen(arg.s);
+            conversion = 's';
+            integer = floating = false;
+            precision = -1;
+        } else if (arg.tag != LOG_ARG_STRING && conversion == 's') {
+            arg.s = "(not a string)";
+            arg.s_len = strlen(arg.s);
+            precision = -1;
+        }
+
+        // Only what C defines for the conversion goes into the spec: '#'
+        // for octal, hex and floating point, '+', ' ' and '0' for numbers,
+        // and no precision for characters and pointers
+        char spec[MAX_SPEC_LEN];
+        size_t spec_len = 0;
+        spec[spec_len++] = '%';
+        for (size_t i = 0; i < flags_len; ++i) {
+            char flag = flags[i];
+            if (flag == '-' || (flag == '#' && (floating || strchr("oxX", conversion) != nullptr)) ||
+                (flag != '#' && (integer || floating))) {
+                spec[spec_len++] = flag;
+            }
+        }
+        if (conversion == 'c' || conversion == 'p') {
+            precision = -1;
+        }
+        int spec_written = snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d", width);
+        spec_len += spec_written > 0 ? spec_written : 0;
+        if (precision >= 0) {
+            spec_written = snprintf(spec + spec_len, sizeof(spec) - spec_len, ".%d", precision);
+            spec_len += spec_written > 0 ? spec_written : 0;
+        }
+        if (integer) {
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = 'l';
+        }
+        spec[spec_len++] = conversion;
+        spec[spec_len] = '\0';
+
+        int written = -1;
+        if (conversion == 's') {
+            // The captured string has no terminator of its own
+            char bounded[LOG_RECORD_MAX_LEN];
+            size_t len = arg.s_len < sizeof(bounded) - 1 ? arg.s_len : sizeof(bounded) - 1;
+            memcpy(bounded, arg.s, len);
+            bounded[len] = '\0';
+            written = snprintf(out + pos, out_len - pos, spec, bounded);
+        } else if (conversion == 'd' || conversion == 'i') {
+            written = snprintf(out + pos, out_len - pos, spec, static_cast<long long>(arg.i));
+        } else if (integer) {
+            unsigned long long v = arg.tag == LOG_ARG_INT ? static_cast<unsigned long long>(arg.i) : arg.u;
+            written = snprintf(out + pos, out_len - pos, spec, v);
+        } else if (conversion == 'c') {
+            written = snprintf(out + pos, out_len - pos, spec, static_cast<int>(static_cast<unsigned char>(arg.u)));
+        } else if (floating) {
+            written = snprintf(out + pos, out_len - pos, spec, arg.d);
+        } else {
+            written = snprintf(out + pos, out_len - pos, spec, reinterpret_cast<void*>(static_cast<uintptr_t>(arg.u)));
+        }
+        pos = appended(written, pos, out_len);
+    }
+    out[pos] = '\0';
+    return pos;
+}
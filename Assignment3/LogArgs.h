@@ -0,0 +1,95 @@
+//LogArgs.h - Arguments of a formatted log call, captured instead of formatted
+//
+// LOGF call sites only copy their arguments into the record; the format
+// string travels once with the call site and the text is put together by
+// whoever finally needs it, normally the server.
+//
+// Each argument is a one byte tag followed by its value in little-endian:
+//
+//   'i'  8 byte signed integer (any signed integral type or enum)
+//   'u'  8 byte unsigned integer (bool as well)
+//   'd'  8 byte double (float and long double as well)
+//   'p'  8 byte pointer value
+//   's'  2 byte length and that many bytes of a C string, without the NUL
+//
+// Arguments that do not fit into the record are left out and render as
+// "(missing)".
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <endian.h>
+
+const char LOG_ARG_INT = 'i';
+const char LOG_ARG_UINT = 'u';
+const char LOG_ARG_DOUBLE = 'd';
+const char LOG_ARG_POINTER = 'p';
+const char LOG_ARG_STRING = 's';
+
+// Writes one tagged 8 byte value, or nothing if it does not fit
+inline size_t EncodeLogArgValue(char* out, size_t room, char tag, uint64_t bits) {
+    if (room < 9) {
+        return 0;
+    }
+    bits = htole64(bits);
+    out[0] = tag;
+    memcpy(out + 1, &bits, 8);
+    return 9;
+}
+
+// Writes a string, cut short to what fits
+size_t EncodeLogArgString(char* out, size_t room, const char* value);
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, size_t>::type
+EncodeLogArg(char* out, size_t room, T value) {
+    return EncodeLogArgValue(out, room, LOG_ARG_INT, static_cast<uint64_t>(static_cast<int64_t>(value)));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, size_t>::type
+EncodeLogArg(char* out, size_t room, T value) {
+    return EncodeLogArgValue(out, room, LOG_ARG_UINT, static_cast<uint64_t>(value));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value, size_t>::type
+EncodeLogArg(char* out, size_t room, T value) {
+    double v = static_cast<double>(value);
+    uint64_t bits;
+    memcpy(&bits, &v, 8);
+    return EncodeLogArgValue(out, room, LOG_ARG_DOUBLE, bits);
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_enum<T>::value, size_t>::type
+EncodeLogArg(char* out, size_t room, T value) {
+    return EncodeLogArgValue(out, room, LOG_ARG_INT, static_cast<uint64_t>(static_cast<int64_t>(value)));
+}
+
+inline size_t EncodeLogArg(char* out, size_t room, const char* value) {
+    return EncodeLogArgString(out, room, value);
+}
+
+inline size_t EncodeLogArg(char* out, size_t room, const void* value) {
+    return EncodeLogArgValue(out, room, LOG_ARG_POINTER, reinterpret_cast<uintptr_t>(value));
+}
+
+inline size_t EncodeLogArgs(char*, size_t) {
+    return 0;
+}
+
+// Captures args into out. Returns the number of bytes written.
+template <typename T, typename... Rest>
+inline size_t EncodeLogArgs(char* out, size_t room, const T& arg, const Rest&... rest) {
+    size_t len = EncodeLogArg(out, room, arg);
+    return len + EncodeLogArgs(out + len, room - len, rest...);
+}
+
+// Renders format with the captured args like snprintf would. The result is
+// always NUL terminated and truncated to fit. Returns the number of
+// characters written, excluding the terminator.
+size_t FormatLogArgs(char* out, size_t out_len, const char* format, const char* args, size_t args_len);
@@ -0,0 +1,742 @@
+//LogBench.cpp - Micro benchmark for the client logging path
+//
+// Usage: ./logbench [iterations]
+//        ./logbench scan [megabytes]   compare dump scanning engines on a
+//                                      generated log (2048 for a 2GB file)
+//        ./logbench ingest [seconds] [senders] [shards...]
+//                                      flood ./logserver started with each
+//                                      shard count and report what it kept
+//        ./logbench transport [records]
+//                                      send records through a Logger over
+//                                      UDP, TCP, a Unix socket and shared
+//                                      memory and report throughput and loss
+//        ./logbench suite [seconds] [threads] [rate]
+//                                      run threads producers calling Log(),
+//                                      each at rate records/s (0 = flat out),
+//                                      against ./logserver over every
+//                                      transport and mode; report call and
+//                                      end-to-end latency percentiles,
+//                                      records/s and loss
+//        ./logbench threads [records] [max threads]
+//                                      split records LOG_WARNING calls over
+//                                      1, 2, 4 ... threads sharing one Logger
+//                                      and report the cost per call
+//
+
+#include "Logger.h"
+#include "LogFormat.h"
+#include "LogScan.h"
+#include "LogIndex.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <new>
+#include <fstream>
+#include <fcntl.h>
+#include <vector>
+#include <sstream>
+#include <sys/un.h>
+#include <random>
+#include <sys/wait.h>
+#include <signal.h>
+#include <algorithm>
+
+// Count every heap allocation made by the process
+static std::atomic<unsigned long> alloc_count(0);
+
+void* operator new(size_t size) {
+    alloc_count++;
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// Runs fn iterations times and prints the cost per call
+template <typename Fn>
+static void run(const char* name, long iterations, Fn fn) {
+    unsigned long allocs_before = alloc_count;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        fn(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    double allocs = double(alloc_count - allocs_before) / iterations;
+    printf("%-28s %10.1f ns/call %8.3f allocs/call\n", name, ns / iterations, allocs);
+}
+
+// Writes a log of roughly megabytes MiB in which 1 line in 64 is an ERROR
+static void generate_log(const char* path, long megabytes) {
+    static const char* messages[] = {
+        "Added the fuel", "Set the efficiency",
+        "The grey 2013 Toyota Corolla is full of gas. Discarding the rest...",
+        "The black 2016 Cadillac Escalade has no gas left in the tank"
+    };
+    FILE* f = fopen(path, "w");
+    char line[1024];
+    long target = megabytes * 1024 * 1024;
+    time_t now = time(nullptr);
+    for (long written = 0, i = 0; written < target; ++i) {
+        int level = i % 64 == 0 ? ERROR : (i % 4 == 0 ? WARNING : DEBUG);
+        const char* message = messages[i % 4];
+        size_t len = FormatLogLine(line, sizeof(line), now + i / 100000, level, "Automobile.cpp", "drive", 48,
+                                   message, strlen(message));
+        line[len++] = '\n';
+        fwrite(line, 1, len, f);
+        written += len;
+    }
+    fclose(f);
+}
+
+// The dump loop as it was: getline into a std::string, then cout << endl
+static size_t dump_ifstream(const char* path, int min_level, std::ostream& out) {
+    std::ifstream log_file(path);
+    std::string line;
+    size_t matches = 0;
+    while (getline(log_file, line)) {
+        if (ParseLogLevel(line.c_str(), line.length()) >= min_level) {
+            out << line << std::endl;
+            ++matches;
+        }
+    }
+    return matches;
+}
+
+// The mmap engine writing matches with writev
+static size_t dump_mmap(const char* path, int min_level, int out_fd) {
+    int fd = open(path, O_RDONLY);
+    LogMapping mapping;
+    mapping.Map(fd);
+    close(fd);
+    LogScanFilter filter;
+    filter.level_mask = LogLevelMask(min_level, false);
+    LogScanOutput out(out_fd);
+    ScanLogRange(mapping.Data(), mapping.Data() + mapping.Size(), filter, out);
+    out.Flush();
+    return out.Lines();
+}
+
+static int scan_bench(long megabytes) {
+    const char* path = "scan_bench.txt";
+    printf("generating %ld MiB log...\n", megabytes);
+    generate_log(path, megabytes);
+    std::ofstream null_stream("/dev/null");
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    printf("newline search: %s\n", LogScanEngine());
+    for (int min_level = DEBUG; min_level <= ERROR; min_level += ERROR) {
+        auto start = std::chrono::steady_clock::now();
+        size_t matches = dump_ifstream(path, min_level, null_stream);
+        double stream_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        size_t mapped_matches = dump_mmap(path, min_level, null_fd);
+        double mmap_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("level >= %-8s ifstream %7.3fs (%6.0f MiB/s)  mmap %7.3fs (%6.0f MiB/s)  matches %zu/%zu\n",
+               LogLevelName(min_level), stream_s, megabytes / stream_s, mmap_s, megabytes / mmap_s,
+               matches, mapped_matches);
+    }
+    close(null_fd);
+    unlink(path);
+    return 0;
+}
+
+const char* INGEST_SOCKET = "/tmp/logbench.sock";
+const char* INGEST_LOG = "/tmp/logbench_server.txt";
+const int INGEST_BATCH = 64;
+
+// Sends a control command to the server under test and returns its answer
+static std::string control_request(const char* command) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, INGEST_SOCKET, sizeof(addr.sun_path) - 1);
+    std::string reply;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        write(fd, command, strlen(command)) == (ssize_t)strlen(command)) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            reply.append(buf, n);
+        }
+    }
+    close(fd);
+    return reply;
+}
+
+// Floods the server from one UDP socket until stop is set: datagrams of
+// packed inline-site records, INGEST_BATCH of them per sendmmsg
+static void ingest_sender(std::atomic<bool>* stop, unsigned long* sent) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(8080);
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+    connect(fd, (struct sockaddr*)&server, sizeof(server));
+
+    char payload[LOG_RECORD_MAX_LEN];
+    size_t site_len = EncodeLogSite(payload, sizeof(payload), "LogBench.cpp", "ingest_sender", __LINE__);
+    static const char message[] = "The grey 2013 Toyota Corolla is full of gas. Discarding the rest...";
+    memcpy(payload + site_len, message, sizeof(message) - 1);
+
+    static const size_t DATAGRAM_LEN = 1400;
+    std::vector<char> datagrams(INGEST_BATCH * DATAGRAM_LEN);
+    struct mmsghdr msgs[INGEST_BATCH];
+    struct iovec iovs[INGEST_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < INGEST_BATCH; ++i) {
+        iovs[i].iov_base = &datagrams[i * DATAGRAM_LEN];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Each sender is a session of its own, numbered like a Logger would
+    LogRecordHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = RECORD_ENTRY;
+    hdr.level = WARNING;
+    hdr.flags = RECORD_FLAG_INLINE_SITE;
+    hdr.session_id = std::random_device()();
+    size_t record_len = LOG_RECORD_HEADER_LEN + site_len + sizeof(message) - 1;
+    int per_datagram = DATAGRAM_LEN / record_len;
+    uint32_t sequence = 0;
+    while (!*stop) {
+        // Restamp every batch so the merger sees current times
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        hdr.timestamp_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+        hdr.sequence = sequence;
+        for (int i = 0; i < INGEST_BATCH; ++i) {
+            char* datagram = &datagrams[i * DATAGRAM_LEN];
+            size_t used = 0;
+            for (int r = 0; r < per_datagram; ++r) {
+                used += EncodeLogRecord(datagram + used, DATAGRAM_LEN - used, hdr, payload, site_len + sizeof(message) - 1);
+                hdr.sequence++;
+            }
+            iovs[i].iov_len = used;
+        }
+        // Numbers of datagrams that were not sent are used again
+        int n = sendmmsg(fd, msgs, INGEST_BATCH, 0);
+        if (n > 0) {
+            *sent += static_cast<unsigned long>(n) * per_datagram;
+            sequence += n * per_datagram;
+        }
+    }
+    close(fd);
+}
+
+// Starts ./logserver with the bench control socket and log plus extra, and
+// waits until it answers. Its stdin is returned in menu_fd.
+static pid_t start_server(std::vector<std::string> args, int& menu_fd) {
+    int in_pipe[2];
+    if (pipe(in_pipe) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(in_pipe[1]);
+        args.insert(args.begin(), "logserver");
+        args.push_back(std::string("--control=") + INGEST_SOCKET);
+        args.push_back(std::string("--log=") + INGEST_LOG);
+        std::vector<char*> argv;
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv.push_back(&args[i][0]);
+        }
+        argv.push_back(nullptr);
+        execv("./logserver", argv.data());
+        perror("exec ./logserver failed");
+        _exit(EXIT_FAILURE);
+    }
+    close(in_pipe[0]);
+    menu_fd = in_pipe[1];
+
+    // Wait until the server answers on its control socket
+    unlink(INGEST_SOCKET);
+    for (int i = 0; i < 100 && control_request("CLIENTS\n").empty(); ++i) {
+        usleep(20000);
+    }
+    return pid;
+}
+
+// Shuts the server down through its menu
+static void stop_server(pid_t pid, int menu_fd) {
+    if (write(menu_fd, "0\n", 2) < 0) {
+        kill(pid, SIGTERM);
+    }
+    close(menu_fd);
+    waitpid(pid, nullptr, 0);
+}
+
+// Adds up the RECORDS column of the server's client list
+static unsigned long server_records() {
+    std::istringstream reply(control_request("CLIENTS\n"));
+    std::string row;
+    unsigned long received = 0;
+    getline(reply, row);
+    getline(reply, row);
+    while (getline(reply, row)) {
+        std::istringstream fields(row);
+        std::string field;
+        for (int i = 0; i < 7; ++i) {
+            fields >> field;
+        }
+        received += strtoul(field.c_str(), nullptr, 10);
+    }
+    return received;
+}
+
+// Runs ./logserver with shards receivers, floods it for the given time and
+// compares what was sent with the record counts the server reports
+static void ingest_run(int seconds, int senders, int shards) {
+    int menu_fd;
+    pid_t pid = start_server({ "--shards=" + std::to_string(shards) }, menu_fd);
+    if (pid < 0) {
+        return;
+    }
+
+    std::atomic<bool> stop(false);
+    std::vector<unsigned long> sent(senders, 0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < senders; ++i) {
+        threads.push_back(std::thread(ingest_sender, &stop, &sent[i]));
+    }
+    sleep(seconds);
+    stop = true;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Give the receivers time to drain their sockets
+    sleep(1);
+    unsigned long received = server_records();
+    unsigned long total = 0;
+    for (size_t i = 0; i < sent.size(); ++i) {
+        total += sent[i];
+    }
+    stop_server(pid, menu_fd);
+
+    printf("shards %2d  sent %10.0f rec/s  kept %10.0f rec/s  lost %5.1f%%\n", shards,
+           total / elapsed, received / elapsed, total ? 100.0 * (total - received) / total : 0.0);
+}
+
+static int ingest_bench(int seconds, int senders, const std::vector<int>& shard_counts) {
+    printf("%d senders, %d s per run, %u cores\n", senders, seconds, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < shard_counts.size(); ++i) {
+        ingest_run(seconds, senders, shard_counts[i]);
+    }
+    unlink(INGEST_LOG);
+    unlink((std::string(INGEST_LOG) + ".idx").c_str());
+    return 0;
+}
+
+// Sends records through the Logger over one transport to a fresh server. The
+// time runs until ExitLog returns, which for the streams is when the server
+// has acknowledged everything.
+static void transport_run(const char* name, LOG_TRANSPORT transport, long records) {
+    int menu_fd;
+    pid_t pid = start_server({ "--stream=/tmp/logbench.stream", "--shm=/tmp/logbench.shm" }, menu_fd);
+    if (pid < 0) {
+        return;
+    }
+    LogConfig config;
+    config.transport = transport;
+    config.stream_path = "/tmp/logbench.stream";
+    config.shm_path = "/tmp/logbench.shm";
+    config.name = "logbench";
+    config.dedup_window_ms = 0;     // the same message over and over would collapse
+    InitializeLog(config);
+    unsigned long dropped = LogDroppedCount();
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < records; ++i) {
+        LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+    }
+    ExitLog();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Wait until the server has worked through its socket buffers. The
+    // HELLO at startup is counted by the server too.
+    unsigned long received = server_records();
+    for (unsigned long last = ULONG_MAX; received != last;) {
+        usleep(200000);
+        last = received;
+        received = server_records();
+    }
+    received = received > 0 ? received - 1 : 0;
+    stop_server(pid, menu_fd);
+
+    printf("%-5s  %10.0f rec/s  dropped at client %8lu  lost %5.1f%%\n", name, records / elapsed,
+           LogDroppedCount() - dropped, records ? 100.0 * (records - received) / records : 0.0);
+}
+
+static int transport_bench(long records) {
+    printf("%ld records per transport\n", records);
+    transport_run("udp", TRANSPORT_UDP, records);
+    transport_run("tcp", TRANSPORT_TCP, records);
+    transport_run("unix", TRANSPORT_UNIX, records);
+    transport_run("shm", TRANSPORT_SHM, records);
+    unlink(INGEST_LOG);
+    unlink((std::string(INGEST_LOG) + ".idx").c_str());
+    return 0;
+}
+
+const int SUITE_SAMPLE_EVERY = 8;       // calls per timed call
+const int SUITE_PROBE_EVERY = 256;      // calls per probe record
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Value below which fraction of the sorted samples lie
+template <typename T>
+static double percentile(const std::vector<T>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return static_cast<double>(sorted[index]);
+}
+
+template <typename T>
+static void print_percentiles(const char* what, std::vector<T>& samples, double scale, const char* unit) {
+    std::sort(samples.begin(), samples.end());
+    printf("    %-10s p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f %s  (%zu samples)\n", what,
+           percentile(samples, 0.5) / scale, percentile(samples, 0.9) / scale, percentile(samples, 0.99) / scale,
+           percentile(samples, 0.999) / scale, samples.empty() ? 0.0 : samples.back() / scale, unit,
+           samples.size());
+}
+
+// One producer: calls Log() at rate records/s, or flat out for rate 0, until
+// stop is set. Every SUITE_SAMPLE_EVERY-th call is timed. Every
+// SUITE_PROBE_EVERY-th record is an ERROR carrying the monotonic time it was
+// logged at, which the subscriber turns into an end-to-end latency.
+static void suite_producer(long rate, std::atomic<bool>* stop, std::vector<uint32_t>* call_ns,
+                           unsigned long* calls) {
+    uint64_t start = monotonic_ns();
+    uint64_t interval = rate > 0 ? 1000000000ULL / rate : 0;
+    unsigned long n = 0;
+    char probe[64];
+    while (!*stop) {
+        if (interval > 0) {
+            uint64_t due = start + n * interval;
+            uint64_t now = monotonic_ns();
+            if (now < due) {
+                if (due - now > 100000) {
+                    usleep((due - now) / 1000 - 50);
+                }
+                continue;
+            }
+        }
+        if (n % SUITE_PROBE_EVERY == 0) {
+            snprintf(probe, sizeof(probe), "probe %llu", static_cast<unsigned long long>(monotonic_ns()));
+            Log(ERROR, __FILE__, __func__, __LINE__, probe);
+        } else if (n % SUITE_SAMPLE_EVERY == 1) {
+            uint64_t before = monotonic_ns();
+            Log(WARNING, __FILE__, __func__, __LINE__, "The grey 2013 Toyota Corolla is full of gas");
+            call_ns->push_back(static_cast<uint32_t>(std::min<uint64_t>(monotonic_ns() - before, UINT32_MAX)));
+        } else {
+            Log(WARNING, __FILE__, __func__, __LINE__, "The grey 2013 Toyota Corolla is full of gas");
+        }
+        ++n;
+    }
+    *calls = n;
+}
+
+// Subscribes to the ERROR records of the server under test and measures how
+// long each probe took from Log() to the server. Returns the connection,
+// which suite_subscriber reads until it is shut down.
+static int suite_subscribe() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, INGEST_SOCKET, sizeof(addr.sun_path) - 1);
+    static const char command[] = "SUBSCRIBE level=2 match=exact\n";
+    char reply[3];
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        write(fd, command, sizeof(command) - 1) != (ssize_t)sizeof(command) - 1 ||
+        read(fd, reply, sizeof(reply)) != (ssize_t)sizeof(reply) || memcmp(reply, "OK\n", 3) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void suite_subscriber(int fd, std::vector<uint64_t>* latencies) {
+    std::string pending;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        uint64_t now = monotonic_ns();
+        pending.append(buf, n);
+        size_t start = 0;
+        size_t eol;
+        while ((eol = pending.find('\n', start)) != std::string::npos) {
+            size_t probe = pending.find("probe ", start);
+            if (probe != std::string::npos && probe < eol) {
+                uint64_t sent = strtoull(pending.c_str() + probe + 6, nullptr, 10);
+                if (sent > 0 && sent <= now) {
+                    latencies->push_back(now - sent);
+                }
+            }
+            start = eol + 1;
+        }
+        pending.erase(0, start);
+    }
+}
+
+// Runs threads producers for the given time over one transport and mode
+// against a fresh server and prints what they achieved
+static void suite_run(const char* name, LOG_TRANSPORT transport, bool async, int seconds, int threads, long rate) {
+    int menu_fd;
+    pid_t pid = start_server({ "--stream=/tmp/logbench.stream", "--shm=/tmp/logbench.shm", "--sampling=off" },
+                             menu_fd);
+    if (pid < 0) {
+        return;
+    }
+    int sub_fd = suite_subscribe();
+    std::vector<uint64_t> end_to_end;
+    std::thread subscriber;
+    if (sub_fd >= 0) {
+        subscriber = std::thread(suite_subscriber, sub_fd, &end_to_end);
+    }
+
+    LogConfig config;
+    config.transport = transport;
+    config.async = async;
+    config.stream_path = "/tmp/logbench.stream";
+    config.shm_path = "/tmp/logbench.shm";
+    config.name = "logbench";
+    config.dedup_window_ms = 0;     // the same message over and over would collapse
+    config.queue_capacity = 1 << 16;
+    InitializeLog(config);
+    unsigned long dropped = LogDroppedCount();
+
+    std::atomic<bool> stop(false);
+    std::vector<std::vector<uint32_t>> call_ns(threads);
+    std::vector<unsigned long> calls(threads, 0);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < threads; ++i) {
+        call_ns[i].reserve(1 << 20);
+        producers.push_back(std::thread(suite_producer, rate, &stop, &call_ns[i], &calls[i]));
+    }
+    auto start = std::chrono::steady_clock::now();
+    sleep(seconds);
+    stop = true;
+    for (int i = 0; i < threads; ++i) {
+        producers[i].join();
+    }
+    double produced_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ExitLog();
+    double delivered_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Wait until the server has worked through its socket buffers. The
+    // HELLO at startup is counted by the server too.
+    unsigned long received = server_records();
+    for (unsigned long last = ULONG_MAX; received != last;) {
+        usleep(200000);
+        last = received;
+        received = server_records();
+    }
+    received = received > 0 ? received - 1 : 0;
+    if (sub_fd >= 0) {
+        shutdown(sub_fd, SHUT_RDWR);
+        subscriber.join();
+        close(sub_fd);
+    }
+    stop_server(pid, menu_fd);
+
+    unsigned long total = 0;
+    std::vector<uint32_t> all_calls;
+    for (int i = 0; i < threads; ++i) {
+        total += calls[i];
+        all_calls.insert(all_calls.end(), call_ns[i].begin(), call_ns[i].end());
+    }
+    // Loss only counts what the client sent, not what it dropped
+    dropped = LogDroppedCount() - dropped;
+    unsigned long sent = total > dropped ? total - dropped : 0;
+    printf("%-9s logged %10.0f rec/s  delivered %10.0f rec/s  dropped at client %8lu  lost %5.2f%%\n", name,
+           total / produced_s, received / delivered_s, dropped,
+           sent ? 100.0 * (sent - std::min<unsigned long>(received, sent)) / sent : 0.0);
+    print_percentiles("Log()", all_calls, 1.0, "ns");
+    print_percentiles("end-to-end", end_to_end, 1000.0, "us");
+}
+
+static int suite_bench(int seconds, int threads, long rate) {
+    printf("%d producer threads, %s, %d s per run, %u cores\n", threads,
+           rate > 0 ? (std::to_string(rate) + " records/s each").c_str() : "flat out", seconds,
+           std::thread::hardware_concurrency());
+    suite_run("udp-sync", TRANSPORT_UDP, false, seconds, threads, rate);
+    suite_run("udp", TRANSPORT_UDP, true, seconds, threads, rate);
+    suite_run("tcp", TRANSPORT_TCP, true, seconds, threads, rate);
+    suite_run("unix", TRANSPORT_UNIX, true, seconds, threads, rate);
+    suite_run("shm", TRANSPORT_SHM, true, seconds, threads, rate);
+    unlink(INGEST_LOG);
+    unlink((std::string(INGEST_LOG) + ".idx").c_str());
+    return 0;
+}
+
+// Splits records LOG_WARNING calls over 1, 2, 4 ... max_threads threads
+// logging through the default Logger. No server needs to listen; the calls
+// cost the same whether or not the datagrams arrive.
+static int threads_bench(long records, int max_threads) {
+    printf("%ld records per run, %u cores\n", records, std::thread::hardware_concurrency());
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        LogConfig config;
+        config.dedup_window_ms = 0;
+        config.queue_capacity = 65536;
+        InitializeLog(config);
+        unsigned long dropped = LogDroppedCount();
+        long per_thread = records / threads;
+        std::vector<std::thread> producers;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < threads; ++i) {
+            producers.push_back(std::thread([per_thread] {
+                for (long n = 0; n < per_thread; ++n) {
+                    LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+                }
+            }));
+        }
+        for (int i = 0; i < threads; ++i) {
+            producers[i].join();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ExitLog();
+        double calls = double(per_thread) * threads;
+        printf("%3d threads  %8.1f ns/call per thread  %12.0f calls/s  dropped %lu\n", threads,
+               elapsed * 1e9 * threads / calls, calls / elapsed, LogDroppedCount() - dropped);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+        return scan_bench(argc > 2 ? atol(argv[2]) : 256);
+    }
+    if (argc > 1 && strcmp(argv[1], "ingest") == 0) {
+        int seconds = argc > 2 ? atoi(argv[2]) : 3;
+        int senders = argc > 3 ? atoi(argv[3]) : 8;
+        std::vector<int> shard_counts;
+        for (int i = 4; i < argc; ++i) {
+            shard_counts.push_back(atoi(argv[i]));
+        }
+        if (shard_counts.empty()) {
+            unsigned int cores = std::thread::hardware_concurrency();
+            for (unsigned int shards = 1; shards <= cores && shards <= 8; shards *= 2) {
+                shard_counts.push_back(shards);
+            }
+        }
+        return ingest_bench(seconds, senders, shard_counts);
+    }
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        return suite_bench(argc > 2 ? atoi(argv[2]) : 2, argc > 3 ? atoi(argv[3]) : 4, argc > 4 ? atol(argv[4]) : 0);
+    }
+    if (argc > 1 && strcmp(argv[1], "threads") == 0) {
+        return threads_bench(argc > 2 ? atol(argv[2]) : 4000000, argc > 3 ? atoi(argv[3]) : 64);
+    }
+    if (argc > 1 && strcmp(argv[1], "transport") == 0) {
+        return transport_bench(argc > 2 ? atol(argv[2]) : 1000000);
+    }
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    char line[1024];
+
+    run("FormatLogLine", iterations, [&](long i) {
+        static const char message[] = "The grey 2013 Toyota Corolla is full of gas";
+        FormatLogLine(line, sizeof(line), time(nullptr), WARNING, __FILE__, __func__, __LINE__, message, sizeof(message) - 1);
+    });
+
+    LogConfig sync_config;
+    sync_config.async = false;
+    sync_config.dedup_window_ms = 0;
+    InitializeLog(sync_config);
+    run("Log (sync)", iterations, [&](long i) {
+        Log(WARNING, __FILE__, __func__, __LINE__, "The grey 2013 Toyota Corolla is full of gas");
+    });
+    ExitLog();
+
+    LogConfig async_config;
+    async_config.dedup_window_ms = 0;
+    InitializeLog(async_config);
+    run("Log (async)", iterations, [&](long i) {
+        Log(WARNING, __FILE__, __func__, __LINE__, "The grey 2013 Toyota Corolla is full of gas");
+    });
+    run("LOG_WARNING (enabled)", iterations, [&](long i) {
+        LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+    });
+    run("snprintf + LOG_WARNING", iterations, [&](long i) {
+        char message[128];
+        snprintf(message, sizeof(message), "The %s %d %s %s is full of gas (%ld)", "grey", 2013, "Toyota", "Corolla", i);
+        LOG_WARNING(message);
+    });
+    run("LOGF_WARNING (deferred)", iterations, [&](long i) {
+        LOGF_WARNING("The %s %d %s %s is full of gas (%ld)", "grey", 2013, "Toyota", "Corolla", i);
+    });
+    SetLogLevel(ERROR);
+    run("Log (filtered out)", iterations, [&](long i) {
+        Log(DEBUG, __FILE__, __func__, __LINE__, "Added the fuel");
+    });
+    run("LOG_DEBUG (filtered out)", iterations, [&](long i) {
+        LOG_DEBUG(std::string("Added the fuel"));
+    });
+    ExitLog();
+
+    SetLogLevel(DEBUG);
+    InitializeLog();
+    run("LOG_WARNING (repeated)", iterations, [&](long i) {
+        LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+    });
+    ExitLog();
+
+    LogConfig sampled_config;
+    sampled_config.dedup_window_ms = 0;
+    sampled_config.sample_one_in[WARNING] = 8;
+    InitializeLog(sampled_config);
+    run("LOG_WARNING (1 in 8 sampled)", iterations, [&](long i) {
+        LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+    });
+    ExitLog();
+
+    // What one timestamp costs from each source
+    static const char* clock_names[] = { "LogClock::Now (realtime)", "LogClock::Now (coarse)", "LogClock::Now (tsc)" };
+    LogClock clock;
+    volatile uint64_t timestamp = 0;
+    for (int source = CLOCK_SOURCE_REALTIME; source <= CLOCK_SOURCE_TSC; ++source) {
+        if (clock.Configure(LOG_CLOCK(source)) == source) {
+            run(clock_names[source], iterations, [&](long i) {
+                timestamp = clock.Now();
+            });
+        }
+    }
+
+    LogConfig tsc_config;
+    tsc_config.dedup_window_ms = 0;
+    tsc_config.clock = CLOCK_SOURCE_TSC;
+    InitializeLog(tsc_config);
+    run("LOG_WARNING (tsc clock)", iterations, [&](long i) {
+        LOG_WARNING("The grey 2013 Toyota Corolla is full of gas");
+    });
+    ExitLog();
+    printf("dropped records: %lu\n", LogDroppedCount());
+    return 0;
+}
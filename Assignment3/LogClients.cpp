@@ -0,0 +1,304 @@
+//LogClients.cpp - Registry of the clients sending records to LogServer
+
+#include "LogClients.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fnmatch.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+uint64_t LogSourceKey(const struct sockaddr_in& addr) {
+    return (static_cast<uint64_t>(ntohl(addr.sin_addr.s_addr)) << 16) | ntohs(addr.sin_port);
+}
+
+struct sockaddr_in LogSourceAddr(uint64_t source) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(static_cast<uint32_t>(source >> 16));
+    addr.sin_port = htons(static_cast<uint16_t>(source & 0xffff));
+    return addr;
+}
+
+const uint64_t STREAM_SOURCE_BIT = 1ULL << 48;
+const uint64_t SHM_SOURCE_BIT = 1ULL << 49;
+
+uint64_t LogStreamSourceKey(uint32_t session_id) {
+    return STREAM_SOURCE_BIT | session_id;
+}
+
+bool IsLogStreamSource(uint64_t source) {
+    return (source & STREAM_SOURCE_BIT) != 0;
+}
+
+uint64_t LogShmSourceKey(uint32_t session_id) {
+    return SHM_SOURCE_BIT | session_id;
+}
+
+bool IsLogShmSource(uint64_t source) {
+    return (source & SHM_SOURCE_BIT) != 0;
+}
+
+void FormatLogSource(uint64_t source, char* out, size_t out_len) {
+    if (IsLogStreamSource(source)) {
+        snprintf(out, out_len, "stream:%08x", static_cast<uint32_t>(source));
+        return;
+    }
+    if (IsLogShmSource(source)) {
+        snprintf(out, out_len, "shm:%08x", static_cast<uint32_t>(source));
+        return;
+    }
+    uint32_t ip = source >> 16;
+    snprintf(out, out_len, "%u.%u.%u.%u:%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff,
+             static_cast<unsigned int>(source & 0xffff));
+}
+
+bool ParseClientSelector(const std::string& text, LogClientSelector& selector, std::string& error) {
+    selector = LogClientSelector();
+    if (text.empty() || text == "all") {
+        return true;
+    }
+    size_t eq = text.find('=');
+    std::string key = text.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : text.substr(eq + 1);
+    if (value.empty()) {
+        error = "expected all, name=, group= or addr=, got " + text;
+        return false;
+    }
+    if (key == "name") {
+        selector.kind = LogClientSelector::NAME;
+        selector.pattern = value;
+    } else if (key == "group") {
+        selector.kind = LogClientSelector::GROUP;
+        selector.pattern = value;
+    } else if (key == "addr") {
+        size_t colon = value.rfind(':');
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        int port = colon == std::string::npos ? 0 : atoi(value.c_str() + colon + 1);
+        if (port <= 0 || port > 65535 ||
+            inet_pton(AF_INET, value.substr(0, colon).c_str(), &addr.sin_addr) <= 0) {
+            error = "addr must be a.b.c.d:port";
+            return false;
+        }
+        addr.sin_port = htons(port);
+        selector.kind = LogClientSelector::ADDRESS;
+        selector.source = LogSourceKey(addr);
+    } else {
+        error = "unknown selector " + key;
+        return false;
+    }
+    return true;
+}
+
+LogClients::LogClients(int _command_fd) : command_fd(_command_fd), swept_at(0) {
+}
+
+void LogClients::SetCommandSender(const CommandSender& sender) {
+    std::lock_guard<std::mutex> lock(mutex);
+    local_sender = sender;
+}
+
+bool LogClients::matches(const LogClientSelector& selector, const LogClientInfo& client) {
+    switch (selector.kind) {
+        case LogClientSelector::ALL:
+            return true;
+        case LogClientSelector::NAME:
+            return fnmatch(selector.pattern.c_str(), client.name.c_str(), 0) == 0;
+        case LogClientSelector::GROUP:
+            return fnmatch(selector.pattern.c_str(), client.group.c_str(), 0) == 0;
+        case LogClientSelector::ADDRESS:
+            return selector.source == client.source;
+    }
+    return false;
+}
+
+// The most recent matching rule wins
+int LogClients::wanted_level(const LogClientInfo& client) const {
+    for (size_t i = rules.size(); i > 0; --i) {
+        if (matches(rules[i - 1].selector, client)) {
+            return rules[i - 1].level;
+        }
+    }
+    return -1;
+}
+
+void LogClients::send_command(const LogClientInfo& client, const std::string& command) {
+    if (IsLogStreamSource(client.source) || IsLogShmSource(client.source)) {
+        if (local_sender) {
+            local_sender(client.source, command);
+        }
+        return;
+    }
+    struct sockaddr_in addr = LogSourceAddr(client.source);
+    sendto(command_fd, command.c_str(), command.length(), 0, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+void LogClients::push_level(const LogClientInfo& client, int level) {
+    send_command(client, "Set Log Level=" + std::to_string(level));
+}
+
+// Pushes the wanted level again to a client that does not report it yet
+void LogClients::reconcile(LogClientInfo& client) {
+    client.level_pending = false;
+    client.wanted_level = wanted_level(client);
+    if (client.wanted_level >= 0 && client.wanted_level != client.level) {
+        push_level(client, client.wanted_level);
+    }
+}
+
+// Drops the clients silent for LOG_CLIENT_FORGET_SECONDS, at most once a minute
+void LogClients::expire(time_t now) {
+    if (now - swept_at < 60) {
+        return;
+    }
+    swept_at = now;
+    for (std::map<uint64_t, LogClientInfo>::iterator it = clients.begin(); it != clients.end();) {
+        if (now - it->second.last_seen > LOG_CLIENT_FORGET_SECONDS) {
+            it = clients.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LogClients::Seen(uint64_t source, uint32_t session_id, const uint32_t* sequences, size_t records, uint64_t sampled,
+                      time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    expire(now);
+    std::map<uint64_t, LogClientInfo>::iterator it = clients.find(source);
+    if (it == clients.end()) {
+        LogClientInfo client;
+        client.source = source;
+        client.pid = 0;
+        client.level = -1;
+        client.wanted_level = -1;
+        client.records = 0;
+        client.sampled = 0;
+        client.first_seen = now;
+        client.last_seen = now;
+        it = clients.insert(std::make_pair(source, client)).first;
+        reconcile(it->second);
+    } else if (it->second.level_pending) {
+        reconcile(it->second);
+    }
+    it->second.records += records;
+    it->second.sampled += sampled;
+    it->second.last_seen = now;
+    if ((IsLogStreamSource(source) || IsLogShmSource(source)) && records > 0) {
+        // These clients outlive a server restart, whatever came before their
+        // first record went to an earlier run
+        it->second.sequence.Resume(session_id, sequences[0]);
+    }
+    for (size_t i = 0; i < records; ++i) {
+        it->second.sequence.Track(session_id, sequences[i]);
+    }
+}
+
+void LogClients::Hello(uint64_t source, uint32_t pid, const char* name, const char* group, int level, time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    expire(now);
+    std::map<uint64_t, LogClientInfo>::iterator it = clients.find(source);
+    if (it == clients.end()) {
+        LogClientInfo client;
+        client.source = source;
+        client.records = 0;
+        client.sampled = 0;
+        client.first_seen = now;
+        it = clients.insert(std::make_pair(source, client)).first;
+    }
+    LogClientInfo& client = it->second;
+    client.pid = pid;
+    client.name = name;
+    client.group = group;
+    client.level = level;
+    client.last_seen = now;
+    reconcile(client);
+    hello_cv.notify_all();
+}
+
+int LogClients::SetLevel(const LogClientSelector& selector, int level, time_t now, time_t max_age,
+                         std::vector<uint64_t>* sent_to) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // A rule for everyone overrides every narrower one; otherwise a rule
+    // replaces the earlier one with the same selector
+    for (size_t i = 0; i < rules.size();) {
+        const LogClientSelector& old = rules[i].selector;
+        if (selector.kind == LogClientSelector::ALL ||
+            (old.kind == selector.kind && old.pattern == selector.pattern && old.source == selector.source)) {
+            rules.erase(rules.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    Rule rule;
+    rule.selector = selector;
+    rule.level = level;
+    rules.push_back(rule);
+
+    int sent = 0;
+    for (std::map<uint64_t, LogClientInfo>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        LogClientInfo& client = it->second;
+        client.wanted_level = wanted_level(client);
+        if (!matches(selector, client)) {
+            continue;
+        }
+        if (now - client.last_seen > max_age) {
+            // Not waited for; the rule reaches it when it sends again
+            client.level_pending = true;
+        } else {
+            push_level(client, level);
+            ++sent;
+            if (sent_to != nullptr) {
+                sent_to->push_back(client.source);
+            }
+        }
+    }
+    return sent;
+}
+
+std::vector<uint64_t> LogClients::AwaitLevel(const std::vector<uint64_t>& sources, int level, int timeout_ms) {
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    std::unique_lock<std::mutex> lock(mutex);
+    std::vector<uint64_t> waiting;
+    while (true) {
+        waiting.clear();
+        for (size_t i = 0; i < sources.size(); ++i) {
+            std::map<uint64_t, LogClientInfo>::const_iterator it = clients.find(sources[i]);
+            if (it == clients.end() || it->second.level != level) {
+                waiting.push_back(sources[i]);
+            }
+        }
+        if (waiting.empty() || std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+        hello_cv.wait_until(lock, deadline);
+    }
+    return waiting;
+}
+
+int LogClients::Broadcast(const std::string& command, time_t now, time_t max_age) {
+    std::lock_guard<std::mutex> lock(mutex);
+    int sent = 0;
+    for (std::map<uint64_t, LogClientInfo>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (now - it->second.last_seen <= max_age) {
+            send_command(it->second, command);
+            ++sent;
+        }
+    }
+    return sent;
+}
+
+std::vector<LogClientInfo> LogClients::List(time_t now, time_t max_age) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<LogClientInfo> list;
+    for (std::map<uint64_t, LogClientInfo>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (max_age == 0 || now - it->second.last_seen <= max_age) {
+            list.push_back(it->second);
+        }
+    }
+    return list;
+}
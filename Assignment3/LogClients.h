@@ -0,0 +1,139 @@
+//LogClients.h - Registry of the clients sending records to LogServer
+//
+// A UDP client is identified by the address its records come from, which is
+// also where it listens for commands; stream and shared memory clients by
+// their session. Clients
+// are added the first time records arrive from them and named by their HELLO
+// records, which also report the level they currently log at.
+//
+// Level changes are kept as rules ("group=sensors gets WARNING") rather than
+// sent once: a rule is pushed to every matching client right away and again to
+// any client that later appears, or whose HELLO shows it missed the change.
+// A client answers a level command with a HELLO reporting its new level,
+// which is what AwaitLevel waits for. Only clients heard from recently are
+// pushed to and waited for; a matching client that was quiet gets the rule
+// once it sends again.
+//
+// Clients silent for LOG_CLIENT_FORGET_SECONDS are dropped from the registry,
+// so addresses and sessions that never come back do not pile up. One that
+// does come back is taken for a new client.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+#include <netinet/in.h>
+#include "LogSequence.h"
+
+const time_t LOG_CLIENT_FORGET_SECONDS = 3600;
+
+// Identifies a client by its IPv4 address and port
+uint64_t LogSourceKey(const struct sockaddr_in& addr);
+struct sockaddr_in LogSourceAddr(uint64_t source);
+
+// Identify stream and shared memory clients by their session, in ranges no
+// address key uses, so they keep their identity across reconnects
+uint64_t LogStreamSourceKey(uint32_t session_id);
+bool IsLogStreamSource(uint64_t source);
+uint64_t LogShmSourceKey(uint32_t session_id);
+bool IsLogShmSource(uint64_t source);
+
+// Renders a source key as "a.b.c.d:port", "stream:<session>" or
+// "shm:<session>"
+void FormatLogSource(uint64_t source, char* out, size_t out_len);
+
+// Picks clients: everyone, by fnmatch glob on the program or group name, or
+// one address
+struct LogClientSelector {
+    enum KIND { ALL, NAME, GROUP, ADDRESS };
+    KIND kind;
+    std::string pattern;
+    uint64_t source;
+
+    LogClientSelector() : kind(ALL), source(0) {}
+};
+
+// Parses "all", "name=<glob>", "group=<glob>" or "addr=<a.b.c.d:port>".
+// Returns false and sets error for anything else.
+bool ParseClientSelector(const std::string& text, LogClientSelector& selector, std::string& error);
+
+struct LogClientInfo {
+    uint64_t source;
+    std::string name;           // empty until the client says HELLO
+    std::string group;
+    uint32_t pid;
+    int level;                  // level the client last reported, -1 if unknown
+    int wanted_level;           // level the rules ask for, -1 if none
+    bool level_pending;         // a rule came while it was quiet; pushed when it is seen again
+    uint64_t records;
+    uint64_t sampled;           // records the client sampled away, going by the weights of those it sent
+    LogSequenceTracker sequence;
+    time_t first_seen;
+    time_t last_seen;
+};
+
+class LogClients {
+    public:
+        // Delivers a command to a client not reached over UDP
+        typedef std::function<void(uint64_t source, const std::string& command)> CommandSender;
+
+    private:
+        struct Rule {
+            LogClientSelector selector;
+            int level;
+        };
+
+        mutable std::mutex mutex;
+        std::condition_variable hello_cv;       // signalled on every HELLO
+        std::map<uint64_t, LogClientInfo> clients;
+        std::vector<Rule> rules;
+        int command_fd;
+        CommandSender local_sender;
+        time_t swept_at;        // when quiet clients were last dropped
+
+        static bool matches(const LogClientSelector& selector, const LogClientInfo& client);
+        int wanted_level(const LogClientInfo& client) const;
+        void send_command(const LogClientInfo& client, const std::string& command);
+        void push_level(const LogClientInfo& client, int level);
+        void reconcile(LogClientInfo& client);
+        void expire(time_t now);
+
+    public:
+        // Commands are sent from command_fd, a UDP socket the caller owns
+        explicit LogClients(int _command_fd);
+
+        // Commands for stream and shared memory clients go through sender
+        void SetCommandSender(const CommandSender& sender);
+
+        // Accounts for a datagram of records from source, numbered sequences
+        // in session session_id, which stood for sampled records more than
+        // were sent
+        void Seen(uint64_t source, uint32_t session_id, const uint32_t* sequences, size_t records, uint64_t sampled,
+                  time_t now);
+
+        // Records the identity and level reported by a HELLO
+        void Hello(uint64_t source, uint32_t pid, const char* name, const char* group, int level, time_t now);
+
+        // Makes level the rule for the selected clients and pushes it to those
+        // seen within the last max_age seconds. Returns the number of clients
+        // the command was sent to, and their sources in sent_to if given.
+        int SetLevel(const LogClientSelector& selector, int level, time_t now, time_t max_age,
+                     std::vector<uint64_t>* sent_to = nullptr);
+
+        // Waits up to timeout_ms for each of sources to report level in a
+        // HELLO. Returns the sources that have not.
+        std::vector<uint64_t> AwaitLevel(const std::vector<uint64_t>& sources, int level, int timeout_ms);
+
+        // Sends command to every client seen within the last max_age seconds.
+        // Returns the number of clients it was sent to.
+        int Broadcast(const std::string& command, time_t now, time_t max_age);
+
+        // Clients seen within the last max_age seconds, all if max_age is 0
+        std::vector<LogClientInfo> List(time_t now, time_t max_age = 0) const;
+};
@@ -0,0 +1,179 @@
+//LogClock.cpp - Where the Logger takes record timestamps from
+
+#include "LogClock.h"
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+const uint64_t NS_PER_SEC = 1000000000ULL;
+const uint64_t FIRST_CALIBRATION_NS = 5000000;  // spent at Configure
+const int CALIBRATION_SAMPLES = 8;              // pairs read, the tightest one is kept
+const int MULT_SHIFT = 32;
+const int MAX_READ_TRIES = 3;                   // then Now() reads CLOCK_REALTIME instead
+const uint64_t MAX_SLEW_NS = 1000000;           // a TSC further ahead is stepped back, the system clock was set
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * NS_PER_SEC + ts.tv_nsec;
+}
+
+// The CPU has a TSC ticking at a constant rate whatever its frequency and
+// sleep state (CPUID 0x80000007, EDX bit 8)
+static bool invariant_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007) {
+        return false;
+    }
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (edx & (1u << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+static uint64_t tsc_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+LogClock::LogClock()
+    : source(CLOCK_SOURCE_REALTIME), version(0), base_tsc(0), base_ns(0), mult(0), next_calibration(0),
+      sample_tsc(0), sample_ns(0), rate(0) {}
+
+// Reads the TSC around CLOCK_REALTIME a few times and pairs the wall time
+// with the middle of the tightest pair of TSC readings
+static void sample_pair(uint64_t& tsc, uint64_t& ns) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < CALIBRATION_SAMPLES; ++i) {
+        uint64_t before = tsc_now();
+        uint64_t real = clock_ns(CLOCK_REALTIME);
+        uint64_t after = tsc_now();
+        if (after - before < best) {
+            best = after - before;
+            tsc = before + best / 2;
+            ns = real;
+        }
+    }
+}
+
+void LogClock::publish(uint64_t tsc, uint64_t ns, uint64_t new_mult) {
+    uint32_t v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    base_tsc.store(tsc, std::memory_order_relaxed);
+    base_ns.store(ns, std::memory_order_relaxed);
+    mult.store(new_mult, std::memory_order_relaxed);
+    version.store(v + 2, std::memory_order_release);
+
+    // Due again in a second's worth of ticks
+    next_calibration.store(tsc + static_cast<uint64_t>((static_cast<unsigned __int128>(NS_PER_SEC) << MULT_SHIFT) /
+                                                        new_mult),
+                           std::memory_order_relaxed);
+}
+
+LOG_CLOCK LogClock::Configure(LOG_CLOCK new_source) {
+    if (new_source != CLOCK_SOURCE_TSC) {
+        source.store(new_source, std::memory_order_relaxed);
+        return new_source;
+    }
+    if (!invariant_tsc()) {
+        source.store(CLOCK_SOURCE_REALTIME, std::memory_order_relaxed);
+        return CLOCK_SOURCE_REALTIME;
+    }
+
+    std::lock_guard<std::mutex> lock(calibration_mutex);
+    uint64_t first_tsc, first_ns, tsc, ns;
+    sample_pair(first_tsc, first_ns);
+    while (clock_ns(CLOCK_REALTIME) < first_ns + FIRST_CALIBRATION_NS) {
+        // Spin; sleeping would only make the interval less exact
+    }
+    sample_pair(tsc, ns);
+    if (tsc <= first_tsc || ns <= first_ns) {
+        source.store(CLOCK_SOURCE_REALTIME, std::memory_order_relaxed);
+        return CLOCK_SOURCE_REALTIME;
+    }
+    sample_tsc = tsc;
+    sample_ns = ns;
+    rate = static_cast<uint64_t>((static_cast<unsigned __int128>(ns - first_ns) << MULT_SHIFT) / (tsc - first_tsc));
+    publish(tsc, ns, rate);
+    source.store(CLOCK_SOURCE_TSC, std::memory_order_release);
+    return CLOCK_SOURCE_TSC;
+}
+
+void LogClock::Recalibrate() {
+    if (source.load(std::memory_order_acquire) != CLOCK_SOURCE_TSC ||
+        tsc_now() < next_calibration.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(calibration_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || tsc_now() < next_calibration.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    uint64_t tsc, ns;
+    sample_pair(tsc, ns);
+    if (tsc > sample_tsc && ns > sample_ns) {
+        uint64_t measured = static_cast<uint64_t>((static_cast<unsigned __int128>(ns - sample_ns) << MULT_SHIFT) /
+                                                  (tsc - sample_tsc));
+        // A step of the system clock in between says nothing about the
+        // rate, so only a plausible one replaces the old
+        if (measured > rate - rate / 100 && measured < rate + rate / 100) {
+            rate = measured;
+        }
+    }
+    sample_tsc = tsc;
+    sample_ns = ns;
+
+    // A TSC running slightly ahead is not stepped back: it keeps the time it
+    // reads now and runs slower until it meets wall time a second later
+    uint64_t anchor = ns;
+    uint64_t new_mult = rate;
+    uint64_t old_tsc = base_tsc.load(std::memory_order_relaxed);
+    if (tsc > old_tsc) {
+        uint64_t predicted = base_ns.load(std::memory_order_relaxed) +
+                             static_cast<uint64_t>((static_cast<unsigned __int128>(tsc - old_tsc) *
+                                                    mult.load(std::memory_order_relaxed)) >> MULT_SHIFT);
+        if (ns < predicted && predicted - ns <= MAX_SLEW_NS) {
+            anchor = predicted;
+            new_mult = rate - static_cast<uint64_t>(static_cast<unsigned __int128>(rate) * (predicted - ns) /
+                                                    NS_PER_SEC);
+        }
+    }
+    publish(tsc, anchor, new_mult);
+}
+
+uint64_t LogClock::Now() {
+    int current = source.load(std::memory_order_relaxed);
+    if (current == CLOCK_SOURCE_COARSE) {
+        return clock_ns(CLOCK_REALTIME_COARSE);
+    }
+    if (current == CLOCK_SOURCE_TSC) {
+        // A signal handler interrupting publish() on this thread would
+        // never see the version settle, hence the limited tries
+        for (int i = 0; i < MAX_READ_TRIES; ++i) {
+            uint32_t v = version.load(std::memory_order_acquire);
+            uint64_t tsc = base_tsc.load(std::memory_order_relaxed);
+            uint64_t ns = base_ns.load(std::memory_order_relaxed);
+            uint64_t scale = mult.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((v & 1) || version.load(std::memory_order_relaxed) != v) {
+                continue;
+            }
+            uint64_t now = tsc_now();
+            if (now >= tsc) {
+                return ns + static_cast<uint64_t>((static_cast<unsigned __int128>(now - tsc) * scale) >> MULT_SHIFT);
+            }
+            return ns - static_cast<uint64_t>((static_cast<unsigned __int128>(tsc - now) * scale) >> MULT_SHIFT);
+        }
+    }
+    return clock_ns(CLOCK_REALTIME);
+}
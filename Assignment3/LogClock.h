@@ -0,0 +1,71 @@
+//LogClock.h - Where the Logger takes record timestamps from
+//
+// Records carry wall time as raw nanoseconds since the epoch; only the server
+// turns them into text. How the client reads that time is configurable:
+//
+//   CLOCK_SOURCE_REALTIME  clock_gettime(CLOCK_REALTIME) through the vDSO,
+//                          exact but the dearest of the three
+//   CLOCK_SOURCE_COARSE    CLOCK_REALTIME_COARSE, the time of the last kernel
+//                          tick: a few ns per read, 1-4 ms resolution
+//   CLOCK_SOURCE_TSC       the CPU's time stamp counter scaled to wall time,
+//                          ns resolution for the cost of an rdtsc
+//
+// The TSC is only used when the CPU says it ticks at a constant rate across
+// cores and sleep states (invariant TSC); otherwise, and off x86, the clock
+// falls back to CLOCK_REALTIME. Its offset and rate come from pairing TSC
+// readings with CLOCK_REALTIME, first over a few ms at Configure and then
+// once a second in Recalibrate, which a Logger thread calls every round.
+// Each recalibration re-anchors the TSC at the current wall time. A TSC found
+// behind steps forward; one found ahead by up to a millisecond keeps its time
+// and runs that much slower over the next second instead, so the calibration
+// error alone does not move timestamps back. Timestamps are still wall time,
+// not a monotonic clock: a system clock set back is followed within a
+// second, and two threads reading around a recalibration may see the order
+// of their timestamps off by a few ns.
+//
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+enum LOG_CLOCK {
+    CLOCK_SOURCE_REALTIME,
+    CLOCK_SOURCE_COARSE,
+    CLOCK_SOURCE_TSC
+};
+
+class LogClock {
+    private:
+        std::atomic<int> source;
+
+        // ns = base_ns + (tsc - base_tsc) * mult / 2^32, published under a
+        // sequence lock: odd versions are being written
+        std::atomic<uint32_t> version;
+        std::atomic<uint64_t> base_tsc;
+        std::atomic<uint64_t> base_ns;
+        std::atomic<uint64_t> mult;
+        std::atomic<uint64_t> next_calibration;     // TSC reading due for the next one
+
+        // The last pairing of TSC and wall time, and the TSC rate measured
+        // from those; mult differs from rate while a TSC ahead slows down.
+        // Under calibration_mutex.
+        std::mutex calibration_mutex;
+        uint64_t sample_tsc;
+        uint64_t sample_ns;
+        uint64_t rate;
+
+        void publish(uint64_t tsc, uint64_t ns, uint64_t new_mult);
+
+    public:
+        LogClock();
+
+        // Switches to source and returns the source actually in use
+        LOG_CLOCK Configure(LOG_CLOCK new_source);
+
+        // Nanoseconds since the epoch. Safe in a signal handler.
+        uint64_t Now();
+
+        // Corrects the TSC conversion once a second; cheap when not due
+        void Recalibrate();
+};
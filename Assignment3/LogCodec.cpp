@@ -0,0 +1,224 @@
+//LogCodec.cpp - Built-in LZ77 codec for closed log segments
+
+#include "LogCodec.h"
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <endian.h>
+#include <unistd.h>
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 65535;
+const int HASH_BITS = 16;
+const size_t FILE_BLOCK_LEN = 1024 * 1024;
+const char FILE_MAGIC[4] = { 'L', 'G', 'Z', '1' };
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static size_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the part of a length that did not fit into its 4 bit nibble
+static size_t put_length(unsigned char* out, size_t op, size_t len) {
+    len -= 15;
+    while (len >= 255) {
+        out[op++] = 255;
+        len -= 255;
+    }
+    out[op++] = static_cast<unsigned char>(len);
+    return op;
+}
+
+// Emits a token, the literals and, if match_len is non-zero, the match
+static size_t put_sequence(unsigned char* out, size_t op, const unsigned char* literals, size_t literal_len,
+                           size_t offset, size_t match_len) {
+    size_t token_pos = op++;
+    unsigned char token = 0;
+    if (literal_len >= 15) {
+        token = 15 << 4;
+        op = put_length(out, op, literal_len);
+    } else {
+        token = static_cast<unsigned char>(literal_len << 4);
+    }
+    memcpy(out + op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len > 0) {
+        out[op++] = static_cast<unsigned char>(offset);
+        out[op++] = static_cast<unsigned char>(offset >> 8);
+        size_t code = match_len - MIN_MATCH;
+        if (code >= 15) {
+            token |= 15;
+            op = put_length(out, op, code);
+        } else {
+            token |= static_cast<unsigned char>(code);
+        }
+    }
+    out[token_pos] = token;
+    return op;
+}
+
+size_t LogCompressBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t LogCompressBlock(const char* src_chars, size_t len, char* out_chars) {
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(src_chars);
+    unsigned char* out = reinterpret_cast<unsigned char*>(out_chars);
+    std::vector<int64_t> table(static_cast<size_t>(1) << HASH_BITS, -1);
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    while (ip + MIN_MATCH <= len) {
+        uint32_t seq = read32(src + ip);
+        size_t h = hash32(seq);
+        int64_t candidate = table[h];
+        table[h] = ip;
+        if (candidate < 0 || ip - candidate > MAX_OFFSET || read32(src + candidate) != seq) {
+            ++ip;
+            continue;
+        }
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < len && src[candidate + match_len] == src[ip + match_len]) {
+            ++match_len;
+        }
+        op = put_sequence(out, op, src + anchor, ip - anchor, ip - candidate, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+    return put_sequence(out, op, src + anchor, len - anchor, 0, 0);
+}
+
+// Reads an extended length, returning false if it runs past the end
+static bool get_length(const unsigned char* src, size_t len, size_t& ip, size_t& value) {
+    unsigned char b;
+    do {
+        if (ip >= len) {
+            return false;
+        }
+        b = src[ip++];
+        value += b;
+    } while (b == 255);
+    return true;
+}
+
+bool LogDecompressBlock(const char* src_chars, size_t len, char* out_chars, size_t out_len, size_t& produced) {
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(src_chars);
+    unsigned char* out = reinterpret_cast<unsigned char*>(out_chars);
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        unsigned char token = src[ip++];
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(src, len, ip, literal_len)) {
+            return false;
+        }
+        if (literal_len > len - ip || literal_len > out_len - op) {
+            return false;
+        }
+        memcpy(out + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return false;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(src, len, ip, match_len)) {
+            return false;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > out_len - op) {
+            return false;
+        }
+        // Byte by byte, since a match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; ++i, ++op) {
+            out[op] = out[op - offset];
+        }
+    }
+    produced = op;
+    return true;
+}
+
+static bool write_fd(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool CompressLogFile(const std::string& in_path, const std::string& out_path) {
+    FILE* in = fopen(in_path.c_str(), "rb");
+    if (in == nullptr) {
+        return false;
+    }
+    FILE* out = fopen(out_path.c_str(), "wb");
+    if (out == nullptr) {
+        fclose(in);
+        return false;
+    }
+
+    std::vector<char> raw(FILE_BLOCK_LEN);
+    std::vector<char> packed(LogCompressBound(FILE_BLOCK_LEN));
+    bool ok = fwrite(FILE_MAGIC, 1, sizeof(FILE_MAGIC), out) == sizeof(FILE_MAGIC);
+    size_t raw_len;
+    while (ok && (raw_len = fread(raw.data(), 1, raw.size(), in)) > 0) {
+        size_t packed_len = LogCompressBlock(raw.data(), raw_len, packed.data());
+        uint32_t lengths[2] = { htole32(static_cast<uint32_t>(raw_len)), htole32(static_cast<uint32_t>(packed_len)) };
+        ok = fwrite(lengths, 1, sizeof(lengths), out) == sizeof(lengths) &&
+             fwrite(packed.data(), 1, packed_len, out) == packed_len;
+    }
+    ok = ok && !ferror(in);
+    fclose(in);
+    if (fclose(out) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+bool DecompressLogFile(const std::string& in_path, int fd) {
+    FILE* in = fopen(in_path.c_str(), "rb");
+    if (in == nullptr) {
+        return false;
+    }
+    char magic[sizeof(FILE_MAGIC)];
+    bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0;
+
+    std::vector<char> raw;
+    std::vector<char> packed;
+    uint32_t lengths[2];
+    while (ok && fread(lengths, 1, sizeof(lengths), in) == sizeof(lengths)) {
+        size_t raw_len = le32toh(lengths[0]);
+        size_t packed_len = le32toh(lengths[1]);
+        raw.resize(raw_len);
+        packed.resize(packed_len);
+        size_t produced = 0;
+        ok = fread(packed.data(), 1, packed_len, in) == packed_len &&
+             LogDecompressBlock(packed.data(), packed_len, raw.data(), raw_len, produced) &&
+             produced == raw_len && write_fd(fd, raw.data(), raw_len);
+    }
+    fclose(in);
+    return ok;
+}
@@ -0,0 +1,32 @@
+//LogCodec.h - Built-in LZ77 codec for closed log segments
+//
+// A block is a sequence of (literals, match) pairs in the LZ4 style: a token
+// byte holds the literal length in its high nibble and the match length - 4
+// in its low nibble, a nibble of 15 is extended by bytes of 255 plus a final
+// remainder, literals follow the token, and a match is a 2 byte little-endian
+// offset back into the output. The last pair of a block has no match.
+//
+// A compressed file is the magic "LGZ1" followed by blocks, each prefixed by
+// its uncompressed and compressed length as 4 byte little-endian values.
+//
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Worst case size of a compressed block of len bytes
+size_t LogCompressBound(size_t len);
+
+// Compresses len bytes from src into out, which must hold LogCompressBound(len)
+// bytes. Returns the compressed size.
+size_t LogCompressBlock(const char* src, size_t len, char* out);
+
+// Decompresses a block into out. Returns false if the block is malformed or
+// does not fit into out_len bytes.
+bool LogDecompressBlock(const char* src, size_t len, char* out, size_t out_len, size_t& produced);
+
+// Compresses the file at in_path into out_path. Returns false on I/O errors.
+bool CompressLogFile(const std::string& in_path, const std::string& out_path);
+
+// Writes the decompressed contents of in_path to the file descriptor fd
+bool DecompressLogFile(const std::string& in_path, int fd);
@@ -0,0 +1,246 @@
+//LogCounters.cpp - Rolling record counts kept by LogServer as records arrive
+
+#include "LogCounters.h"
+#include <cstring>
+#include <cstdio>
+
+uint64_t LogLevelCounts::Total() const {
+    uint64_t total = 0;
+    for (int level = 0; level < COUNTER_LEVELS; ++level) {
+        total += counts[level];
+    }
+    return total;
+}
+
+void LogLevelCounts::Add(const LogLevelCounts& other) {
+    for (int level = 0; level < COUNTER_LEVELS; ++level) {
+        counts[level] += other.counts[level];
+    }
+}
+
+static const char OTHER_KEY[] = "(other)";    // files and sites beyond COUNTER_MAX_SERIES
+const size_t MAX_KNOWN_SITES = 64 * 1024;      // numbered sites remembered; others are looked up by name
+
+LogCounters::Series::Series() : last_bucket(0) {
+    memset(bucket, 0, sizeof(bucket));
+    memset(counts, 0, sizeof(counts));
+}
+
+// Nothing within the hour of buckets kept
+bool LogCounters::Series::Idle(uint64_t now_bucket) const {
+    return last_bucket + COUNTER_BUCKETS <= now_bucket;
+}
+
+// A slot still holding an older bucket is cleared when time reaches it again
+void LogCounters::Series::Add(uint64_t bucket_number, int level, uint32_t n) {
+    size_t slot = bucket_number % COUNTER_BUCKETS;
+    if (bucket[slot] != bucket_number) {
+        bucket[slot] = bucket_number;
+        memset(counts[slot], 0, sizeof(counts[slot]));
+    }
+    counts[slot][level] += n;
+    total.counts[level] += n;
+    if (bucket_number > last_bucket) {
+        last_bucket = bucket_number;
+    }
+}
+
+LogLevelCounts LogCounters::Series::Sum(uint64_t now_bucket, int buckets) const {
+    LogLevelCounts sum;
+    for (int i = 0; i < buckets && static_cast<uint64_t>(i) <= now_bucket; ++i) {
+        uint64_t wanted = now_bucket - i;
+        size_t slot = wanted % COUNTER_BUCKETS;
+        if (bucket[slot] != wanted) {
+            continue;       // nothing arrived in that bucket
+        }
+        for (int level = 0; level < COUNTER_LEVELS; ++level) {
+            sum.counts[level] += counts[slot][level];
+        }
+    }
+    return sum;
+}
+
+// Buckets a window of seconds spans, counting the current one
+int LogCounters::window_buckets(int seconds) {
+    int buckets = (seconds + COUNTER_BUCKET_SECONDS - 1) / COUNTER_BUCKET_SECONDS;
+    return buckets < 1 ? 1 : (buckets > COUNTER_BUCKETS ? COUNTER_BUCKETS : buckets);
+}
+
+LogCounters::LogCounters() : swept_bucket(0) {
+}
+
+LogCounters::Series* LogCounters::series(std::unordered_map<std::string, std::unique_ptr<Series>>& map,
+                                         const std::string& key) {
+    std::unordered_map<std::string, std::unique_ptr<Series>>::iterator it = map.find(key);
+    if (it != map.end()) {
+        return it->second.get();
+    }
+    std::unique_ptr<Series>& entry = map[map.size() < COUNTER_MAX_SERIES ? key : std::string(OTHER_KEY)];
+    if (!entry) {
+        entry.reset(new Series());
+    }
+    return entry.get();
+}
+
+// Drops the series idle for an hour, and the sites that lead to them or
+// belong to a client that went quiet
+void LogCounters::expire(uint64_t now_bucket) {
+    for (std::map<std::pair<uint64_t, uint32_t>, SiteSeries>::iterator it = known_sites.begin();
+         it != known_sites.end();) {
+        std::unordered_map<uint64_t, std::unique_ptr<Series>>::const_iterator source = sources.find(it->first.first);
+        if (it->second.file->Idle(now_bucket) || it->second.site->Idle(now_bucket) || source == sources.end() ||
+            source->second->Idle(now_bucket)) {
+            it = known_sites.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::unordered_map<std::string, std::unique_ptr<Series>>* maps[] = { &files, &sites };
+    for (size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); ++i) {
+        for (std::unordered_map<std::string, std::unique_ptr<Series>>::iterator it = maps[i]->begin();
+             it != maps[i]->end();) {
+            if (it->second->Idle(now_bucket)) {
+                it = maps[i]->erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (std::unordered_map<uint64_t, std::unique_ptr<Series>>::iterator it = sources.begin(); it != sources.end();) {
+        if (it->second->Idle(now_bucket)) {
+            it = sources.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    swept_bucket = now_bucket;
+}
+
+void LogCounters::Count(uint64_t source, uint32_t site_id, const char* file, int line, int level, uint32_t n,
+                        time_t now) {
+    if (level < 0 || level >= COUNTER_LEVELS) {
+        return;
+    }
+    uint64_t bucket_number = static_cast<uint64_t>(now) / COUNTER_BUCKET_SECONDS;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (bucket_number != swept_bucket) {
+        expire(bucket_number);
+    }
+    all.Add(bucket_number, level, n);
+
+    std::unordered_map<uint64_t, std::unique_ptr<Series>>::iterator by_source = sources.find(source);
+    if (by_source == sources.end() && sources.size() < COUNTER_MAX_SERIES) {
+        by_source = sources.emplace(source, std::unique_ptr<Series>(new Series())).first;
+    }
+    if (by_source != sources.end()) {
+        by_source->second->Add(bucket_number, level, n);
+    }
+
+    SiteSeries where;
+    std::map<std::pair<uint64_t, uint32_t>, SiteSeries>::const_iterator it = known_sites.end();
+    if (site_id != 0) {
+        it = known_sites.find(std::make_pair(source, site_id));
+    }
+    if (it != known_sites.end()) {
+        where = it->second;
+    } else {
+        char line_text[16];
+        snprintf(line_text, sizeof(line_text), ":%d", line);
+        where.file = series(files, file);
+        where.site = series(sites, file + std::string(line_text));
+        if (site_id != 0 && by_source != sources.end() && known_sites.size() < MAX_KNOWN_SITES) {
+            known_sites[std::make_pair(source, site_id)] = where;
+        }
+    }
+    where.file->Add(bucket_number, level, n);
+    where.site->Add(bucket_number, level, n);
+}
+
+void LogCounters::ForgetSite(uint64_t source, uint32_t site_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    known_sites.erase(std::make_pair(source, site_id));
+}
+
+const LogCounters::Series* LogCounters::find(LOG_COUNTER_DIMENSION dimension, const std::string& key,
+                                             uint64_t source) const {
+    switch (dimension) {
+        case COUNT_ALL:
+            return &all;
+        case COUNT_FILE: {
+            std::unordered_map<std::string, std::unique_ptr<Series>>::const_iterator it = files.find(key);
+            return it != files.end() ? it->second.get() : nullptr;
+        }
+        case COUNT_SITE: {
+            std::unordered_map<std::string, std::unique_ptr<Series>>::const_iterator it = sites.find(key);
+            return it != sites.end() ? it->second.get() : nullptr;
+        }
+        case COUNT_SOURCE: {
+            std::unordered_map<uint64_t, std::unique_ptr<Series>>::const_iterator it = sources.find(source);
+            return it != sources.end() ? it->second.get() : nullptr;
+        }
+    }
+    return nullptr;
+}
+
+bool LogCounters::Sum(LOG_COUNTER_DIMENSION dimension, const std::string& key, uint64_t source, int seconds,
+                      time_t now, LogLevelCounts& counts) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    const Series* found = find(dimension, key, source);
+    if (found == nullptr) {
+        return false;
+    }
+    if (seconds == 0) {
+        counts.Add(found->total);
+    } else {
+        counts.Add(found->Sum(static_cast<uint64_t>(now) / COUNTER_BUCKET_SECONDS, window_buckets(seconds)));
+    }
+    return true;
+}
+
+bool LogCounters::Histogram(LOG_COUNTER_DIMENSION dimension, const std::string& key, uint64_t source, int seconds,
+                            time_t now, std::vector<LogLevelCounts>& buckets) const {
+    int count = window_buckets(seconds);
+    buckets.resize(count);
+    std::lock_guard<std::mutex> lock(mutex);
+    const Series* found = find(dimension, key, source);
+    if (found == nullptr) {
+        return false;
+    }
+    uint64_t now_bucket = static_cast<uint64_t>(now) / COUNTER_BUCKET_SECONDS;
+    for (int i = 0; i < count && static_cast<uint64_t>(i) <= now_bucket; ++i) {
+        buckets[count - 1 - i].Add(found->Sum(now_bucket - i, 1));
+    }
+    return true;
+}
+
+std::vector<LogCounters::Row> LogCounters::Rows(LOG_COUNTER_DIMENSION dimension, int seconds, time_t now) const {
+    std::vector<Row> rows;
+    uint64_t now_bucket = static_cast<uint64_t>(now) / COUNTER_BUCKET_SECONDS;
+    int buckets = window_buckets(seconds);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dimension == COUNT_ALL) {
+        Row row;
+        row.source = 0;
+        row.counts = seconds == 0 ? all.total : all.Sum(now_bucket, buckets);
+        rows.push_back(row);
+    } else if (dimension == COUNT_SOURCE) {
+        for (std::unordered_map<uint64_t, std::unique_ptr<Series>>::const_iterator it = sources.begin();
+             it != sources.end(); ++it) {
+            Row row;
+            row.source = it->first;
+            row.counts = seconds == 0 ? it->second->total : it->second->Sum(now_bucket, buckets);
+            rows.push_back(row);
+        }
+    } else {
+        const std::unordered_map<std::string, std::unique_ptr<Series>>& map = dimension == COUNT_FILE ? files : sites;
+        for (std::unordered_map<std::string, std::unique_ptr<Series>>::const_iterator it = map.begin();
+             it != map.end(); ++it) {
+            Row row;
+            row.key = it->first;
+            row.source = 0;
+            row.counts = seconds == 0 ? it->second->total : it->second->Sum(now_bucket, buckets);
+            rows.push_back(row);
+        }
+    }
+    return rows;
+}
@@ -0,0 +1,120 @@
+//LogCounters.h - Rolling record counts kept by LogServer as records arrive
+//
+// Every record received is counted by level in ten second buckets, once in
+// the server-wide totals and once each under its source file, its call site
+// ("file:line") and the client it came from. An hour of buckets is kept per
+// series, in a ring that is reset bucket by bucket as time moves on, next to
+// counts since the server started.
+//
+// A query such as "ERRORs from Automobile.cpp in the last 5 minutes" looks
+// up one series and adds up at most an hour of buckets, however many records
+// the log holds.
+//
+// Files, sites and clients come and go, and clients pick what they send, so
+// a series nothing was counted under for an hour is dropped together with
+// its counts since the server started (the server-wide totals keep them).
+// At most COUNTER_MAX_SERIES files, sites and clients each have a series at
+// a time; records of further files and sites are counted under "(other)",
+// those of further clients only in the totals.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <ctime>
+
+const int COUNTER_BUCKET_SECONDS = 10;
+const int COUNTER_BUCKETS = 360;            // one hour
+const int COUNTER_LEVELS = 4;               // DEBUG to CRITICAL
+const size_t COUNTER_MAX_SERIES = 1024;     // per dimension, about 8.6 KB each
+
+// Counts of one level each, DEBUG first
+struct LogLevelCounts {
+    uint64_t counts[COUNTER_LEVELS];
+
+    LogLevelCounts() : counts{ 0, 0, 0, 0 } {}
+    uint64_t Total() const;
+    void Add(const LogLevelCounts& other);
+};
+
+enum LOG_COUNTER_DIMENSION {
+    COUNT_ALL,          // every record
+    COUNT_FILE,         // by source file
+    COUNT_SITE,         // by call site, "file:line"
+    COUNT_SOURCE        // by client, the source key
+};
+
+class LogCounters {
+    public:
+        // One entry of a dimension, with its counts over the window asked for
+        struct Row {
+            std::string key;        // file or site; empty for COUNT_SOURCE
+            uint64_t source;        // COUNT_SOURCE only
+            LogLevelCounts counts;
+        };
+
+    private:
+        struct Series {
+            uint64_t bucket[COUNTER_BUCKETS];                   // bucket number each slot holds
+            uint32_t counts[COUNTER_BUCKETS][COUNTER_LEVELS];
+            LogLevelCounts total;                               // since the server started
+            uint64_t last_bucket;                               // the newest counted in
+
+            Series();
+            bool Idle(uint64_t now_bucket) const;
+            void Add(uint64_t bucket_number, int level, uint32_t n);
+            LogLevelCounts Sum(uint64_t now_bucket, int buckets) const;
+        };
+
+        // What a numbered call site of a client is counted under, so that
+        // records from known sites need no string keys built
+        struct SiteSeries {
+            Series* file;
+            Series* site;
+        };
+
+        mutable std::mutex mutex;
+        Series all;
+        std::unordered_map<std::string, std::unique_ptr<Series>> files;
+        std::unordered_map<std::string, std::unique_ptr<Series>> sites;
+        std::unordered_map<uint64_t, std::unique_ptr<Series>> sources;
+        std::map<std::pair<uint64_t, uint32_t>, SiteSeries> known_sites;
+        uint64_t swept_bucket;      // when idle series were last dropped
+
+        Series* series(std::unordered_map<std::string, std::unique_ptr<Series>>& map, const std::string& key);
+        void expire(uint64_t now_bucket);
+        const Series* find(LOG_COUNTER_DIMENSION dimension, const std::string& key, uint64_t source) const;
+        static int window_buckets(int seconds);
+
+    public:
+        LogCounters();
+
+        // Counts n records (the weight of a sampled record) at level, from
+        // site site_id of source, logged at file:line, received at now.
+        // site_id 0 stands for a site sent along with the record.
+        void Count(uint64_t source, uint32_t site_id, const char* file, int line, int level, uint32_t n, time_t now);
+
+        // Forgets where site site_id of source was, as a SITE record is
+        // about to say it again
+        void ForgetSite(uint64_t source, uint32_t site_id);
+
+        // Counts of one file, site or source over the last seconds (0 for
+        // since the server started). key is ignored for COUNT_ALL and
+        // COUNT_SOURCE. Returns false if nothing was counted under it, or
+        // nothing for the last hour.
+        bool Sum(LOG_COUNTER_DIMENSION dimension, const std::string& key, uint64_t source, int seconds, time_t now,
+                 LogLevelCounts& counts) const;
+
+        // Per bucket counts of one file, site or source, oldest first, over
+        // the last seconds
+        bool Histogram(LOG_COUNTER_DIMENSION dimension, const std::string& key, uint64_t source, int seconds,
+                       time_t now, std::vector<LogLevelCounts>& buckets) const;
+
+        // Every file, site or source with its counts over the last seconds
+        std::vector<Row> Rows(LOG_COUNTER_DIMENSION dimension, int seconds, time_t now) const;
+};
@@ -0,0 +1,150 @@
+//LogCtl.cpp - Command line client for the LogServer control socket
+//
+// Usage: ./logctl [--socket=PATH] tail [level=N] [match=exact|cumulative]
+//                                      [file=GLOB] [source=GLOB]
+//        ./logctl [--socket=PATH] set-level LEVEL [all|name=GLOB|group=GLOB|addr=IP:PORT] [wait=MS]
+//        ./logctl [--socket=PATH] dump [level=N] [match=exact|cumulative] [minutes=N] [contains=TEXT]
+//        ./logctl [--socket=PATH] clients
+//        ./logctl [--socket=PATH] stats
+//        ./logctl [--socket=PATH] count [window=SECONDS] [file=NAME|site=FILE:LINE|source=ADDR]
+//                                       [by=file|site|source] [histogram]
+//        ./logctl [--socket=PATH] search [limit=N] WORD...
+//        ./logctl [--socket=PATH] rotate
+//        ./logctl [--socket=PATH] shutdown
+//
+// The exit status is 0 if the server answered OK, so set-level fails unless
+// every selected client confirmed the level within the wait.
+//
+
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const char* DEFAULT_SOCKET = "/tmp/logserver.sock";
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--socket=PATH] <command> [args]" << std::endl
+              << "Commands:" << std::endl
+              << "  tail [level=N] [match=exact|cumulative] [file=GLOB] [source=GLOB]" << std::endl
+              << "      print matching records as the server receives them" << std::endl
+              << "  set-level LEVEL [all|name=GLOB|group=GLOB|addr=IP:PORT] [wait=MS]" << std::endl
+              << "      make the selected clients log at LEVEL (0-3), now and whenever they reconnect," << std::endl
+              << "      and wait up to MS (default 1000, at most 60000) for each to confirm" << std::endl
+              << "  dump [level=N] [match=exact|cumulative] [minutes=N] [contains=TEXT]" << std::endl
+              << "      print the matching records of the log" << std::endl
+              << "  clients" << std::endl
+              << "      list the clients heard from lately" << std::endl
+              << "  stats" << std::endl
+              << "      show the records lost, reordered and duplicated per client" << std::endl
+              << "  count [window=SECONDS] [file=NAME|site=FILE:LINE|source=ADDR] [by=file|site|source] [histogram]" << std::endl
+              << "      count the records received per level over the last SECONDS (default 300, 0 = all)" << std::endl
+              << "  search [limit=N] WORD..." << std::endl
+              << "      show the newest N (default 100) records containing all the words" << std::endl
+              << "  rotate" << std::endl
+              << "      start new log segments" << std::endl
+              << "  shutdown" << std::endl
+              << "      stop a server started with --daemon" << std::endl;
+}
+
+int connect_control(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect to LogServer failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one command line and copies everything the server answers to stdout
+// until it closes the connection
+int run_command(const std::string& path, const std::string& command) {
+    int fd = connect_control(path);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+    std::string line = command + "\n";
+    if (write(fd, line.c_str(), line.length()) != (ssize_t)line.length()) {
+        perror("write failed");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    char buf[65536];
+    ssize_t n;
+    bool first = true;
+    int status = EXIT_SUCCESS;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        // The first line is the server's OK or ERR
+        if (first && n >= 3 && strncmp(buf, "ERR", 3) == 0) {
+            status = EXIT_FAILURE;
+        }
+        first = false;
+        if (write(STDOUT_FILENO, buf, n) < 0) {
+            break;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = DEFAULT_SOCKET;
+    int arg = 1;
+    if (arg < argc && strncmp(argv[arg], "--socket=", 9) == 0) {
+        path = argv[arg] + 9;
+        ++arg;
+    }
+    if (arg >= argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::string command = argv[arg++];
+    std::string args;
+    for (; arg < argc; ++arg) {
+        args += std::string(" ") + argv[arg];
+    }
+
+    if (command == "tail") {
+        return run_command(path, "SUBSCRIBE" + args);
+    }
+    if (command == "set-level" && !args.empty()) {
+        return run_command(path, "SETLEVEL" + args);
+    }
+    if (command == "dump") {
+        return run_command(path, "DUMP" + args);
+    }
+    if (command == "rotate") {
+        return run_command(path, "ROTATE");
+    }
+    if (command == "shutdown") {
+        return run_command(path, "SHUTDOWN");
+    }
+    if (command == "clients") {
+        return run_command(path, "CLIENTS");
+    }
+    if (command == "stats") {
+        return run_command(path, "STATS");
+    }
+    if (command == "search" && !args.empty()) {
+        return run_command(path, "SEARCH" + args);
+    }
+    if (command == "count") {
+        return run_command(path, "COUNT" + args);
+    }
+    usage(argv[0]);
+    return EXIT_FAILURE;
+}
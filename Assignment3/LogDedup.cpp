@@ -0,0 +1,144 @@
+//LogDedup.cpp - Suppression of repeated log messages in the Logger
+
+#include "LogDedup.h"
+#include <cstring>
+
+const int MAX_PROBES = 8;
+
+// Entry::state: the generation of the window in the high 32 bits, then the
+// closed flag and the repeats counted in the window
+const uint64_t CLOSED = 1ULL << 31;
+const uint64_t REPEATS_MASK = CLOSED - 1;
+const int GENERATION_SHIFT = 32;
+const size_t SUMMARY_MESSAGE_LEN = 1024;    // of the repeated message kept for the summary; all
+                                            // of it, so captured LOGF arguments stay whole
+
+LogDedup::LogDedup(size_t capacity, int window_ms) : window_ns(static_cast<uint64_t>(window_ms) * 1000000ULL) {
+    size_t size = 16;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    std::vector<Entry> new_entries(size);
+    entries.swap(new_entries);
+    windows.resize(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        entries[i].key.store(0, std::memory_order_relaxed);
+        entries[i].state.store(CLOSED, std::memory_order_relaxed);
+    }
+}
+
+static uint64_t mix(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+// Hashes the text eight bytes at a time, mixed with the site so equal text
+// at different call sites is kept apart
+uint64_t LogDedup::Key(int site_id, const char* file, int line, const char* message, size_t len) {
+    uint64_t hash = mix(static_cast<uint64_t>(site_id) << 32 | static_cast<uint32_t>(line),
+                        reinterpret_cast<uintptr_t>(file));
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, message + i, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t rest = 0;
+    memcpy(&rest, message + i, len - i);
+    hash = mix(hash, rest ^ static_cast<uint64_t>(len) << 56);
+    return hash == 0 ? 1 : hash;
+}
+
+// Every probe position is looked at, free or not, so that a window can be
+// closed without breaking the probe sequence of another
+LogDedup::Entry* LogDedup::find(uint64_t key) {
+    for (int i = 0; i < MAX_PROBES; ++i) {
+        Entry& entry = entries[(key + i) & mask];
+        if (entry.key.load(std::memory_order_acquire) == key) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+bool LogDedup::Repeat(uint64_t key) {
+    Entry* entry = find(key);
+    if (entry == nullptr) {
+        return false;
+    }
+    // Open stores the key before the state that opens the window, so a key
+    // read after an open state belongs to that window
+    uint64_t state = entry->state.load(std::memory_order_acquire);
+    if ((state & CLOSED) || entry->key.load(std::memory_order_acquire) != key) {
+        return false;
+    }
+    uint64_t generation = state >> GENERATION_SHIFT;
+    while (!entry->state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel)) {
+        // Closed, or even reopened, since: the caller goes through Open
+        if ((state & CLOSED) || (state >> GENERATION_SHIFT) != generation) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LogDedup::Open(uint64_t key, int level, int site_id, const char* file, const char* function, int line,
+                    const char* message, size_t len, uint64_t now_ns) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry* entry = find(key);
+    if (entry != nullptr) {
+        entry->state.fetch_add(1, std::memory_order_acq_rel);
+        return false;
+    }
+    for (int i = 0; i < MAX_PROBES; ++i) {
+        size_t index = (key + i) & mask;
+        if (entries[index].key.load(std::memory_order_relaxed) != 0) {
+            continue;
+        }
+        Window& window = windows[index];
+        window.end_ns = now_ns + window_ns;
+        window.level = level;
+        window.site_id = site_id;
+        window.file = file;
+        window.function = function;
+        window.line = line;
+        window.message.assign(message, len < SUMMARY_MESSAGE_LEN ? len : SUMMARY_MESSAGE_LEN);
+        uint64_t generation = (entries[index].state.load(std::memory_order_relaxed) >> GENERATION_SHIFT) + 1;
+        entries[index].key.store(key, std::memory_order_relaxed);
+        entries[index].state.store(generation << GENERATION_SHIFT, std::memory_order_release);
+        return true;
+    }
+    return true;
+}
+
+std::vector<LogDedup::Summary> LogDedup::Expire(uint64_t now_ns) {
+    std::vector<Summary> summaries;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        Window& window = windows[i];
+        if (entries[i].key.load(std::memory_order_relaxed) == 0 || window.end_ns > now_ns) {
+            continue;
+        }
+        // Quiet for a whole window: the next occurrence is sent again. A
+        // repeat counted meanwhile makes the exchange fail and is summarised.
+        uint64_t state = entries[i].state.load(std::memory_order_acquire);
+        if ((state & REPEATS_MASK) == 0 &&
+            entries[i].state.compare_exchange_strong(state, state | CLOSED, std::memory_order_acq_rel)) {
+            entries[i].key.store(0, std::memory_order_release);
+            continue;
+        }
+        uint32_t repeats = entries[i].state.fetch_and(~REPEATS_MASK, std::memory_order_acq_rel) & REPEATS_MASK;
+        Summary summary;
+        summary.level = window.level;
+        summary.site_id = window.site_id;
+        summary.file = window.file;
+        summary.function = window.function;
+        summary.line = window.line;
+        summary.repeats = repeats;
+        summary.message = window.message;
+        summaries.push_back(summary);
+        window.end_ns = now_ns + window_ns;
+    }
+    return summaries;
+}
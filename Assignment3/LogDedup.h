@@ -0,0 +1,83 @@
+//LogDedup.h - Suppression of repeated log messages in the Logger
+//
+// A message is identified by its call site and a hash of its text. The first
+// occurrence is sent and opens a window; repeats inside the window are only
+// counted. When the window closes one summary record ("last message repeated
+// N times") goes out instead of the repeats, and if there were any a new
+// window opens right away, so a message repeated forever costs one record per
+// window.
+//
+// Looking a message up and counting a repeat only touches atomics. Opening a
+// window and closing windows, which happen once per window, take a mutex.
+// A repeat is counted with a compare-and-swap on a word that also holds the
+// window's generation, so it lands in the window it was looked up in or, if
+// that closed meanwhile, goes through Open like a new message.
+//
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class LogDedup {
+    public:
+        // A closed window with repeats, to be sent as a summary record
+        struct Summary {
+            int level;
+            int site_id;            // 0 for messages logged without a site
+            const char* file;
+            const char* function;
+            int line;
+            uint32_t repeats;
+            std::string message;    // the repeated text, or the arguments of a LOGF site
+        };
+
+    private:
+        // The atomics of a probe sequence share a cache line or two; the
+        // rest of a slot is only read when a window opens or closes
+        struct Entry {
+            std::atomic<uint64_t> key;      // 0 = free
+            std::atomic<uint64_t> state;    // window generation, closed flag and repeats
+        };
+        struct Window {
+            uint64_t end_ns;
+            int level;
+            int site_id;
+            const char* file;
+            const char* function;
+            int line;
+            std::string message;
+        };
+
+        std::vector<Entry> entries;
+        std::vector<Window> windows;        // guarded by mutex
+        size_t mask;
+        uint64_t window_ns;
+        std::mutex mutex;
+
+        Entry* find(uint64_t key);
+
+    public:
+        // capacity is rounded up to a power of two
+        LogDedup(size_t capacity, int window_ms);
+
+        // Hash of a message at a call site
+        static uint64_t Key(int site_id, const char* file, int line, const char* message, size_t len);
+
+        // Counts a repeat and returns true if key has an open window
+        bool Repeat(uint64_t key);
+
+        // Opens a window for a message Repeat() did not know. Returns false
+        // if another thread opened it first, which counts as a repeat, and
+        // true if the message must be sent. A full table lets every message
+        // through.
+        bool Open(uint64_t key, int level, int site_id, const char* file, const char* function, int line,
+                  const char* message, size_t len, uint64_t now_ns);
+
+        // Closes the windows that ended by now_ns and returns those that had
+        // repeats
+        std::vector<Summary> Expire(uint64_t now_ns);
+};
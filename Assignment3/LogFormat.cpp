@@ -0,0 +1,125 @@
+//LogFormat.cpp - Allocation-free formatting of log lines
+
+#include "LogFormat.h"
+#include <cstring>
+
+const int TIME_TEXT_LEN = 19; // strlen("YYYY-MM-DD HH:MM:SS")
+
+// Per-thread cache of the last rendered second
+struct TimeCache {
+    time_t seconds;
+    char text[TIME_TEXT_LEN + 1];
+};
+static thread_local TimeCache time_cache = { -1, "" };
+
+const char* LogLevelName(int level) {
+    switch (level) {
+        case 0: return "DEBUG";
+        case 1: return "WARNING";
+        case 2: return "ERROR";
+        case 3: return "CRITICAL";
+    }
+    return "UNKNOWN";
+}
+
+const char* FormatLogTime(time_t seconds) {
+    if (seconds != time_cache.seconds) {
+        struct tm tm_now;
+        localtime_r(&seconds, &tm_now);
+        strftime(time_cache.text, sizeof(time_cache.text), "%Y-%m-%d %H:%M:%S", &tm_now);
+        time_cache.seconds = seconds;
+    }
+    return time_cache.text;
+}
+
+// Appends src to out at pos, never writing past out_len - 1
+static size_t append(char* out, size_t out_len, size_t pos, const char* src, size_t len) {
+    if (pos + len >= out_len) {
+        len = out_len - 1 - pos;
+    }
+    memcpy(out + pos, src, len);
+    return pos + len;
+}
+
+static size_t append_str(char* out, size_t out_len, size_t pos, const char* src) {
+    return append(out, out_len, pos, src, src ? strlen(src) : 0);
+}
+
+// Appends src with line breaks written as "\n" and "\r", so whatever a
+// client sends stays on its record's line
+static size_t append_escaped(char* out, size_t out_len, size_t pos, const char* src, size_t len) {
+    while (len > 0) {
+        const char* brk = static_cast<const char*>(memchr(src, '\n', len));
+        const char* ret = static_cast<const char*>(memchr(src, '\r', brk != nullptr ? brk - src : len));
+        if (ret != nullptr) {
+            brk = ret;
+        }
+        if (brk == nullptr) {
+            return append(out, out_len, pos, src, len);
+        }
+        pos = append(out, out_len, pos, src, brk - src);
+        pos = append(out, out_len, pos, *brk == '\n' ? "\\n" : "\\r", 2);
+        len -= brk - src + 1;
+        src = brk + 1;
+    }
+    return pos;
+}
+
+static size_t append_escaped_str(char* out, size_t out_len, size_t pos, const char* src) {
+    return append_escaped(out, out_len, pos, src, src ? strlen(src) : 0);
+}
+
+static size_t append_int(char* out, size_t out_len, size_t pos, int value) {
+    char digits[12];
+    int n = sizeof(digits);
+    unsigned int v = value < 0 ? -static_cast<unsigned int>(value) : value;
+    do {
+        digits[--n] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    if (value < 0) {
+        digits[--n] = '-';
+    }
+    return append(out, out_len, pos, digits + n, sizeof(digits) - n);
+}
+
+size_t FormatLogLine(char* out, size_t out_len, time_t seconds, int level,
+                     const char* file, const char* function, int line,
+                     const char* message, size_t message_len) {
+    if (out_len == 0) {
+        return 0;
+    }
+    while (message_len > 0 && (message[message_len - 1] == '\n' || message[message_len - 1] == '\r')) {
+        --message_len;
+    }
+    size_t pos = 0;
+    pos = append(out, out_len, pos, FormatLogTime(seconds), TIME_TEXT_LEN);
+    pos = append(out, out_len, pos, " ", 1);
+    pos = append_str(out, out_len, pos, LogLevelName(level));
+    pos = append(out, out_len, pos, " ", 1);
+    pos = append_escaped_str(out, out_len, pos, file);
+    pos = append(out, out_len, pos, ":", 1);
+    pos = append_escaped_str(out, out_len, pos, function);
+    pos = append(out, out_len, pos, ":", 1);
+    pos = append_int(out, out_len, pos, line);
+    pos = append(out, out_len, pos, " ", 1);
+    pos = append_escaped(out, out_len, pos, message, message_len);
+    out[pos] = '\0';
+    return pos;
+}
+
+int ParseLogLevel(const char* line, size_t len) {
+    const size_t level_pos = TIME_TEXT_LEN + 1;
+    if (len <= level_pos || line[TIME_TEXT_LEN] != ' ') {
+        return -1;
+    }
+    for (int level = 0; level <= 3; ++level) {
+        const char* name = LogLevelName(level);
+        size_t name_len = strlen(name);
+        if (len > level_pos + name_len && memcmp(line + level_pos, name, name_len) == 0 &&
+            line[level_pos + name_len] == ' ') {
+            return level;
+        }
+    }
+    return -1;
+}
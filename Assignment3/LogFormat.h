@@ -0,0 +1,27 @@
+//LogFormat.h - Allocation-free formatting of log lines
+//
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+
+// Returns the printable name of a log level ("DEBUG", "WARNING", ...)
+const char* LogLevelName(int level);
+
+// Returns "YYYY-MM-DD HH:MM:SS" for the given second. The text is cached per
+// thread and only re-rendered when the second changes.
+const char* FormatLogTime(time_t seconds);
+
+// Renders "<time> <LEVEL> <file>:<function>:<line> <message>" into out without
+// touching the heap. Trailing newlines of the message are dropped and any
+// other line break in the message, file or function is written as "\n" or
+// "\r", so every record stays on one line. The result is always NUL
+// terminated and truncated to fit. Returns the number of characters written,
+// excluding the terminator.
+size_t FormatLogLine(char* out, size_t out_len, time_t seconds, int level,
+                     const char* file, const char* function, int line,
+                     const char* message, size_t message_len);
+
+// Returns the level of a line rendered by FormatLogLine by reading the level
+// column right after the timestamp, or -1 if the line is not a log record
+int ParseLogLevel(const char* line, size_t len);
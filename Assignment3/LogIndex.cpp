@@ -0,0 +1,102 @@
+//LogIndex.cpp - Sparse sidecar index over a log segment
+
+#include "LogIndex.h"
+#include <cstring>
+#include <cerrno>
+#include <endian.h>
+#include <unistd.h>
+
+LogIndex::LogIndex(uint32_t _records_per_block)
+    : records_per_block(_records_per_block ? _records_per_block : 1), persisted(0) {
+}
+
+void LogIndex::Add(uint64_t offset, int level, uint64_t timestamp_ns) {
+    if (blocks.empty() || blocks.back().records >= records_per_block) {
+        LogIndexBlock block;
+        block.offset = offset;
+        block.min_timestamp_ns = timestamp_ns;
+        block.max_timestamp_ns = timestamp_ns;
+        block.records = 0;
+        block.level_mask = 0;
+        blocks.push_back(block);
+    }
+    LogIndexBlock& block = blocks.back();
+    if (timestamp_ns < block.min_timestamp_ns) {
+        block.min_timestamp_ns = timestamp_ns;
+    }
+    if (timestamp_ns > block.max_timestamp_ns) {
+        block.max_timestamp_ns = timestamp_ns;
+    }
+    block.level_mask |= 1u << level;
+    block.records++;
+}
+
+void LogIndex::Reset() {
+    blocks.clear();
+    persisted = 0;
+}
+
+const std::vector<LogIndexBlock>& LogIndex::Blocks() const {
+    return blocks;
+}
+
+void LogIndex::TakeUnpersisted(std::vector<char>& out, bool final) {
+    size_t end = blocks.size();
+    if (!final && end > 0 && blocks.back().records < records_per_block) {
+        --end;
+    }
+    for (; persisted < end; ++persisted) {
+        const LogIndexBlock& block = blocks[persisted];
+        uint64_t words[3] = { htole64(block.offset), htole64(block.min_timestamp_ns), htole64(block.max_timestamp_ns) };
+        uint32_t counts[2] = { htole32(block.records), htole32(block.level_mask) };
+        char entry[LOG_INDEX_ENTRY_LEN];
+        memcpy(entry, words, sizeof(words));
+        memcpy(entry + sizeof(words), counts, sizeof(counts));
+        out.insert(out.end(), entry, entry + sizeof(entry));
+    }
+}
+
+bool ReadLogIndex(int fd, std::vector<LogIndexBlock>& blocks) {
+    std::vector<char> data;
+    char buf[64 * LOG_INDEX_ENTRY_LEN];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        data.insert(data.end(), buf, buf + n);
+    }
+    blocks.clear();
+    for (size_t at = 0; at + LOG_INDEX_ENTRY_LEN <= data.size(); at += LOG_INDEX_ENTRY_LEN) {
+        uint64_t words[3];
+        uint32_t counts[2];
+        memcpy(words, data.data() + at, sizeof(words));
+        memcpy(counts, data.data() + at + sizeof(words), sizeof(counts));
+        LogIndexBlock block;
+        block.offset = le64toh(words[0]);
+        block.min_timestamp_ns = le64toh(words[1]);
+        block.max_timestamp_ns = le64toh(words[2]);
+        block.records = le32toh(counts[0]);
+        block.level_mask = le32toh(counts[1]);
+        blocks.push_back(block);
+    }
+    return true;
+}
+
+uint32_t LogLevelMask(int level, bool exact_match) {
+    if (exact_match) {
+        return 1u << level;
+    }
+    return ~((1u << level) - 1);
+}
+
+bool LogIndexBlockMatches(const LogIndexBlock& block, uint32_t level_mask, uint64_t min_ns, uint64_t max_ns) {
+    return (block.level_mask & level_mask) != 0 &&
+           block.max_timestamp_ns >= min_ns && block.min_timestamp_ns <= max_ns;
+}
@@ -0,0 +1,59 @@
+//LogIndex.h - Sparse sidecar index over a log segment
+//
+// Records are grouped into blocks of a fixed number of lines. For every block
+// the index keeps the file offset of its first line, the smallest and largest
+// record timestamp and a bitmap of the levels it contains, so a filtered dump
+// only has to read the blocks that can match.
+//
+// The sidecar (<log file>.idx) holds one 32 byte little-endian entry per
+// block: offset, min timestamp, max timestamp (8 bytes each), record count
+// and level mask (4 bytes each).
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct LogIndexBlock {
+    uint64_t offset;            // file offset of the first record in the block
+    uint64_t min_timestamp_ns;
+    uint64_t max_timestamp_ns;
+    uint32_t records;
+    uint32_t level_mask;        // bit n is set if the block holds a record of level n
+};
+
+const size_t LOG_INDEX_ENTRY_LEN = 32;
+
+class LogIndex {
+    private:
+        uint32_t records_per_block;
+        std::vector<LogIndexBlock> blocks;
+        size_t persisted;       // blocks already written to the sidecar
+
+    public:
+        explicit LogIndex(uint32_t _records_per_block);
+
+        // Accounts for one record starting at offset
+        void Add(uint64_t offset, int level, uint64_t timestamp_ns);
+
+        // Forgets all blocks, used when a new segment starts
+        void Reset();
+
+        const std::vector<LogIndexBlock>& Blocks() const;
+
+        // Encodes the blocks that have not been persisted yet, including the
+        // last one only if it is complete or final is set
+        void TakeUnpersisted(std::vector<char>& out, bool final);
+};
+
+// Reads the sidecar open on fd into blocks. A torn last entry is left out.
+// Returns false if the file cannot be read.
+bool ReadLogIndex(int fd, std::vector<LogIndexBlock>& blocks);
+
+// Bit mask of the levels a dump wants: just level, or level and above
+uint32_t LogLevelMask(int level, bool exact_match);
+
+// True if the block may hold a record of a level in level_mask whose
+// timestamp lies within [min_ns, max_ns]
+bool LogIndexBlockMatches(const LogIndexBlock& block, uint32_t level_mask, uint64_t min_ns, uint64_t max_ns);
@@ -0,0 +1,147 @@
+//LogMerger.cpp - Time-ordered merge of the lines rendered by receiver shards
+
+#include "LogMerger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+const int MAX_HOLD_ROUNDS = 8;
+const int MIN_MERGE_INTERVAL_MS = 5;
+
+namespace {
+// A staged line wherever its text currently lives
+struct MergeRef {
+    uint64_t timestamp_ns;
+    const char* line;
+    uint32_t len;
+    int level;
+    int rounds;
+
+    bool operator<(const MergeRef& other) const {
+        return timestamp_ns < other.timestamp_ns;
+    }
+};
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+LogMerger::LogMerger(LogWriter* _writer, size_t shards, int _delay_ms)
+    : writer(_writer), delay_ms(_delay_ms), taken_text(shards), taken(shards), running(false) {
+    for (size_t i = 0; i < shards; ++i) {
+        stages.push_back(new Stage());
+    }
+}
+
+LogMerger::~LogMerger() {
+    Stop();
+    for (size_t i = 0; i < stages.size(); ++i) {
+        delete stages[i];
+    }
+}
+
+void LogMerger::Start() {
+    running = true;
+    merge_thread = std::thread(&LogMerger::merge_loop, this);
+}
+
+void LogMerger::Stop() {
+    if (running) {
+        {
+            std::lock_guard<std::mutex> lock(timer_mutex);
+            running = false;
+        }
+        timer_cv.notify_one();
+    }
+    if (merge_thread.joinable()) {
+        merge_thread.join();
+    }
+    merge(true);
+}
+
+void LogMerger::Append(size_t shard, const char* line, size_t len, int level, uint64_t timestamp_ns) {
+    Stage* stage = stages[shard];
+    std::lock_guard<std::mutex> lock(stage->mutex);
+    Entry entry;
+    entry.timestamp_ns = timestamp_ns;
+    entry.offset = stage->text.size();
+    entry.len = len;
+    entry.level = level;
+    entry.rounds = 0;
+    stage->text.insert(stage->text.end(), line, line + len);
+    stage->entries.push_back(entry);
+}
+
+void LogMerger::Flush() {
+    merge(true);
+}
+
+// Thread function merging the stages every half delay
+void LogMerger::merge_loop() {
+    int interval_ms = std::max(delay_ms / 2, MIN_MERGE_INTERVAL_MS);
+    while (running) {
+        {
+            std::unique_lock<std::mutex> lock(timer_mutex);
+            timer_cv.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return !running; });
+        }
+        merge(false);
+    }
+}
+
+// Sorts the held lines and everything staged since the last round by
+// timestamp and writes out those that are old enough, or all of them
+void LogMerger::merge(bool all) {
+    std::lock_guard<std::mutex> merge_lock(merge_mutex);
+    for (size_t i = 0; i < stages.size(); ++i) {
+        std::lock_guard<std::mutex> lock(stages[i]->mutex);
+        taken_text[i].swap(stages[i]->text);
+        taken[i].swap(stages[i]->entries);
+    }
+
+    std::vector<MergeRef> refs;
+    refs.reserve(held.size());
+    for (size_t i = 0; i < held.size(); ++i) {
+        MergeRef ref = { held[i].timestamp_ns, &held_text[held[i].offset], held[i].len, held[i].level, held[i].rounds };
+        refs.push_back(ref);
+    }
+    for (size_t s = 0; s < taken.size(); ++s) {
+        for (size_t i = 0; i < taken[s].size(); ++i) {
+            const Entry& entry = taken[s][i];
+            MergeRef ref = { entry.timestamp_ns, &taken_text[s][entry.offset], entry.len, entry.level, 0 };
+            refs.push_back(ref);
+        }
+    }
+    // Lines from one client are already in order, keep it that way for ties
+    std::stable_sort(refs.begin(), refs.end());
+
+    uint64_t watermark = now_ns() - static_cast<uint64_t>(delay_ms) * 1000000ULL;
+    std::vector<char> next_text;
+    std::vector<Entry> next_held;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        const MergeRef& ref = refs[i];
+        if (all || ref.timestamp_ns <= watermark || ref.rounds >= MAX_HOLD_ROUNDS) {
+            writer->Append(ref.line, ref.len, ref.level, ref.timestamp_ns);
+            continue;
+        }
+        Entry entry;
+        entry.timestamp_ns = ref.timestamp_ns;
+        entry.offset = next_text.size();
+        entry.len = ref.len;
+        entry.level = ref.level;
+        entry.rounds = ref.rounds + 1;
+        next_text.insert(next_text.end(), ref.line, ref.line + ref.len);
+        next_held.push_back(entry);
+    }
+    held_text.swap(next_text);
+    held.swap(next_held);
+
+    // Keep the capacity for the next round
+    for (size_t s = 0; s < taken.size(); ++s) {
+        taken_text[s].clear();
+        taken[s].clear();
+    }
+}
@@ -0,0 +1,69 @@
+//LogMerger.h - Time-ordered merge of the lines rendered by receiver shards
+//
+// Every shard appends to its own staging buffer, so shards never contend
+// with each other. The merge thread swaps the buffers out every half merge
+// delay, sorts what it collected by record timestamp and passes the lines
+// older than the delay to the LogWriter. Younger lines are held back for the
+// next round so that records arriving on different shards at about the same
+// time still come out in order. A line is never held for more than a few
+// rounds, so a client with a clock running ahead cannot stall the log.
+//
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include "LogWriter.h"
+
+class LogMerger {
+    private:
+        struct Entry {
+            uint64_t timestamp_ns;
+            uint32_t offset;        // into the text buffer the entry came with
+            uint32_t len;
+            int level;
+            int rounds;             // merge rounds the entry has been held back
+        };
+        struct Stage {
+            std::mutex mutex;
+            std::vector<char> text;
+            std::vector<Entry> entries;
+        };
+
+        LogWriter* writer;
+        int delay_ms;
+        std::vector<Stage*> stages;
+
+        // Owned by whoever holds merge_mutex
+        std::mutex merge_mutex;
+        std::vector<char> held_text;
+        std::vector<Entry> held;
+        std::vector<std::vector<char> > taken_text;
+        std::vector<std::vector<Entry> > taken;
+
+        std::mutex timer_mutex;
+        std::condition_variable timer_cv;
+        std::atomic<bool> running;
+        std::thread merge_thread;
+
+        void merge_loop();
+        void merge(bool all);
+
+    public:
+        LogMerger(LogWriter* _writer, size_t shards, int _delay_ms);
+        ~LogMerger();
+
+        void Start();
+
+        // Stops the merge thread and writes out everything still staged
+        void Stop();
+
+        // Stages one line from shard; the newline is added by the writer
+        void Append(size_t shard, const char* line, size_t len, int level, uint64_t timestamp_ns);
+
+        // Passes every staged line to the writer now, regardless of the delay
+        void Flush();
+};
@@ -0,0 +1,115 @@
+//LogQueue.cpp - Bounded queue of encoded log records
+//
+// Each slot carries a sequence number telling whose turn it is: a producer
+// may claim slot i when its sequence equals the enqueue position, and the
+// consumer may read it once the producer has published position + 1.
+//
+
+#include "LogQueue.h"
+#include <cstring>
+
+LogQueue::LogQueue(size_t capacity) : enqueue_pos(0), dequeue_pos(0) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    std::vector<Slot> new_slots(size);
+    slots.swap(new_slots);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool LogQueue::Push(const char* record, size_t len) {
+    if (len > LOG_RECORD_MAX_LEN) {
+        return false;
+    }
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots[pos & mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    slot->len = static_cast<uint16_t>(len);
+    memcpy(slot->data, record, len);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// Slots are freed in order, so once the last of the count slots is free for
+// this round all of them are
+bool LogQueue::PushAll(const char* data, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    if (count > mask + 1) {
+        return false;
+    }
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        size_t last = pos + count - 1;
+        size_t seq = slots[last & mask].sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(last);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        Slot& slot = slots[(pos + i) & mask];
+        size_t len = PeekLogRecordLength(data, LOG_RECORD_MAX_LEN);
+        slot.len = static_cast<uint16_t>(len);
+        memcpy(slot.data, data, len);
+        slot.sequence.store(pos + i + 1, std::memory_order_release);
+        data += len;
+    }
+    return true;
+}
+
+const char* LogQueue::Front(size_t& len) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Slot& slot = slots[pos & mask];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return nullptr;
+    }
+    len = slot.len;
+    return slot.data;
+}
+
+void LogQueue::PopFront() {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    slots[pos & mask].sequence.store(pos + mask + 1, std::memory_order_release);
+    dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+}
+
+const char* LogQueue::Peek(size_t index, size_t& len) const {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed) + index;
+    const Slot& slot = slots[pos & mask];
+    if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return nullptr;
+    }
+    len = slot.len;
+    return slot.data;
+}
+
+size_t LogQueue::Size() const {
+    size_t head = dequeue_pos.load(std::memory_order_relaxed);
+    size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,51 @@
+//LogQueue.h - Bounded queue of encoded log records
+//
+// Any number of threads may push, a single thread (the Logger backend)
+// consumes. Each slot holds one record of up to LOG_RECORD_MAX_LEN bytes, so
+// pushing is one atomic claim plus a memcpy and never allocates.
+//
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "LogRecord.h"
+
+class LogQueue {
+    private:
+        struct Slot {
+            std::atomic<size_t> sequence;
+            uint16_t len;
+            char data[LOG_RECORD_MAX_LEN];
+        };
+        std::vector<Slot> slots;
+        size_t mask;
+        std::atomic<size_t> enqueue_pos;
+        std::atomic<size_t> dequeue_pos;
+
+    public:
+        // capacity is rounded up to a power of two
+        explicit LogQueue(size_t capacity);
+
+        // Copies one encoded record into the queue. Returns false if it is full.
+        bool Push(const char* record, size_t len);
+
+        // Copies count encoded records, stored back to back in data, into
+        // consecutive slots claimed at once. Returns false, having copied
+        // none of them, if there is no room for all.
+        bool PushAll(const char* data, size_t count);
+
+        // Consumer side: returns the oldest record without removing it, or
+        // nullptr if the queue is empty
+        const char* Front(size_t& len);
+        void PopFront();
+
+        // The record index places behind the oldest, left in the queue, or
+        // nullptr past the last one published. Only reads memory, so a
+        // signal handler may call it while the threads it interrupted carry
+        // on.
+        const char* Peek(size_t index, size_t& len) const;
+
+        size_t Size() const;
+};
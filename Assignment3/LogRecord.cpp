@@ -0,0 +1,157 @@
+//LogRecord.cpp - Binary log record exchanged between Logger and LogServer
+
+#include "LogRecord.h"
+#include <cstring>
+#include <endian.h>
+
+size_t EncodeLogRecord(char* out, size_t out_len, const LogRecordHeader& hdr, const char* payload, size_t len) {
+    if (out_len < LOG_RECORD_HEADER_LEN) {
+        return 0;
+    }
+    if (len > out_len - LOG_RECORD_HEADER_LEN) {
+        len = out_len - LOG_RECORD_HEADER_LEN;
+    }
+    if (len > UINT16_MAX) {
+        len = UINT16_MAX;
+    }
+
+    uint16_t payload_len = htole16(static_cast<uint16_t>(len));
+    uint16_t weight = htole16(hdr.weight);
+    uint32_t site_id = htole32(hdr.site_id);
+    uint32_t sequence = htole32(hdr.sequence);
+    uint64_t timestamp_ns = htole64(hdr.timestamp_ns);
+    uint32_t session_id = htole32(hdr.session_id);
+
+    out[0] = LOG_RECORD_VERSION;
+    out[1] = hdr.type;
+    out[2] = hdr.level;
+    out[3] = hdr.flags;
+    memcpy(out + 4, &payload_len, 2);
+    memcpy(out + 6, &weight, 2);
+    memcpy(out + 8, &site_id, 4);
+    memcpy(out + 12, &sequence, 4);
+    memcpy(out + 16, &timestamp_ns, 8);
+    memcpy(out + 24, &session_id, 4);
+    memcpy(out + LOG_RECORD_HEADER_LEN, payload, len);
+    return LOG_RECORD_HEADER_LEN + len;
+}
+
+size_t PeekLogRecordLength(const char* data, size_t len) {
+    if (len < LOG_RECORD_V1_HEADER_LEN) {
+        return 0;
+    }
+    uint8_t version = data[0];
+    if (version != LOG_RECORD_VERSION && version != 1) {
+        return SIZE_MAX;
+    }
+    uint16_t payload_len;
+    memcpy(&payload_len, data + 4, 2);
+    size_t header_len = version == LOG_RECORD_VERSION ? LOG_RECORD_HEADER_LEN : LOG_RECORD_V1_HEADER_LEN;
+    if (le16toh(payload_len) > LOG_RECORD_MAX_LEN - header_len) {
+        return SIZE_MAX;
+    }
+    return header_len + le16toh(payload_len);
+}
+
+size_t DecodeLogRecord(const char* data, size_t len, LogRecordHeader& hdr, const char*& payload) {
+    if (len < LOG_RECORD_V1_HEADER_LEN) {
+        return 0;
+    }
+    size_t header_len;
+    uint8_t version = data[0];
+    if (version == LOG_RECORD_VERSION) {
+        header_len = LOG_RECORD_HEADER_LEN;
+    } else if (version == 1) {
+        header_len = LOG_RECORD_V1_HEADER_LEN;
+    } else {
+        return 0;
+    }
+    if (len < header_len) {
+        return 0;
+    }
+
+    uint16_t payload_len;
+    memcpy(&payload_len, data + 4, 2);
+    memcpy(&hdr.weight, data + 6, 2);
+    memcpy(&hdr.site_id, data + 8, 4);
+    memcpy(&hdr.sequence, data + 12, 4);
+    memcpy(&hdr.timestamp_ns, data + 16, 8);
+    hdr.version = data[0];
+    hdr.type = data[1];
+    hdr.level = data[2];
+    hdr.flags = data[3];
+    hdr.payload_len = le16toh(payload_len);
+    hdr.weight = le16toh(hdr.weight);
+    hdr.site_id = le32toh(hdr.site_id);
+    hdr.sequence = le32toh(hdr.sequence);
+    hdr.timestamp_ns = le64toh(hdr.timestamp_ns);
+    hdr.session_id = 0;
+    if (version == LOG_RECORD_VERSION) {
+        memcpy(&hdr.session_id, data + 24, 4);
+        hdr.session_id = le32toh(hdr.session_id);
+    }
+
+    if (hdr.level > CRITICAL || hdr.payload_len > LOG_RECORD_MAX_LEN - header_len ||
+        len - header_len < hdr.payload_len) {
+        return 0;
+    }
+    payload = data + header_len;
+    return header_len + hdr.payload_len;
+}
+
+size_t EncodeLogSite(char* out, size_t out_len, const char* file, const char* function, int line) {
+    size_t file_len = strlen(file) + 1;
+    size_t function_len = strlen(function) + 1;
+    if (out_len < 4 + file_len + function_len) {
+        return 0;
+    }
+    uint32_t line_le = htole32(static_cast<uint32_t>(line));
+    memcpy(out, &line_le, 4);
+    memcpy(out + 4, file, file_len);
+    memcpy(out + 4 + file_len, function, function_len);
+    return 4 + file_len + function_len;
+}
+
+size_t DecodeLogSite(const char* data, size_t len, const char*& file, const char*& function, int& line) {
+    if (len < 4) {
+        return 0;
+    }
+    const char* file_end = static_cast<const char*>(memchr(data + 4, '\0', len - 4));
+    if (file_end == nullptr) {
+        return 0;
+    }
+    const char* end = data + len;
+    const char* function_end = static_cast<const char*>(memchr(file_end + 1, '\0', end - file_end - 1));
+    if (function_end == nullptr) {
+        return 0;
+    }
+    uint32_t line_le;
+    memcpy(&line_le, data, 4);
+    line = static_cast<int>(le32toh(line_le));
+    file = data + 4;
+    function = file_end + 1;
+    return function_end + 1 - data;
+}
+
+size_t EncodeLogHello(char* out, size_t out_len, uint32_t pid, const char* name, const char* group) {
+    size_t name_len = strlen(name) + 1;
+    size_t group_len = strlen(group) + 1;
+    if (out_len < 4 + name_len + group_len) {
+        return 0;
+    }
+    uint32_t pid_le = htole32(pid);
+    memcpy(out, &pid_le, 4);
+    memcpy(out + 4, name, name_len);
+    memcpy(out + 4 + name_len, group, group_len);
+    return 4 + name_len + group_len;
+}
+
+size_t DecodeLogHello(const char* data, size_t len, uint32_t& pid, const char*& name, const char*& group) {
+    // Same layout as a call site with the process ID in place of the line
+    int value = 0;
+    size_t used = DecodeLogSite(data, len, name, group, value);
+    if (used > 0) {
+        pid = static_cast<uint32_t>(value);
+    }
+    return used;
+}
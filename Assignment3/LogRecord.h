@@ -0,0 +1,111 @@
+//LogRecord.h - Binary log record exchanged between Logger and LogServer
+//
+// Every record is a fixed 28 byte little-endian header followed by
+// payload_len bytes of payload:
+//
+//   offset  size  field
+//        0     1  version
+//        1     1  type (LOG_RECORD_TYPE)
+//        2     1  level (LOG_LEVEL)
+//        3     1  flags
+//        4     2  payload_len
+//        6     2  weight
+//        8     4  site_id
+//       12     4  sequence
+//       16     8  timestamp (nanoseconds since the epoch)
+//       24     4  session_id
+//
+// Records are self delimiting, so several of them may share one datagram, and
+// on stream transports they are simply sent back to back.
+// A Logger picks a random session ID when it starts and numbers its records
+// from 0 in that session, so the server can count what went missing.
+// A client that samples its records sends each kept one with the number of
+// records it stands for as its weight; 0 (what older clients send) and 1
+// both mean the record stands for itself.
+// Version 1 records lack the session ID and are still accepted as session 0.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// This is the new definition of the log levels.
+enum LOG_LEVEL { DEBUG, WARNING, ERROR, CRITICAL };
+
+enum LOG_RECORD_TYPE {
+    RECORD_ENTRY = 0,   // a log message; payload is the message text
+    RECORD_SITE = 1,    // defines site_id; payload is an encoded call site,
+                        // for a LOGF site followed by its NUL terminated
+                        // format string
+    RECORD_HELLO = 2,   // announces the client; level is its current log level,
+                        // payload is an encoded client identity
+    RECORD_ACK = 3,     // server to stream client: every record of session_id up
+                        // to and including sequence has been processed
+    RECORD_COMMAND = 4  // server to stream client; payload is the command text
+};
+
+// The payload of an ENTRY starts with an encoded call site instead of
+// referring to a site_id (used by the plain Log() entry point)
+const uint8_t RECORD_FLAG_INLINE_SITE = 0x01;
+
+// The record is not part of the session's numbering: stream clients resend
+// their identity and call sites this way after every reconnect
+const uint8_t RECORD_FLAG_UNSEQUENCED = 0x02;
+
+// The payload of an ENTRY holds the captured arguments (see LogArgs.h) for
+// the format string of its site, and the server formats the message
+const uint8_t RECORD_FLAG_DEFERRED = 0x04;
+
+const uint8_t LOG_RECORD_VERSION = 2;
+const size_t LOG_RECORD_HEADER_LEN = 28;
+const size_t LOG_RECORD_V1_HEADER_LEN = 24;
+const size_t LOG_RECORD_MAX_LEN = 1024;
+
+struct LogRecordHeader {
+    uint8_t version;
+    uint8_t type;
+    uint8_t level;
+    uint8_t flags;
+    uint16_t payload_len;
+    uint16_t weight;
+    uint32_t site_id;
+    uint32_t sequence;
+    uint64_t timestamp_ns;
+    uint32_t session_id;
+};
+
+// Number of records the client sampled away in place of which it sent this one
+inline uint32_t LogRecordSampledAway(const LogRecordHeader& hdr) {
+    return hdr.weight > 1 ? hdr.weight - 1 : 0;
+}
+
+// Writes header and payload into out, truncating the payload so the record
+// fits into out_len bytes. payload_len of hdr is ignored and set from len.
+// Returns the record length, or 0 if not even the header fits.
+size_t EncodeLogRecord(char* out, size_t out_len, const LogRecordHeader& hdr, const char* payload, size_t len);
+
+// Length of the record starting at data according to its header, 0 if fewer
+// bytes than a header are available yet, or SIZE_MAX if data cannot be the
+// start of a record (an unknown version, or longer than LOG_RECORD_MAX_LEN)
+size_t PeekLogRecordLength(const char* data, size_t len);
+
+// Decodes the record at the start of data. Returns the record length, or 0 if
+// data does not start with a complete record of a known version of at most
+// LOG_RECORD_MAX_LEN bytes.
+size_t DecodeLogRecord(const char* data, size_t len, LogRecordHeader& hdr, const char*& payload);
+
+// A call site is encoded as a 4 byte line number, the file name and the
+// function name, each name terminated by a NUL
+size_t EncodeLogSite(char* out, size_t out_len, const char* file, const char* function, int line);
+
+// Decodes the call site at the start of data. Returns the number of bytes it
+// occupies, or 0 if it is malformed.
+size_t DecodeLogSite(const char* data, size_t len, const char*& file, const char*& function, int& line);
+
+// A client identity is encoded as a 4 byte process ID, the program name and
+// the group name, each name terminated by a NUL
+size_t EncodeLogHello(char* out, size_t out_len, uint32_t pid, const char* name, const char* group);
+
+// Decodes the client identity at the start of data. Returns the number of
+// bytes it occupies, or 0 if it is malformed.
+size_t DecodeLogHello(const char* data, size_t len, uint32_t& pid, const char*& name, const char*& group);
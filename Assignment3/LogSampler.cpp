@@ -0,0 +1,110 @@
+//LogSampler.cpp - Sampling of DEBUG and WARNING records in the Logger
+
+#include "LogSampler.h"
+#include <ctime>
+#include <random>
+
+const uint64_t NS_PER_SEC = 1000000000ULL;
+const uint32_t MAX_WEIGHT = 65535;     // what the record header can carry
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * NS_PER_SEC + ts.tv_nsec;
+}
+
+// xorshift64*, one generator per thread so sampling never contends
+static uint64_t next_random() {
+    static thread_local uint64_t state = 0;
+    if (state == 0) {
+        state = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()() | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+LogSampler::LogSampler() : active(false) {
+    for (int i = 0; i < LOG_SAMPLED_LEVELS; ++i) {
+        levels[i].one_in.store(1);
+        levels[i].server_one_in.store(1);
+        levels[i].lease_end_ns.store(0);
+        levels[i].interval_ns.store(0);
+        levels[i].next_ns.store(0);
+        levels[i].held_weight.store(0);
+    }
+}
+
+void LogSampler::update_active() {
+    bool sampling = false;
+    for (int i = 0; i < LOG_SAMPLED_LEVELS; ++i) {
+        sampling = sampling || levels[i].one_in > 1 || levels[i].server_one_in > 1 || levels[i].interval_ns > 0;
+    }
+    active = sampling;
+}
+
+void LogSampler::Configure(int level, uint32_t one_in, uint32_t max_per_sec) {
+    if (level < 0 || level >= LOG_SAMPLED_LEVELS) {
+        return;
+    }
+    levels[level].one_in = one_in < 1 ? 1 : one_in > MAX_WEIGHT ? MAX_WEIGHT : one_in;
+    levels[level].interval_ns = max_per_sec > 0 ? NS_PER_SEC / max_per_sec : 0;
+    update_active();
+}
+
+void LogSampler::Throttle(int level, uint32_t one_in, uint32_t lease_ms) {
+    if (level < 0 || level >= LOG_SAMPLED_LEVELS) {
+        return;
+    }
+    levels[level].lease_end_ns = monotonic_ns() + static_cast<uint64_t>(lease_ms) * 1000000ULL;
+    levels[level].server_one_in = one_in < 1 ? 1 : one_in > MAX_WEIGHT ? MAX_WEIGHT : one_in;
+    update_active();
+}
+
+// Generic cell rate algorithm: every record moves next_ns on by one interval,
+// and a record that would move it more than a second ahead is turned away.
+// Its weight is held and added to the next record let through.
+uint32_t LogSampler::bucket(Level& state, uint32_t weight, uint64_t now) {
+    uint64_t interval = state.interval_ns.load(std::memory_order_relaxed);
+    uint64_t next = state.next_ns.load(std::memory_order_relaxed);
+    for (;;) {
+        uint64_t start = next > now ? next : now;
+        if (start + interval > now + NS_PER_SEC) {
+            state.held_weight.fetch_add(weight, std::memory_order_relaxed);
+            return 0;
+        }
+        if (state.next_ns.compare_exchange_weak(next, start + interval, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    uint32_t held = state.held_weight.exchange(0, std::memory_order_relaxed);
+    if (weight + held > MAX_WEIGHT) {
+        // Carried on to the next record
+        state.held_weight.fetch_add(weight + held - MAX_WEIGHT, std::memory_order_relaxed);
+        return MAX_WEIGHT;
+    }
+    return weight + held;
+}
+
+uint32_t LogSampler::sample(int level) {
+    Level& state = levels[level];
+    uint32_t one_in = state.one_in.load(std::memory_order_relaxed);
+    uint32_t server_one_in = state.server_one_in.load(std::memory_order_relaxed);
+    uint64_t now = 0;
+    if (server_one_in > 1) {
+        now = monotonic_ns();
+        if (now < state.lease_end_ns.load(std::memory_order_relaxed)) {
+            one_in = server_one_in > one_in ? server_one_in : one_in;
+        } else if (state.server_one_in.exchange(1, std::memory_order_relaxed) > 1) {
+            update_active();
+        }
+    }
+    if (one_in > 1 && next_random() % one_in != 0) {
+        return 0;
+    }
+    if (state.interval_ns.load(std::memory_order_relaxed) == 0) {
+        return one_in;
+    }
+    return bucket(state, one_in, now != 0 ? now : monotonic_ns());
+}
@@ -0,0 +1,59 @@
+//LogSampler.h - Sampling of DEBUG and WARNING records in the Logger
+//
+// Each of the two levels can be thinned out in two ways, which may be
+// combined: keeping a record with probability 1/one_in, and a token bucket
+// letting at most max_per_sec records through per second with bursts of up to
+// a second's worth. ERROR and CRITICAL records are never sampled.
+//
+// A kept record carries a weight, the number of records it stands for, so
+// the server can still count what was logged: one_in for the probabilistic
+// part, plus whatever the bucket turned away since the last record of the
+// level it let through.
+//
+// Besides the client's own rates the server can ask for a higher one_in for
+// a while when it falls behind; the higher of the two applies until that
+// lease runs out, so a client never stays throttled by a server that went
+// away.
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+const int LOG_SAMPLED_LEVELS = 2;       // DEBUG and WARNING
+
+class LogSampler {
+    private:
+        struct Level {
+            std::atomic<uint32_t> one_in;           // the client's own rate
+            std::atomic<uint32_t> server_one_in;    // the server's, until lease_end_ns
+            std::atomic<uint64_t> lease_end_ns;
+            std::atomic<uint64_t> interval_ns;      // between bucket tokens, 0 = no bucket
+            std::atomic<uint64_t> next_ns;          // when the bucket is full again
+            std::atomic<uint32_t> held_weight;      // of records the bucket turned away
+        };
+        Level levels[LOG_SAMPLED_LEVELS];
+        std::atomic<bool> active;               // anything but "keep every record"
+
+        void update_active();
+        uint32_t bucket(Level& state, uint32_t weight, uint64_t now);
+        uint32_t sample(int level);
+
+    public:
+        LogSampler();
+
+        // The client's own rates for a level; one_in 1 and max_per_sec 0 keep
+        // every record
+        void Configure(int level, uint32_t one_in, uint32_t max_per_sec);
+
+        // The server's rate for a level for the next lease_ms
+        void Throttle(int level, uint32_t one_in, uint32_t lease_ms);
+
+        // Returns the weight to send a record at level with, or 0 to drop it
+        uint32_t Sample(int level) {
+            if (level >= LOG_SAMPLED_LEVELS || level < 0 || !active.load(std::memory_order_relaxed)) {
+                return 1;
+            }
+            return sample(level);
+        }
+};
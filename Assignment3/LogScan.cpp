@@ -0,0 +1,201 @@
+//LogScan.cpp - mmap based scanning engine for log dumps and greps
+
+#include "LogScan.h"
+#include "LogFormat.h"
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOG_SCAN_X86 1
+#endif
+
+const size_t TIME_TEXT_LEN = 19;
+
+LogScanOutput::LogScanOutput(int _fd) : fd(_fd), lines(0), failed(false) {
+    iovs.reserve(IOV_MAX);
+}
+
+LogScanOutput::~LogScanOutput() {
+    Flush();
+}
+
+void LogScanOutput::Add(const char* data, size_t len) {
+    if (failed) {
+        return;
+    }
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = len;
+    iovs.push_back(iov);
+    ++lines;
+    if (iovs.size() == IOV_MAX) {
+        Flush();
+    }
+}
+
+void LogScanOutput::Flush() {
+    size_t first = 0;
+    while (first < iovs.size()) {
+        ssize_t n = writev(fd, &iovs[first], iovs.size() - first);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = true;
+            break;
+        }
+        // Skip what was written, trimming a partially written iovec
+        size_t written = n;
+        while (first < iovs.size() && written >= iovs[first].iov_len) {
+            written -= iovs[first].iov_len;
+            ++first;
+        }
+        if (first < iovs.size()) {
+            iovs[first].iov_base = static_cast<char*>(iovs[first].iov_base) + written;
+            iovs[first].iov_len -= written;
+        }
+    }
+    iovs.clear();
+}
+
+size_t LogScanOutput::Lines() const {
+    return lines;
+}
+
+bool LogScanOutput::Failed() const {
+    return failed;
+}
+
+LogMapping::LogMapping() : data(nullptr), size(0) {
+}
+
+LogMapping::~LogMapping() {
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+bool LogMapping::Map(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+    if (size == 0) {
+        return true;
+    }
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        size = 0;
+        return false;
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(p);
+    return true;
+}
+
+const char* LogMapping::Data() const {
+    return data;
+}
+
+size_t LogMapping::Size() const {
+    return size;
+}
+
+static const char* find_newline_scalar(const char* p, const char* end) {
+    const char* found = static_cast<const char*>(memchr(p, '\n', end - p));
+    return found ? found : end;
+}
+
+#ifdef LOG_SCAN_X86
+static const char* find_newline_sse2(const char* p, const char* end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_newline_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_newline_avx2(const char* p, const char* end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; p + 32 <= end; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_newline_sse2(p, end);
+}
+#endif
+
+typedef const char* (*NewlineFinder)(const char*, const char*);
+
+// Picks the widest newline search the CPU supports
+static NewlineFinder select_finder(const char*& name) {
+#ifdef LOG_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return find_newline_avx2;
+    }
+    name = "sse2";
+    return find_newline_sse2;
+#else
+    name = "scalar";
+    return find_newline_scalar;
+#endif
+}
+
+static const char* engine_name = "scalar";
+static const NewlineFinder find_newline = select_finder(engine_name);
+
+const char* FindNewline(const char* p, const char* end) {
+    return find_newline(p, end);
+}
+
+const char* LogScanEngine() {
+    return engine_name;
+}
+
+static bool line_matches(const char* line, size_t len, const LogScanFilter& filter) {
+    int level = ParseLogLevel(line, len);
+    if (level < 0 || !(filter.level_mask & (1u << level))) {
+        return false;
+    }
+    // Text timestamps sort like the times they stand for
+    if (!filter.min_time.empty() && memcmp(line, filter.min_time.data(), TIME_TEXT_LEN) < 0) {
+        return false;
+    }
+    if (!filter.max_time.empty() && memcmp(line, filter.max_time.data(), TIME_TEXT_LEN) > 0) {
+        return false;
+    }
+    return filter.pattern.empty() || memmem(line, len, filter.pattern.data(), filter.pattern.length()) != nullptr;
+}
+
+size_t ScanLogRange(const char* begin, const char* end, const LogScanFilter& filter, LogScanOutput& out) {
+    size_t scanned = 0;
+    const char* line = begin;
+    while (line < end) {
+        const char* newline = find_newline(line, end);
+        if (newline == end) {
+            break;      // incomplete last line, still being written
+        }
+        size_t len = newline - line;
+        if (line_matches(line, len, filter)) {
+            out.Add(line, len + 1);
+        }
+        ++scanned;
+        line = newline + 1;
+    }
+    return scanned;
+}
@@ -0,0 +1,70 @@
+//LogScan.h - mmap based scanning engine for log dumps and greps
+//
+// The log is mapped read-only with MADV_SEQUENTIAL, record boundaries are
+// found with a vectorized newline search (AVX2 or SSE2, picked at run time,
+// with a scalar fallback) and the level of each line is read from its fixed
+// level column. Matching lines are not copied: they are gathered as iovecs
+// pointing into the mapping and written with one writev per batch.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+// Filter applied to every line
+struct LogScanFilter {
+    uint32_t level_mask;        // see LogLevelMask
+    std::string min_time;       // "YYYY-MM-DD HH:MM:SS" bounds, empty = open
+    std::string max_time;
+    std::string pattern;        // substring the line must contain, empty = any
+
+    LogScanFilter() : level_mask(~0u) {}
+};
+
+// Collects matching lines and writes them to fd in batches. Once a write
+// fails, say on a send timeout, nothing more is written.
+class LogScanOutput {
+    private:
+        int fd;
+        std::vector<struct iovec> iovs;
+        size_t lines;
+        bool failed;
+
+    public:
+        explicit LogScanOutput(int _fd);
+        ~LogScanOutput();
+
+        void Add(const char* data, size_t len);
+        void Flush();
+        size_t Lines() const;
+        bool Failed() const;
+};
+
+// A read-only mapping of a whole file
+class LogMapping {
+    private:
+        const char* data;
+        size_t size;
+
+    public:
+        LogMapping();
+        ~LogMapping();
+
+        // Maps the file open on fd. An empty file maps to an empty range.
+        bool Map(int fd);
+        const char* Data() const;
+        size_t Size() const;
+};
+
+// Returns the first '\n' in [p, end), or end if there is none
+const char* FindNewline(const char* p, const char* end);
+
+// Name of the newline search in use: "avx2", "sse2" or "scalar"
+const char* LogScanEngine();
+
+// Passes every complete line of [begin, end) that matches filter to out.
+// Returns the number of lines scanned.
+size_t ScanLogRange(const char* begin, const char* end, const LogScanFilter& filter, LogScanOutput& out);
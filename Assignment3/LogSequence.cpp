@@ -0,0 +1,108 @@
+//LogSequence.cpp - Loss, reordering and duplicate accounting for one client
+
+#include "LogSequence.h"
+#include <cstring>
+
+const uint32_t WINDOW_WORDS = SEQUENCE_WINDOW / 64;
+
+LogSequenceTracker::LogSequenceTracker()
+    : session(0), highest(0), started(false), received(0), lost(0), reordered(0), duplicates(0), sessions(0) {
+    memset(window, 0, sizeof(window));
+}
+
+// Marks the number behind positions below the highest as arrived and returns
+// whether it had arrived before
+bool LogSequenceTracker::test_and_set(uint32_t behind) {
+    uint64_t bit = 1ULL << (behind % 64);
+    uint64_t& word = window[behind / 64];
+    bool seen = (word & bit) != 0;
+    word |= bit;
+    return seen;
+}
+
+// Moves the window so that the number ahead positions above the highest
+// becomes the new highest
+void LogSequenceTracker::advance(uint32_t ahead) {
+    if (ahead >= SEQUENCE_WINDOW) {
+        memset(window, 0, sizeof(window));
+        return;
+    }
+    uint32_t words = ahead / 64;
+    uint32_t bits = ahead % 64;
+    for (uint32_t i = WINDOW_WORDS; i-- > 0;) {
+        uint64_t value = 0;
+        if (i >= words) {
+            value = window[i - words] << bits;
+            if (bits != 0 && i > words) {
+                value |= window[i - words - 1] >> (64 - bits);
+            }
+        }
+        window[i] = value;
+    }
+}
+
+void LogSequenceTracker::Track(uint32_t session_id, uint32_t sequence) {
+    if (!started || session_id != session) {
+        // A new session numbers from 0 again; records it lost before its
+        // first one that arrived are counted as lost too
+        sessions++;
+        session = session_id;
+        highest = sequence;
+        memset(window, 0, sizeof(window));
+        test_and_set(0);
+        lost += sequence;
+        received++;
+        started = true;
+        return;
+    }
+
+    // Serial number arithmetic, so the counter may wrap
+    int32_t distance = static_cast<int32_t>(sequence - highest);
+    if (distance > 0) {
+        advance(distance);
+        test_and_set(0);
+        highest = sequence;
+        lost += distance - 1;
+        received++;
+        return;
+    }
+    uint32_t behind = static_cast<uint32_t>(-static_cast<int64_t>(distance));
+    if (behind >= SEQUENCE_WINDOW) {
+        reordered++;
+        if (lost > 0) {
+            lost--;
+        }
+        received++;
+        return;
+    }
+    if (test_and_set(behind)) {
+        duplicates++;
+        return;
+    }
+    reordered++;
+    if (lost > 0) {
+        lost--;
+    }
+    received++;
+}
+
+void LogSequenceTracker::Resume(uint32_t session_id, uint32_t sequence) {
+    if (started && session_id == session) {
+        return;
+    }
+    sessions++;
+    session = session_id;
+    highest = sequence - 1;
+    memset(window, 0, sizeof(window));
+    test_and_set(0);
+    started = true;
+}
+
+uint32_t LogSequenceTracker::Session() const {
+    return session;
+}
+
+double LogSequenceTracker::LossRate() const {
+    uint64_t sent = received + lost;
+    return sent == 0 ? 0.0 : static_cast<double>(lost) / sent;
+}
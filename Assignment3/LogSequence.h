@@ -0,0 +1,48 @@
+//LogSequence.h - Loss, reordering and duplicate accounting for one client
+//
+// Records carry a session ID and a sequence number counting up from 0 in
+// that session. The tracker remembers the highest sequence seen and which of
+// the SEQUENCE_WINDOW numbers below it have arrived. A jump ahead counts the
+// numbers skipped as lost; one of them turning up later is moved from lost to
+// reordered, and a number arriving twice is a duplicate. Numbers older than
+// the window cannot be told apart and are counted as reordered.
+//
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+const uint32_t SEQUENCE_WINDOW = 1024;
+
+class LogSequenceTracker {
+    private:
+        uint32_t session;
+        uint32_t highest;
+        uint64_t window[SEQUENCE_WINDOW / 64];  // bit i: highest - i arrived
+        bool started;
+
+        bool test_and_set(uint32_t behind);
+        void advance(uint32_t ahead);
+
+    public:
+        uint64_t received;      // distinct records that arrived
+        uint64_t lost;          // sequence numbers still missing
+        uint64_t reordered;     // records that arrived after a later one
+        uint64_t duplicates;
+        uint64_t sessions;      // times the client started over
+
+        LogSequenceTracker();
+
+        void Track(uint32_t session_id, uint32_t sequence);
+
+        // Takes up a session at sequence without counting the numbers before
+        // it as lost, unless it is already being tracked. For stream clients,
+        // whose earlier records went to a previous run of the server.
+        void Resume(uint32_t session_id, uint32_t sequence);
+
+        // Session of the last record tracked
+        uint32_t Session() const;
+
+        // Share of the records sent so far that never arrived, 0 to 1
+        double LossRate() const;
+};
@@ -8,123 +8,1546 @@
 #include <cstring>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <arpa/inet.h>
 #include <chrono>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include "LogRecord.h"
+#include "LogFormat.h"
+#include "LogArgs.h"
+#include "LogWriter.h"
+#include "LogCodec.h"
+#include "LogScan.h"
+#include "LogSubscribers.h"
+#include "LogClients.h"
+#include "LogMerger.h"
+#include "LogStreamServer.h"
+#include "LogShmServer.h"
+#include "LogCounters.h"
+#include "LogSinks.h"
+#include <sys/un.h>
+#include <poll.h>
+#include <getopt.h>
+#include <cerrno>
+#include <climits>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/sock_diag.h>
 
-const int SERVER_PORT = 8080;
-const int CLIENT_LISTEN_PORT = 8081;
-const int BUF_LEN = 1024;
+const int BUF_LEN = 65536;               // largest UDP datagram
+const int RECV_BATCH = 64;              // datagrams drained per recvmmsg call
+const int RECV_BUFFER_BYTES = 8 * 1024 * 1024;
+const size_t SUBSCRIBER_QUEUE_BYTES = 4 * 1024 * 1024;
+const size_t MAX_COMMAND_LEN = 4096;
+const int CONTROL_SEND_TIMEOUT_SEC = 5;  // a control client reading no reply for longer is dropped
+const int MAX_SETLEVEL_WAIT_MS = 60000;
+const int MAX_CONTROL_HANDLERS = 16;    // control connections served at once
+const time_t CLIENT_IDLE_SECONDS = 60;  // clients silent for longer are not listed
+const size_t MAX_SHARDS = 64;
+const int SAMPLING_INTERVAL_MS = 500;
+const double BACKLOG_HIGH = 0.5;        // fill at which clients are asked to sample more
+const double BACKLOG_LOW = 0.1;         // fill below which sampling relaxes again
+const int CALM_INTERVALS = 4;           // intervals below BACKLOG_LOW before each relaxing step
+const int MAX_SAMPLING_STEP = 12;
 std::atomic<bool> shutdown_flag(false);
-std::thread receive_thread;
+
+// UDP and TCP port the clients send to
+int server_port = 8080;
+
+// Without the menu the server runs until SIGTERM, SIGINT or SHUTDOWN
+bool daemon_mode = false;
+
+// Local stream socket accepting commands such as live tail subscriptions
+std::string control_path = "/tmp/logserver.sock";
+std::thread control_thread;
+std::mutex control_mutex;
+std::condition_variable control_cv;
+int control_handlers = 0;               // guarded by control_mutex
+LogSubscribers* subscribers = nullptr;
+
+// Every client heard from, with the level it runs at
+LogClients* clients = nullptr;
 
 // Server now maintains its own log level for filtering the dump output
-enum LOG_LEVEL { DEBUG, WARNING, ERROR, CRITICAL };
 LOG_LEVEL current_server_log_level = DEBUG;
 
-// Function to safely write a message to the log file
-void log_message(const std::string& message) {
-    std::ofstream log_file("server_log.txt", std::ios::app);
-    if (log_file.is_open()) {
-        log_file << message << std::endl << std::endl;
-        log_file.close();
+struct SiteInfo {
+    std::string file;
+    std::string function;
+    int line;
+    std::string format;     // of a LOGF site
+};
+typedef std::map<std::pair<uint64_t, uint32_t>, SiteInfo> SiteTable;
+
+// One UDP receiver. With several shards each has its own SO_REUSEPORT socket,
+// across which the kernel spreads clients by address, and its own thread
+// pinned to a core. A client always lands on the same shard, so every shard
+// keeps the call sites of its own clients, keyed by client address and site
+// ID, and only its thread touches them.
+struct ReceiverShard {
+    size_t id;
+    int fd;
+    std::thread thread;
+    SiteTable site_table;
+    LogWriter* writer;          // the shard's own log file, nullptr when merged
+    LogCounters counters;       // of the records this shard received
+    std::shared_ptr<LogSinkBatch> batch;    // entries not handed to the sinks yet
+};
+std::vector<ReceiverShard*> shards;
+size_t shard_count = 1;
+bool split_shards = false;      // a log file per shard instead of one merged log
+int merge_delay_ms = 100;
+LogMerger* merger = nullptr;
+
+// Stream clients (TCP on the server port, or a Unix socket) come in through
+// their own thread, which acts as one more shard for the log output
+std::string stream_path = "/tmp/logserver.stream";
+LogStreamServer* stream_server = nullptr;
+ReceiverShard* stream_shard = nullptr;
+
+// Clients on this host may hand over a shared memory ring instead; all rings
+// are drained by one more thread and shard
+std::string shm_path = "/tmp/logserver.shm";
+LogShmServer* shm_server = nullptr;
+ReceiverShard* shm_shard = nullptr;
+
+// While the server falls behind it asks every client to sample its DEBUG
+// records, and beyond DEBUG 1 in 16 its WARNING records as well, harder with
+// every step. The requests are leases the clients drop on their own once the
+// server stops renewing them.
+bool adaptive_sampling = true;
+std::atomic<int> sampling_step(0);
+std::thread sampling_thread;
+
+// Sampling rates of a step: DEBUG 1 in 2^step up to 1 in 256, WARNING only
+// from step 5 on
+void sampling_rates(int step, unsigned int& debug_one_in, unsigned int& warning_one_in) {
+    debug_one_in = 1u << std::min(step, 8);
+    warning_one_in = step > 4 ? 1u << (step - 4) : 1;
+}
+
+// The log files stay open and buffered for the life of the server
+LogWriterConfig writer_config;
+std::vector<LogWriter*> log_writers;
+
+// Every batch of entries a shard receives goes to each sink on its own queue
+// and thread: the log file, the live subscribers and, given an upstream
+// server, the forwarder. The subscribers and the forwarder drop batches of
+// their own when they fall behind rather than holding up the receivers. The
+// file sink holds them up instead: its batches are never dropped, and as a
+// stream client's batch is offered before the client gets its ACK, what was
+// acknowledged is queued for the log file.
+const size_t SINK_QUEUE_BYTES = 64 * 1024 * 1024;
+const size_t SINK_BATCH_BYTES = 256 * 1024;             // a shard hands on a batch at least this often
+const size_t FORWARD_BUFFER_BYTES = 16 * 1024 * 1024;   // forwarded records kept until acknowledged
+bool file_sink_enabled = true;
+bool subscriber_sink_enabled = true;
+bool forward_sink_enabled = false;
+std::string forward_target;
+std::vector<LogSink*> sinks;
+LogSink* file_sink = nullptr;
+
+// Hands the entries the shard collected since the last call to every sink
+void dispatch_batch(ReceiverShard& shard) {
+    if (shard.batch->entries.empty()) {
+        return;
+    }
+    shard.batch->received = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < sinks.size(); ++i) {
+        sinks[i]->Offer(shard.batch);
+    }
+    shard.batch = std::make_shared<LogSinkBatch>(shard.id);
+}
+
+// Gets everything received so far into the log files: what the file sink
+// has queued, then what waits in the merge
+void settle_log() {
+    if (file_sink != nullptr) {
+        file_sink->Drain(5000);
+    }
+    if (merger != nullptr) {
+        merger->Flush();
+    }
+}
+
+// Remembers what a SITE record says about one of the client's call sites
+void remember_site(SiteTable& site_table, uint64_t source, const LogRecordHeader& hdr, const char* payload) {
+    const char* file;
+    const char* function;
+    int line;
+    size_t site_len = DecodeLogSite(payload, hdr.payload_len, file, function, line);
+    if (site_len > 0) {
+        SiteInfo& site = site_table[std::make_pair(source, hdr.site_id)];
+        site.file = file;
+        site.function = function;
+        site.line = line;
+        const char* format = payload + site_len;
+        size_t format_len = hdr.payload_len - site_len;
+        site.format.assign(format, format_len > 0 ? strnlen(format, format_len) : 0);
+    }
+}
+
+// Where an ENTRY was logged from and its message, as render_entry found them
+struct EntryParts {
+    const char* file;
+    const char* function;
+    int line;
+    const char* message;                // may point into formatted
+    size_t message_len;
+    char formatted[LOG_RECORD_MAX_LEN]; // the message of a LOGF call the client left to the server
+};
+
+// Renders an ENTRY record as a log line into text. Returns its length, 0 for
+// a malformed record, and fills in parts.
+size_t render_entry(const SiteTable& site_table, uint64_t source, const LogRecordHeader& hdr, const char* payload,
+                    char* text, size_t text_len, EntryParts& parts) {
+    const char*& file = parts.file;
+    const char*& function = parts.function;
+    int& line = parts.line;
+    const char* message = payload;
+    size_t message_len = hdr.payload_len;
+    const char* format = nullptr;
+    char weighted[LOG_RECORD_MAX_LEN + 16];
+    if (hdr.flags & RECORD_FLAG_INLINE_SITE) {
+        size_t site_len = DecodeLogSite(payload, hdr.payload_len, file, function, line);
+        if (site_len == 0) {
+            return 0;
+        }
+        message += site_len;
+        message_len -= site_len;
     } else {
-        std::cerr << "Error: Unable to open log file." << std::endl;
+        SiteTable::const_iterator it = site_table.find(std::make_pair(source, hdr.site_id));
+        if (it != site_table.end()) {
+            file = it->second.file.c_str();
+            function = it->second.function.c_str();
+            line = it->second.line;
+            format = it->second.format.c_str();
+        } else {
+            file = "unknown";
+            function = "unknown";
+            line = 0;
+        }
+    }
+
+    if (hdr.flags & RECORD_FLAG_DEFERRED) {
+        // The client only captured the arguments of a LOGF call
+        message_len = FormatLogArgs(parts.formatted, sizeof(parts.formatted),
+                                    format != nullptr ? format : "(unknown format)", message, message_len);
+        message = parts.formatted;
     }
+    parts.message = message;
+    parts.message_len = message_len;
+    if (hdr.weight > 1) {
+        // A sampled record stands for weight records like it; the line says
+        // so, which keeps counts taken from the log right
+        int prefix = snprintf(weighted, sizeof(weighted), "[x%u] ", hdr.weight);
+        message_len = std::min(message_len, sizeof(weighted) - prefix);
+        memcpy(weighted + prefix, message, message_len);
+        message = weighted;
+        message_len += prefix;
+    }
+
+    return FormatLogLine(text, text_len, hdr.timestamp_ns / 1000000000ULL, hdr.level,
+                         file, function, line, message, message_len);
 }
 
-// Function to parse the log level from a log message string
-LOG_LEVEL get_log_level_from_string(const std::string& log_line) {
-    if (log_line.find("CRITICAL") != std::string::npos) return CRITICAL;
-    if (log_line.find("ERROR") != std::string::npos) return ERROR;
-    if (log_line.find("WARNING") != std::string::npos) return WARNING;
-    return DEBUG;
+// Handles one decoded record: remembers site definitions and client
+// identities, and renders entries as text lines into the shard's batch for
+// the sinks
+void handle_record(ReceiverShard& shard, uint64_t source, const LogRecordHeader& hdr, const char* payload) {
+    if (hdr.type == RECORD_HELLO) {
+        uint32_t pid;
+        const char* name;
+        const char* group;
+        if (DecodeLogHello(payload, hdr.payload_len, pid, name, group) > 0) {
+            clients->Hello(source, pid, name, group, hdr.level, time(nullptr));
+        }
+        return;
+    }
+    if (hdr.type == RECORD_SITE) {
+        remember_site(shard.site_table, source, hdr, payload);
+        shard.counters.ForgetSite(source, hdr.site_id);
+        return;
+    }
+    if (hdr.type != RECORD_ENTRY) {
+        return;
+    }
+
+    char text[2 * LOG_RECORD_MAX_LEN];
+    EntryParts parts;
+    size_t text_len = render_entry(shard.site_table, source, hdr, payload, text, sizeof(text), parts);
+    if (text_len == 0) {
+        return;
+    }
+    shard.counters.Count(source, hdr.flags & RECORD_FLAG_INLINE_SITE ? 0 : hdr.site_id, parts.file, parts.line,
+                         hdr.level, hdr.weight > 1 ? hdr.weight : 1, time(nullptr));
+
+    if (!sinks.empty()) {
+        shard.batch->Add(source, hdr, text, text_len, parts.file, parts.function, parts.line, parts.message,
+                         parts.message_len);
+        if (shard.batch->Bytes() >= SINK_BATCH_BYTES) {
+            dispatch_batch(shard);
+        }
+    }
 }
 
-// dump_log_file now takes a boolean to switch between exact and cumulative filtering
-void dump_log_file(bool exact_match) {
-    std::cout << "---- server_log.txt (filtered " << (exact_match ? "exactly" : "cumulatively") << " for level " << current_server_log_level << ") ----" << std::endl;
-    std::ifstream log_file("server_log.txt");
-    if (log_file.is_open()) {
-        std::string line;
-        while (getline(log_file, line)) {
-            // Check if the line has a log level and if it meets the filtering criteria
-            LOG_LEVEL line_level = get_log_level_from_string(line);
-            if (exact_match) {
-                if (line_level == current_server_log_level) {
-                    std::cout << line << std::endl;
-                }
-            } else {
-                if (line_level >= current_server_log_level) {
-                    std::cout << line << std::endl;
-                }
+// Prints the records a Logger wrote to its crash file (LogConfig::crash_path)
+// as log lines. The file holds raw records, each crash starting over with
+// the client's HELLO and call sites.
+bool print_crash_file(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    SiteTable site_table;
+    size_t offset = 0;
+    while (offset < data.size()) {
+        LogRecordHeader hdr;
+        const char* payload;
+        size_t record_len = DecodeLogRecord(data.data() + offset, data.size() - offset, hdr, payload);
+        if (record_len == 0) {
+            std::cerr << "Malformed record at offset " << offset << std::endl;
+            return false;
+        }
+        offset += record_len;
+        if (hdr.type == RECORD_HELLO) {
+            site_table.clear();
+        } else if (hdr.type == RECORD_SITE) {
+            remember_site(site_table, 0, hdr, payload);
+        } else if (hdr.type == RECORD_ENTRY) {
+            char text[2 * LOG_RECORD_MAX_LEN];
+            EntryParts parts;
+            size_t text_len = render_entry(site_table, 0, hdr, payload, text, sizeof(text), parts);
+            fwrite(text, 1, text_len, stdout);
+            fputc('\n', stdout);
+        }
+    }
+    return true;
+}
+
+// Passes the matching lines of the segment open on fd to out, reading only
+// the blocks of its index that can match
+static void scan_segment(int fd, const std::vector<LogIndexBlock>& blocks, const LogScanFilter& filter,
+                         uint64_t min_ns, uint64_t max_ns, LogScanOutput& out) {
+    LogMapping mapping;
+    if (!mapping.Map(fd)) {
+        std::cerr << "Error: Unable to map log file." << std::endl;
+        return;
+    }
+    uint64_t file_size = mapping.Size();
+    for (size_t i = 0; i < blocks.size() && !out.Failed(); ++i) {
+        if (!LogIndexBlockMatches(blocks[i], filter.level_mask, min_ns, max_ns)) {
+            continue;
+        }
+        uint64_t begin = blocks[i].offset;
+        uint64_t end = i + 1 < blocks.size() ? blocks[i + 1].offset : file_size;
+        if (end > file_size) {
+            end = file_size;
+        }
+        if (begin < end) {
+            ScanLogRange(mapping.Data() + begin, mapping.Data() + end, filter, out);
+        }
+    }
+    // The lines out holds point into the mapping
+    out.Flush();
+}
+
+// Scans every segment of one log file, the closed ones oldest first and then
+// the current one. The sparse indexes let it skip every block, and every
+// closed segment, without a matching level or time; the blocks left are
+// scanned straight out of an mmap of the log. A compressed segment is only
+// unpacked if its index says it can match.
+void dump_segment(LogWriter* writer, const LogScanFilter& filter, uint64_t min_ns, uint64_t max_ns,
+                  int out_fd = STDOUT_FILENO) {
+    // Matching lines go straight from the mappings to out_fd
+    LogScanOutput out(out_fd);
+    std::vector<std::string> closed = writer->ClosedSegments();
+    for (size_t i = 0; i < closed.size() && !out.Failed(); ++i) {
+        std::vector<LogIndexBlock> blocks;
+        if (LogWriter::ReadSegmentIndex(closed[i], blocks)) {
+            size_t matching = 0;
+            while (matching < blocks.size() &&
+                   !LogIndexBlockMatches(blocks[matching], filter.level_mask, min_ns, max_ns)) {
+                ++matching;
+            }
+            if (matching == blocks.size()) {
+                continue;
             }
+        } else {
+            // Without its sidecar the whole segment is read
+            LogIndexBlock all;
+            all.offset = 0;
+            all.min_timestamp_ns = 0;
+            all.max_timestamp_ns = UINT64_MAX;
+            all.records = 0;
+            all.level_mask = ~0u;
+            blocks.assign(1, all);
         }
-        log_file.close();
-    } else {
+        int fd = LogWriter::OpenClosedSegment(closed[i]);
+        if (fd < 0) {
+            std::cerr << "Error: Unable to open log segment " << closed[i] << "." << std::endl;
+            continue;
+        }
+        scan_segment(fd, blocks, filter, min_ns, max_ns, out);
+        close(fd);
+    }
+
+    if (out.Failed()) {
+        return;
+    }
+
+    // Make sure everything received so far is in the file
+    std::vector<LogIndexBlock> blocks;
+    int fd = writer->OpenSegment(blocks);
+    if (fd < 0) {
         std::cerr << "Error: Unable to open log file." << std::endl;
+        return;
+    }
+    scan_segment(fd, blocks, filter, min_ns, max_ns, out);
+    close(fd);
+}
+
+// dump_log_file now takes a boolean to switch between exact and cumulative filtering.
+// Only records with a timestamp within [min_ns, max_ns] that contain pattern
+// are shown. Thanks to the index the cost follows the matching blocks rather
+// than the file size.
+void dump_log_file(bool exact_match, uint64_t min_ns = 0, uint64_t max_ns = UINT64_MAX,
+                   const std::string& pattern = "") {
+    std::cout << "---- server_log.txt (filtered " << (exact_match ? "exactly" : "cumulatively") << " for level " << current_server_log_level << ") ----" << std::endl;
+
+    LogScanFilter filter;
+    filter.level_mask = LogLevelMask(current_server_log_level, exact_match);
+    if (min_ns > 0) {
+        filter.min_time = FormatLogTime(min_ns / 1000000000ULL);
+    }
+    if (max_ns < UINT64_MAX) {
+        filter.max_time = FormatLogTime(max_ns / 1000000000ULL);
+    }
+    filter.pattern = pattern;
+
+    // Lines still on their way to the file are written out first. Split
+    // shards are dumped one file after the other.
+    settle_log();
+    for (size_t i = 0; i < log_writers.size(); ++i) {
+        dump_segment(log_writers[i], filter, min_ns, max_ns);
     }
     std::cout << "---- end of server_log.txt ----" << std::endl;
 }
 
-// Thread function to receive log messages via UDP
-void receive_logs(int server_fd) {
-    char buffer[BUF_LEN];
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    
-    // Set a timeout for the socket to make recvfrom non-blocking
+// Finds the records containing every word of text through the token index
+// of each log file, newest last. Returns false and sets error without one.
+bool search_logs(const std::string& text, size_t limit, std::string& result, std::string& error) {
+    std::vector<std::string> words = LogTokens(text);
+    if (words.empty()) {
+        error = "no words to search for";
+        return false;
+    }
+    settle_log();
+    std::ostringstream out;
+    size_t total = 0;
+    for (size_t i = 0; i < log_writers.size(); ++i) {
+        std::vector<std::string> lines;
+        size_t found = 0;
+        if (!log_writers[i]->Search(words, limit, lines, found)) {
+            error = "the server keeps no token index, start it with --token-index";
+            return false;
+        }
+        total += found;
+        for (size_t j = 0; j < lines.size(); ++j) {
+            out << lines[j] << std::endl;
+        }
+    }
+    out << "---- " << total << " matching records";
+    if (total > limit) {
+        out << ", the newest " << limit << " shown";
+    }
+    out << " ----" << std::endl;
+    result = out.str();
+    return true;
+}
+
+// Pushes level to the selected clients and waits up to wait_ms for them to
+// report it back. Clients idle for CLIENT_IDLE_SECONDS are left to pick it up
+// when they send again. Returns a line saying how that went, followed by the
+// clients that did not confirm; confirmed tells whether all did.
+std::string set_level(const LogClientSelector& selector, int level, int wait_ms, bool& confirmed) {
+    std::vector<uint64_t> sent_to;
+    auto start = std::chrono::steady_clock::now();
+    int sent = clients->SetLevel(selector, level, time(nullptr), CLIENT_IDLE_SECONDS, &sent_to);
+    std::vector<uint64_t> missing = wait_ms > 0 ? clients->AwaitLevel(sent_to, level, wait_ms) : sent_to;
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::ostringstream out;
+    out << "sent " << LogLevelName(level) << " to " << sent << " clients";
+    if (wait_ms > 0) {
+        char elapsed_text[32];
+        snprintf(elapsed_text, sizeof(elapsed_text), "%.1f", elapsed_ms);
+        out << ", " << sent - missing.size() << " confirmed in " << elapsed_text << " ms";
+    }
+    out << std::endl;
+    for (size_t i = 0; wait_ms > 0 && i < missing.size(); ++i) {
+        char source_text[32];
+        FormatLogSource(missing[i], source_text, sizeof(source_text));
+        out << "unconfirmed " << source_text << std::endl;
+    }
+    confirmed = wait_ms <= 0 || missing.empty();
+    return out.str();
+}
+
+// Parses the filter of a DUMP command: [level=N] [match=exact|cumulative]
+// [minutes=N] [contains=TEXT], where TEXT is the rest of the line
+bool parse_dump(const std::string& args, LogScanFilter& filter, uint64_t& min_ns, std::string& error) {
+    std::string words = args;
+    size_t contains = words.find("contains=");
+    if (contains != std::string::npos) {
+        filter.pattern = words.substr(contains + 9);
+        words.erase(contains);
+    }
+    std::istringstream in(words);
+    std::string word;
+    int level = 0;
+    bool exact_match = false;
+    min_ns = 0;
+    while (in >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = eq != std::string::npos ? word.substr(eq + 1) : "";
+        if (key == "level") {
+            level = atoi(value.c_str());
+            if (level < DEBUG || level > CRITICAL) {
+                error = "level must be 0-3";
+                return false;
+            }
+        } else if (key == "match" && (value == "exact" || value == "cumulative")) {
+            exact_match = value == "exact";
+        } else if (key == "minutes") {
+            uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            uint64_t span_ns = strtoull(value.c_str(), nullptr, 10) * 60 * 1000000000ULL;
+            min_ns = span_ns < now_ns ? now_ns - span_ns : 0;
+            filter.min_time = FormatLogTime(min_ns / 1000000000ULL);
+        } else {
+            error = "unexpected " + word;
+            return false;
+        }
+    }
+    filter.level_mask = LogLevelMask(level, exact_match);
+    return true;
+}
+
+// Reads one command line from a freshly accepted control connection. Reads
+// and replies on it time out, so a client that stops reading a dump only
+// holds up its own handler, and not for long.
+bool read_command(int fd, std::string& line) {
     struct timeval tv;
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    tv.tv_sec = CONTROL_SEND_TIMEOUT_SEC;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof tv);
+
+    char c;
+    line.clear();
+    while (line.length() < MAX_COMMAND_LEN) {
+        ssize_t n = read(fd, &c, 1);
+        if (n <= 0) {
+            return false;
+        }
+        if (c == '\n') {
+            return true;
+        }
+        line.push_back(c);
+    }
+    return false;
+}
+
+void send_reply(int fd, const std::string& reply) {
+    send(fd, reply.c_str(), reply.length(), MSG_NOSIGNAL);
+}
+
+// One line per client seen lately: address, name, group, pid, reported and
+// wanted level, records received, records it sampled away and seconds since
+// the last one
+std::string format_clients() {
+    time_t now = time(nullptr);
+    std::vector<LogClientInfo> list = clients->List(now, CLIENT_IDLE_SECONDS);
+    std::ostringstream out;
+    out << std::left << std::setw(22) << "ADDRESS" << std::setw(16) << "NAME" << std::setw(12) << "GROUP"
+        << std::setw(8) << "PID" << std::setw(10) << "LEVEL" << std::setw(10) << "WANTED"
+        << std::setw(12) << "RECORDS" << std::setw(12) << "SAMPLED" << "IDLE" << std::endl;
+    for (size_t i = 0; i < list.size(); ++i) {
+        const LogClientInfo& client = list[i];
+        char source_text[32];
+        FormatLogSource(client.source, source_text, sizeof(source_text));
+        out << std::setw(22) << source_text
+            << std::setw(16) << (client.name.empty() ? "-" : client.name)
+            << std::setw(12) << (client.group.empty() ? "-" : client.group)
+            << std::setw(8) << client.pid
+            << std::setw(10) << (client.level >= 0 ? LogLevelName(client.level) : "-")
+            << std::setw(10) << (client.wanted_level >= 0 ? LogLevelName(client.wanted_level) : "-")
+            << std::setw(12) << client.records
+            << std::setw(12) << client.sampled
+            << (now - client.last_seen) << "s" << std::endl;
+    }
+    return out.str();
+}
+
+// Transport statistics per client seen lately, worked out from the record
+// sequence numbers, followed by the totals over those clients
+std::string format_stats() {
+    time_t now = time(nullptr);
+    std::vector<LogClientInfo> list = clients->List(now, CLIENT_IDLE_SECONDS);
+    std::ostringstream out;
+    out << std::left << std::setw(22) << "ADDRESS" << std::setw(16) << "NAME" << std::setw(10) << "SESSION"
+        << std::setw(12) << "RECEIVED" << std::setw(10) << "LOST" << std::setw(9) << "LOSS"
+        << std::setw(11) << "REORDERED" << std::setw(11) << "DUPLICATES" << "SESSIONS" << std::endl;
+    LogSequenceTracker total;
+    for (size_t i = 0; i < list.size(); ++i) {
+        const LogSequenceTracker& seq = list[i].sequence;
+        char source_text[32];
+        char session_text[16];
+        char loss_text[16];
+        FormatLogSource(list[i].source, source_text, sizeof(source_text));
+        snprintf(session_text, sizeof(session_text), "%08x", seq.Session());
+        snprintf(loss_text, sizeof(loss_text), "%.2f%%", 100.0 * seq.LossRate());
+        out << std::setw(22) << source_text
+            << std::setw(16) << (list[i].name.empty() ? "-" : list[i].name)
+            << std::setw(10) << session_text
+            << std::setw(12) << seq.received << std::setw(10) << seq.lost << std::setw(9) << loss_text
+            << std::setw(11) << seq.reordered << std::setw(11) << seq.duplicates << seq.sessions << std::endl;
+        total.received += seq.received;
+        total.lost += seq.lost;
+        total.reordered += seq.reordered;
+        total.duplicates += seq.duplicates;
+        total.sessions += seq.sessions;
+    }
+    char loss_text[16];
+    snprintf(loss_text, sizeof(loss_text), "%.2f%%", 100.0 * total.LossRate());
+    out << std::setw(22) << "TOTAL" << std::setw(16) << list.size() << std::setw(10) << ""
+        << std::setw(12) << total.received << std::setw(10) << total.lost << std::setw(9) << loss_text
+        << std::setw(11) << total.reordered << std::setw(11) << total.duplicates << total.sessions << std::endl;
+    if (adaptive_sampling) {
+        unsigned int debug_one_in;
+        unsigned int warning_one_in;
+        sampling_rates(sampling_step, debug_one_in, warning_one_in);
+        out << "Sampling asked of clients: DEBUG 1 in " << debug_one_in << ", WARNING 1 in " << warning_one_in
+            << std::endl;
+    }
+    if (!sinks.empty()) {
+        out << std::endl << std::setw(14) << "SINK" << std::setw(10) << "BATCHES" << std::setw(12) << "RECORDS"
+            << std::setw(12) << "BYTES" << std::setw(10) << "LAG_MS" << std::setw(14) << "CONSUMED" << "DROPPED"
+            << std::endl;
+        for (size_t i = 0; i < sinks.size(); ++i) {
+            LogSinkLag lag = sinks[i]->Lag();
+            out << std::setw(14) << sinks[i]->Name() << std::setw(10) << lag.batches << std::setw(12) << lag.records
+                << std::setw(12) << lag.bytes << std::setw(10) << lag.oldest_ms << std::setw(14) << lag.consumed
+                << lag.dropped << std::endl;
+        }
+    }
+    return out.str();
+}
+
+// Every shard, each counting the records it receives
+std::vector<ReceiverShard*> all_shards() {
+    std::vector<ReceiverShard*> all = shards;
+    all.push_back(stream_shard);
+    all.push_back(shm_shard);
+    return all;
+}
+
+std::string format_level_counts(const LogLevelCounts& counts) {
+    std::ostringstream out;
+    out << std::left;
+    for (int level = 0; level < COUNTER_LEVELS; ++level) {
+        out << std::setw(10) << counts.counts[level];
+    }
+    out << counts.Total();
+    return out.str();
+}
+
+// Answers COUNT from the rolling counters of the shards:
+//   COUNT [window=SECONDS] [file=NAME | site=FILE:LINE | source=ADDRESS]
+//         [by=file|site|source] [histogram]
+// The window defaults to 300 seconds, 0 means since the server started.
+// by lists every file, site or source, busiest first; histogram splits the
+// window into its buckets.
+std::string format_counts(const std::string& args, std::string& error) {
+    std::istringstream in(args);
+    std::string word;
+    int seconds = 300;
+    LOG_COUNTER_DIMENSION dimension = COUNT_ALL;
+    std::string key;
+    std::string source_text;
+    LOG_COUNTER_DIMENSION by = COUNT_ALL;
+    bool histogram = false;
+    while (in >> word) {
+        if (word == "histogram") {
+            histogram = true;
+            continue;
+        }
+        size_t eq = word.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + word;
+            return "";
+        }
+        std::string name = word.substr(0, eq);
+        std::string value = word.substr(eq + 1);
+        if (name == "window") {
+            seconds = atoi(value.c_str());
+            if (seconds < 0 || seconds > COUNTER_BUCKETS * COUNTER_BUCKET_SECONDS) {
+                error = "window must be 0-" + std::to_string(COUNTER_BUCKETS * COUNTER_BUCKET_SECONDS) + " seconds";
+                return "";
+            }
+        } else if (name == "file" || name == "site" || name == "source") {
+            dimension = name == "file" ? COUNT_FILE : (name == "site" ? COUNT_SITE : COUNT_SOURCE);
+            key = value;
+        } else if (name == "by") {
+            if (value != "file" && value != "site" && value != "source") {
+                error = "by must be file, site or source";
+                return "";
+            }
+            by = value == "file" ? COUNT_FILE : (value == "site" ? COUNT_SITE : COUNT_SOURCE);
+        } else {
+            error = "unknown key " + name;
+            return "";
+        }
+    }
+    if (histogram && seconds == 0) {
+        error = "a histogram needs a window";
+        return "";
+    }
+
+    // Sources are asked for the way CLIENTS shows them
+    uint64_t source = 0;
+    if (dimension == COUNT_SOURCE) {
+        std::vector<LogClientInfo> list = clients->List(time(nullptr));
+        size_t i = 0;
+        for (; i < list.size(); ++i) {
+            char text[32];
+            FormatLogSource(list[i].source, text, sizeof(text));
+            if (key == text) {
+                source = list[i].source;
+                break;
+            }
+        }
+        if (i == list.size()) {
+            error = "no client " + key;
+            return "";
+        }
+    }
+
+    time_t now = time(nullptr);
+    std::vector<ReceiverShard*> counted = all_shards();
+    std::ostringstream out;
+    out << std::left;
+    if (by != COUNT_ALL) {
+        std::map<std::string, LogLevelCounts> merged;
+        for (size_t i = 0; i < counted.size(); ++i) {
+            std::vector<LogCounters::Row> rows = counted[i]->counters.Rows(by, seconds, now);
+            for (size_t j = 0; j < rows.size(); ++j) {
+                std::string name = rows[j].key;
+                if (by == COUNT_SOURCE) {
+                    char text[32];
+                    FormatLogSource(rows[j].source, text, sizeof(text));
+                    name = text;
+                }
+                merged[name].Add(rows[j].counts);
+            }
+        }
+        std::vector<std::pair<uint64_t, std::string>> order;
+        for (std::map<std::string, LogLevelCounts>::const_iterator it = merged.begin(); it != merged.end(); ++it) {
+            if (it->second.Total() > 0) {
+                order.push_back(std::make_pair(it->second.Total(), it->first));
+            }
+        }
+        std::sort(order.begin(), order.end(), std::greater<std::pair<uint64_t, std::string>>());
+        out << std::setw(40) << (by == COUNT_FILE ? "FILE" : (by == COUNT_SITE ? "SITE" : "SOURCE"))
+            << std::setw(10) << "DEBUG" << std::setw(10) << "WARNING" << std::setw(10) << "ERROR"
+            << std::setw(10) << "CRITICAL" << "TOTAL" << std::endl;
+        for (size_t i = 0; i < order.size(); ++i) {
+            out << std::setw(40) << order[i].second << format_level_counts(merged[order[i].second]) << std::endl;
+        }
+        return out.str();
+    }
+
+    bool found = false;
+    if (histogram) {
+        std::vector<LogLevelCounts> buckets;
+        std::vector<LogLevelCounts> merged;
+        for (size_t i = 0; i < counted.size(); ++i) {
+            if (counted[i]->counters.Histogram(dimension, key, source, seconds, now, buckets)) {
+                found = true;
+                merged.resize(buckets.size());
+                for (size_t j = 0; j < buckets.size(); ++j) {
+                    merged[j].Add(buckets[j]);
+                }
+            }
+        }
+        if (!found) {
+            error = "nothing counted for " + key;
+            return "";
+        }
+        out << std::setw(10) << "SINCE" << std::setw(10) << "DEBUG" << std::setw(10) << "WARNING"
+            << std::setw(10) << "ERROR" << std::setw(10) << "CRITICAL" << "TOTAL" << std::endl;
+        time_t bucket_start = now - now % COUNTER_BUCKET_SECONDS;
+        for (size_t j = 0; j < merged.size(); ++j) {
+            time_t start = bucket_start - static_cast<time_t>(merged.size() - 1 - j) * COUNTER_BUCKET_SECONDS;
+            out << std::setw(10) << ("-" + std::to_string(now - start) + "s") << format_level_counts(merged[j])
+                << std::endl;
+        }
+        return out.str();
+    }
+
+    LogLevelCounts counts;
+    for (size_t i = 0; i < counted.size(); ++i) {
+        found = counted[i]->counters.Sum(dimension, key, source, seconds, now, counts) || found;
+    }
+    if (!found && dimension != COUNT_ALL) {
+        error = "nothing counted for " + key;
+        return "";
+    }
+    out << std::setw(10) << "WINDOW" << std::setw(10) << "DEBUG" << std::setw(10) << "WARNING"
+        << std::setw(10) << "ERROR" << std::setw(10) << "CRITICAL" << "TOTAL" << std::endl
+        << std::setw(10) << (seconds == 0 ? std::string("all") : std::to_string(seconds) + "s")
+        << format_level_counts(counts) << std::endl;
+    return out.str();
+}
+
+// Handles one control connection. Every command gets one reply starting with
+// OK or ERR, after which the server closes the connection:
+//   SUBSCRIBE <filter>     hands the connection over to the subscriber
+//                          fan-out, which streams matching records
+//   SETLEVEL <level> [selector] [wait=MS]
+//                          pushes a level to clients and waits up to MS
+//                          (default 1000, at most 60000, 0 = not at all) for
+//                          each to confirm
+//   DUMP [filter]          the matching records of the log files
+//   CLIENTS, STATS         the clients, and what was lost on the way from each
+//   COUNT [query]          answers from the rolling record counts
+//   SEARCH [limit=N] <words>
+//                          answers from the token index
+//   ROTATE                 starts new segments of the log files
+//   SHUTDOWN               stops a server running with --daemon
+void handle_control(int fd) {
+    std::string line;
+    if (!read_command(fd, line)) {
+        close(fd);
+        return;
+    }
+    std::string verb = line.substr(0, line.find(' '));
+    std::string args = verb.length() < line.length() ? line.substr(verb.length() + 1) : "";
+
+    if (verb == "SUBSCRIBE") {
+        LogSubscription sub;
+        std::string error;
+        if (!ParseSubscription(args, sub, error)) {
+            send_reply(fd, "ERR " + error + "\n");
+            close(fd);
+            return;
+        }
+        if (!subscriber_sink_enabled) {
+            send_reply(fd, "ERR the subscribers sink is off\n");
+            close(fd);
+            return;
+        }
+        send_reply(fd, "OK\n");
+        subscribers->Add(fd, sub);
+        return;
+    }
+    if (verb == "SETLEVEL") {
+        std::istringstream in(args);
+        int level = -1;
+        std::string word;
+        std::string selector_text;
+        int wait_ms = 1000;
+        in >> level;
+        while (in >> word) {
+            if (word.compare(0, 5, "wait=") == 0) {
+                wait_ms = atoi(word.c_str() + 5);
+                wait_ms = wait_ms > MAX_SETLEVEL_WAIT_MS ? MAX_SETLEVEL_WAIT_MS : wait_ms;
+            } else {
+                selector_text = word;
+            }
+        }
+        LogClientSelector selector;
+        std::string error;
+        if (level < DEBUG || level > CRITICAL) {
+            send_reply(fd, "ERR level must be 0-3\n");
+        } else if (!ParseClientSelector(selector_text, selector, error)) {
+            send_reply(fd, "ERR " + error + "\n");
+        } else {
+            bool confirmed;
+            std::string result = set_level(selector, level, wait_ms, confirmed);
+            send_reply(fd, (confirmed ? "OK " : "ERR ") + result);
+        }
+        close(fd);
+        return;
+    }
+    if (verb == "DUMP") {
+        LogScanFilter filter;
+        uint64_t min_ns;
+        std::string error;
+        if (!parse_dump(args, filter, min_ns, error)) {
+            send_reply(fd, "ERR " + error + "\n");
+        } else {
+            send_reply(fd, "OK\n");
+            settle_log();
+            for (size_t i = 0; i < log_writers.size(); ++i) {
+                dump_segment(log_writers[i], filter, min_ns, UINT64_MAX, fd);
+            }
+        }
+        close(fd);
+        return;
+    }
+    if (verb == "ROTATE") {
+        settle_log();
+        for (size_t i = 0; i < log_writers.size(); ++i) {
+            log_writers[i]->Rotate();
+        }
+        send_reply(fd, "OK rotated " + std::to_string(log_writers.size()) + " log files\n");
+        close(fd);
+        return;
+    }
+    if (verb == "SHUTDOWN") {
+        if (daemon_mode) {
+            send_reply(fd, "OK\n");
+            shutdown_flag = true;
+        } else {
+            send_reply(fd, "ERR only a server started with --daemon shuts down on request\n");
+        }
+        close(fd);
+        return;
+    }
+    if (verb == "CLIENTS") {
+        send_reply(fd, "OK\n" + format_clients());
+        close(fd);
+        return;
+    }
+    if (verb == "STATS") {
+        send_reply(fd, "OK\n" + format_stats());
+        close(fd);
+        return;
+    }
+    if (verb == "SEARCH") {
+        size_t limit = 100;
+        if (args.compare(0, 6, "limit=") == 0) {
+            limit = strtoul(args.c_str() + 6, nullptr, 10);
+            args = args.find(' ') != std::string::npos ? args.substr(args.find(' ') + 1) : "";
+        }
+        std::string result;
+        std::string error;
+        if (search_logs(args, limit, result, error)) {
+            send_reply(fd, "OK\n" + result);
+        } else {
+            send_reply(fd, "ERR " + error + "\n");
+        }
+        close(fd);
+        return;
+    }
+    if (verb == "COUNT") {
+        std::string error;
+        std::string reply = format_counts(args, error);
+        send_reply(fd, error.empty() ? "OK\n" + reply : "ERR " + error + "\n");
+        close(fd);
+        return;
+    }
+    send_reply(fd, "ERR unknown command " + verb + "\n");
+    close(fd);
+}
 
+// Creates the Unix stream socket for control connections
+int open_control_socket(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("control socket failed");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("control socket bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Thread function accepting control connections. Each is handled by a
+// thread of its own, so a SETLEVEL waiting for clients or a slow DUMP holds
+// up no other command; beyond MAX_CONTROL_HANDLERS new connections wait in
+// the listen backlog.
+void control_loop(int listen_fd) {
     while (!shutdown_flag) {
-        int len = recvfrom(server_fd, buffer, BUF_LEN, 0, (struct sockaddr *)&client_addr, &addr_len);
-        if (len > 0) {
-            log_message(std::string(buffer, len));
+        {
+            std::unique_lock<std::mutex> lock(control_mutex);
+            if (!control_cv.wait_for(lock, std::chrono::seconds(1),
+                                     [] { return control_handlers < MAX_CONTROL_HANDLERS; })) {
+                continue;
+            }
+        }
+        struct pollfd p = { listen_fd, POLLIN, 0 };
+        if (poll(&p, 1, 1000) <= 0) {
+            continue;
         }
-        memset(buffer, 0, BUF_LEN);
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(control_mutex);
+            ++control_handlers;
+        }
+        std::thread([fd] {
+            handle_control(fd);
+            std::lock_guard<std::mutex> lock(control_mutex);
+            --control_handlers;
+            control_cv.notify_all();
+        }).detach();
     }
+    // The handlers use the log writers and the client table, which are torn
+    // down once this thread is joined
+    std::unique_lock<std::mutex> lock(control_mutex);
+    control_cv.wait(lock, [] { return control_handlers == 0; });
 }
 
-int main() {
-    // Clear the log file on startup
-    std::ofstream("server_log.txt", std::ios::trunc).close();
+// Prints the records matching sub as they arrive until ENTER is pressed
+void tail_until_enter(const LogSubscription& sub) {
+    if (!subscriber_sink_enabled) {
+        std::cout << "The subscribers sink is off, nothing to show." << std::endl;
+        return;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("socketpair failed");
+        return;
+    }
+    int id = subscribers->Add(pair[0], sub);
+    int read_fd = pair[1];
+    std::thread printer([read_fd] {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(read_fd, buf, sizeof(buf))) > 0) {
+            if (write(STDOUT_FILENO, buf, n) < 0) {
+                break;
+            }
+        }
+    });
+    std::cin.ignore();
+
+    // The fan-out closes its end, which ends the printer
+    subscribers->Remove(id);
+    printer.join();
+    close(read_fd);
+}
+
+// Derives the log file of a split shard: server_log.txt -> server_log.s2.txt
+std::string shard_log_path(const std::string& path, size_t id) {
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = path.length();
+    }
+    return path.substr(0, dot) + ".s" + std::to_string(id) + path.substr(dot);
+}
 
+// Creates a UDP socket bound to the server port. Shards share the port
+// through SO_REUSEPORT and the kernel hashes each client to one of them.
+int open_receiver_socket(bool reuse_port) {
     int server_fd;
     struct sockaddr_in server_addr;
-    
+
     // Create a UDP socket for the server to listen on
     if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("socket failed");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    int optval = 1;
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt SO_REUSEPORT failed");
+        close(server_fd);
+        return -1;
     }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(server_port);
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind failed");
-        exit(EXIT_FAILURE);
+        close(server_fd);
+        return -1;
+    }
+
+    // Leave room for bursts of batched datagrams while the receiver is busy
+    // (SO_RCVBUFFORCE lifts the rmem_max cap when running privileged)
+    int rcvbuf = RECV_BUFFER_BYTES;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    return server_fd;
+}
+
+// Thread function to receive log messages via UDP. Datagrams are drained
+// RECV_BATCH at a time with recvmmsg into buffers allocated once up front.
+void receive_logs(ReceiverShard* shard) {
+    int server_fd = shard->fd;
+    if (shard_count > 1) {
+        // Keep each shard's buffers and site table warm in one core's cache
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->id % std::thread::hardware_concurrency(), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    std::vector<char> buffers(RECV_BATCH * BUF_LEN);
+    std::vector<uint32_t> sequences(BUF_LEN / LOG_RECORD_V1_HEADER_LEN);
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    struct sockaddr_in client_addrs[RECV_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < RECV_BATCH; ++i) {
+        iovs[i].iov_base = &buffers[i * BUF_LEN];
+        iovs[i].iov_len = BUF_LEN;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &client_addrs[i];
+    }
+
+    // Set a timeout for the socket to make recvmmsg non-blocking
+    struct timeval tv;
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+    while (!shutdown_flag) {
+        for (int i = 0; i < RECV_BATCH; ++i) {
+            msgs[i].msg_hdr.msg_namelen = sizeof(client_addrs[i]);
+        }
+        // Block for the first datagram only, then take whatever else is queued
+        int count = recvmmsg(server_fd, msgs, RECV_BATCH, MSG_WAITFORONE, nullptr);
+        for (int i = 0; i < count; ++i) {
+            const char* buffer = &buffers[i * BUF_LEN];
+            size_t len = msgs[i].msg_len;
+            uint64_t source = LogSourceKey(client_addrs[i]);
+
+            // A datagram carries one or more complete records
+            size_t offset = 0;
+            size_t records = 0;
+            uint64_t sampled = 0;
+            uint32_t session_id = 0;
+            while (len > offset) {
+                LogRecordHeader hdr;
+                const char* payload;
+                size_t record_len = DecodeLogRecord(buffer + offset, len - offset, hdr, payload);
+                if (record_len == 0) {
+                    break;
+                }
+                handle_record(*shard, source, hdr, payload);
+                offset += record_len;
+                session_id = hdr.session_id;
+                sequences[records++] = hdr.sequence;
+                sampled += LogRecordSampledAway(hdr);
+            }
+            clients->Seen(source, session_id, sequences.data(), records, sampled, time(nullptr));
+        }
+        dispatch_batch(*shard);
+    }
+}
+
+// Fill of the fullest UDP receive queue or shared memory ring, 0 to 1
+double measure_backlog() {
+    double backlog = shm_server->Backlog();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(meminfo);
+        if (getsockopt(shards[i]->fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && meminfo[SK_MEMINFO_RCVBUF] > 0) {
+            backlog = std::max(backlog, static_cast<double>(meminfo[SK_MEMINFO_RMEM_ALLOC]) / meminfo[SK_MEMINFO_RCVBUF]);
+        }
+    }
+    return backlog;
+}
+
+// Thread function stepping the sampling up while the backlog is high and
+// down once it has stayed low for a while, and renewing the clients' leases
+void sampling_loop() {
+    int calm = 0;
+    while (!shutdown_flag) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(SAMPLING_INTERVAL_MS));
+        double backlog = measure_backlog();
+        int step = sampling_step;
+        if (backlog > BACKLOG_HIGH) {
+            step = std::min(step + 1, MAX_SAMPLING_STEP);
+            calm = 0;
+        } else if (backlog < BACKLOG_LOW && step > 0 && ++calm >= CALM_INTERVALS) {
+            step--;
+            calm = 0;
+        }
+        sampling_step = step;
+        if (step > 0) {
+            unsigned int debug_one_in;
+            unsigned int warning_one_in;
+            sampling_rates(step, debug_one_in, warning_one_in);
+            clients->Broadcast("Set Sampling=" + std::to_string(debug_one_in) + "," + std::to_string(warning_one_in) +
+                               "," + std::to_string(3 * SAMPLING_INTERVAL_MS), time(nullptr), CLIENT_IDLE_SECONDS);
+        }
+    }
+}
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]" << std::endl
+              << "  --buffer-kb=N        flush the log buffer once N KiB are pending (default 1024)" << std::endl
+              << "  --flush-ms=N         flush the log buffer at least every N ms (default 100)" << std::endl
+              << "  --durability=MODE    none, interval (group commit) or always (default none)" << std::endl
+              << "  --sync-ms=N          fdatasync interval for --durability=interval (default 1000)" << std::endl
+              << "  --rotate-mb=N        start a new segment once the log reaches N MiB" << std::endl
+              << "  --rotate-sec=N       start a new segment once the log is N seconds old" << std::endl
+              << "  --naming=SCHEME      closed segment names: numbered or dated (default numbered)" << std::endl
+              << "  --compress           compress closed segments in the background" << std::endl
+              << "  --index-every=N      records per sparse index block (default 256)" << std::endl
+              << "  --token-index        index the words of every record in the background for searches" << std::endl
+              << "  --log=PATH           log file (default server_log.txt)" << std::endl
+              << "  --shards=N           receive on N SO_REUSEPORT sockets, one thread per core (default 1)" << std::endl
+              << "  --shard-output=MODE  merged (one time-ordered log) or split (a log per shard)" << std::endl
+              << "  --merge-ms=N         how long merged lines wait for older ones (default 100)" << std::endl
+              << "  --control=PATH       Unix socket for control connections (default /tmp/logserver.sock)" << std::endl
+              << "  --stream=PATH        Unix socket for stream clients (default /tmp/logserver.stream)" << std::endl
+              << "  --shm=PATH           Unix socket for shared memory clients (default /tmp/logserver.shm)" << std::endl
+              << "  --sampling=MODE      auto (ask clients to sample while behind) or off (default auto)" << std::endl
+              << "  --port=N             UDP and TCP port the clients send to (default 8080)" << std::endl
+              << "  --sinks=LIST         where records go, of file,subscribers,forward" << std::endl
+              << "                       (default file,subscribers, plus forward with --forward)" << std::endl
+              << "  --forward=TARGET     upstream LogServer to forward records to, HOST:PORT or a socket path" << std::endl
+              << "  --daemon             run without the menu, driven through the control socket only" << std::endl
+              << "  --unpack=FILE        print a compressed segment to stdout and exit" << std::endl
+              << "  --read=FILE          print the records of a client crash file to stdout and exit" << std::endl;
+}
+
+// Reads the command line options into writer_config. Returns false on error.
+bool parse_options(int argc, char* argv[]) {
+    static const struct option options[] = {
+        { "buffer-kb", required_argument, nullptr, 'b' },
+        { "flush-ms", required_argument, nullptr, 'f' },
+        { "durability", required_argument, nullptr, 'd' },
+        { "sync-ms", required_argument, nullptr, 's' },
+        { "rotate-mb", required_argument, nullptr, 'r' },
+        { "rotate-sec", required_argument, nullptr, 't' },
+        { "naming", required_argument, nullptr, 'n' },
+        { "compress", no_argument, nullptr, 'c' },
+        { "unpack", required_argument, nullptr, 'u' },
+        { "read", required_argument, nullptr, 'R' },
+        { "index-every", required_argument, nullptr, 'i' },
+        { "token-index", no_argument, nullptr, 'K' },
+        { "control", required_argument, nullptr, 'C' },
+        { "log", required_argument, nullptr, 'l' },
+        { "shards", required_argument, nullptr, 'S' },
+        { "shard-output", required_argument, nullptr, 'O' },
+        { "merge-ms", required_argument, nullptr, 'm' },
+        { "stream", required_argument, nullptr, 'T' },
+        { "shm", required_argument, nullptr, 'M' },
+        { "sampling", required_argument, nullptr, 'A' },
+        { "daemon", no_argument, nullptr, 'D' },
+        { "port", required_argument, nullptr, 'p' },
+        { "sinks", required_argument, nullptr, 'k' },
+        { "forward", required_argument, nullptr, 'F' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 }
+    };
+    int opt;
+    bool sinks_given = false;
+    while ((opt = getopt_long(argc, argv, "h", options, nullptr)) != -1) {
+        switch (opt) {
+            case 'b':
+                writer_config.buffer_bytes = std::stoul(optarg) * 1024;
+                break;
+            case 'f':
+                writer_config.flush_interval_ms = std::stoi(optarg);
+                break;
+            case 'd':
+                if (!ParseDurability(optarg, writer_config.durability)) {
+                    std::cerr << "Unknown durability mode: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 's':
+                writer_config.sync_interval_ms = std::stoi(optarg);
+                break;
+            case 'r':
+                writer_config.rotate_bytes = std::stoul(optarg) * 1024 * 1024;
+                break;
+            case 't':
+                writer_config.rotate_seconds = std::stoi(optarg);
+                break;
+            case 'n':
+                if (!ParseSegmentNaming(optarg, writer_config.naming)) {
+                    std::cerr << "Unknown segment naming: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'c':
+                writer_config.compress = true;
+                break;
+            case 'i':
+                writer_config.index_every = std::stoul(optarg);
+                break;
+            case 'K':
+                writer_config.token_index = true;
+                break;
+            case 'C':
+                control_path = optarg;
+                break;
+            case 'l':
+                writer_config.path = optarg;
+                break;
+            case 'S':
+                shard_count = std::stoul(optarg);
+                if (shard_count < 1 || shard_count > MAX_SHARDS) {
+                    std::cerr << "Shards must be 1-" << MAX_SHARDS << std::endl;
+                    return false;
+                }
+                break;
+            case 'O':
+                if (strcmp(optarg, "merged") != 0 && strcmp(optarg, "split") != 0) {
+                    std::cerr << "Unknown shard output: " << optarg << std::endl;
+                    return false;
+                }
+                split_shards = strcmp(optarg, "split") == 0;
+                break;
+            case 'm':
+                merge_delay_ms = std::stoi(optarg);
+                break;
+            case 'T':
+                stream_path = optarg;
+                break;
+            case 'M':
+                shm_path = optarg;
+                break;
+            case 'A':
+                if (strcmp(optarg, "auto") != 0 && strcmp(optarg, "off") != 0) {
+                    std::cerr << "Unknown sampling mode: " << optarg << std::endl;
+                    return false;
+                }
+                adaptive_sampling = strcmp(optarg, "auto") == 0;
+                break;
+            case 'D':
+                daemon_mode = true;
+                break;
+            case 'p':
+                server_port = std::stoi(optarg);
+                if (server_port < 1 || server_port > 65535) {
+                    std::cerr << "Port must be 1-65535" << std::endl;
+                    return false;
+                }
+                break;
+            case 'k': {
+                sinks_given = true;
+                file_sink_enabled = subscriber_sink_enabled = forward_sink_enabled = false;
+                std::istringstream in(optarg);
+                std::string name;
+                while (std::getline(in, name, ',')) {
+                    if (name == "file") {
+                        file_sink_enabled = true;
+                    } else if (name == "subscribers") {
+                        subscriber_sink_enabled = true;
+                    } else if (name == "forward") {
+                        forward_sink_enabled = true;
+                    } else {
+                        std::cerr << "Unknown sink: " << name << std::endl;
+                        return false;
+                    }
+                }
+                break;
+            }
+            case 'F':
+                forward_target = optarg;
+                break;
+            case 'u':
+                exit(DecompressLogFile(optarg, STDOUT_FILENO) ? EXIT_SUCCESS : EXIT_FAILURE);
+            case 'R':
+                exit(print_crash_file(optarg) ? EXIT_SUCCESS : EXIT_FAILURE);
+            default:
+                return false;
+        }
+    }
+    if (!sinks_given) {
+        forward_sink_enabled = !forward_target.empty();
+    } else if (forward_sink_enabled && forward_target.empty()) {
+        std::cerr << "The forward sink needs --forward" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        if (!parse_options(argc, argv)) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    } catch (...) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Clear the log files on startup. Split shards each write their own file,
+    // otherwise the shards feed one log through the merger.
+    for (size_t i = 0; i < (split_shards ? shard_count : 1); ++i) {
+        LogWriterConfig config = writer_config;
+        if (split_shards && shard_count > 1) {
+            config.path = shard_log_path(writer_config.path, i);
+        }
+        LogWriter* writer = new LogWriter(config);
+        if (!writer->Open(true)) {
+            exit(EXIT_FAILURE);
+        }
+        log_writers.push_back(writer);
+    }
+    if (shard_count > 1 && !split_shards) {
+        merger = new LogMerger(log_writers[0], shard_count + 2, merge_delay_ms);
+        merger->Start();
+    }
+
+    for (size_t i = 0; i < shard_count; ++i) {
+        ReceiverShard* shard = new ReceiverShard();
+        shard->id = i;
+        shard->fd = open_receiver_socket(shard_count > 1);
+        if (shard->fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        shard->writer = merger != nullptr ? nullptr : log_writers[split_shards ? i : 0];
+        shards.push_back(shard);
+    }
+    int server_fd = shards[0]->fd;
+    stream_shard = new ReceiverShard();
+    stream_shard->id = shard_count;
+    stream_shard->fd = -1;
+    stream_shard->writer = merger != nullptr ? nullptr : log_writers[0];
+    shm_shard = new ReceiverShard();
+    shm_shard->id = shard_count + 1;
+    shm_shard->fd = -1;
+    shm_shard->writer = merger != nullptr ? nullptr : log_writers[0];
+
+    // The sinks are in place before the first record can arrive
+    subscribers = new LogSubscribers(SUBSCRIBER_QUEUE_BYTES);
+    subscribers->Start();
+    std::vector<ReceiverShard*> every_shard = all_shards();
+    std::vector<LogWriter*> shard_writers(every_shard.size());
+    for (size_t i = 0; i < every_shard.size(); ++i) {
+        every_shard[i]->batch = std::make_shared<LogSinkBatch>(every_shard[i]->id);
+        shard_writers[every_shard[i]->id] = every_shard[i]->writer;
+    }
+    if (file_sink_enabled) {
+        file_sink = new LogFileSink(shard_writers, merger, SINK_QUEUE_BYTES);
+        sinks.push_back(file_sink);
+    }
+    if (subscriber_sink_enabled) {
+        sinks.push_back(new LogSubscriberSink(subscribers, SINK_QUEUE_BYTES));
+    }
+    if (forward_sink_enabled) {
+        struct sockaddr_storage upstream;
+        socklen_t upstream_len;
+        std::string error;
+        if (!ParseForwardTarget(forward_target, upstream, upstream_len, error)) {
+            std::cerr << "Cannot forward to " << forward_target << ": " << error << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        sinks.push_back(new LogForwardSink((const struct sockaddr*)&upstream, upstream_len, FORWARD_BUFFER_BYTES,
+                                           SINK_QUEUE_BYTES));
+    }
+    for (size_t i = 0; i < sinks.size(); ++i) {
+        sinks[i]->Start();
+    }
+
+    // Level commands go out from the server socket, so clients see them come
+    // from the address they send to. Stream and shared memory clients get
+    // them on their connection.
+    clients = new LogClients(server_fd);
+    stream_server = new LogStreamServer(
+        [](uint64_t source, const LogRecordHeader& hdr, const char* payload) {
+            handle_record(*stream_shard, source, hdr, payload);
+        },
+        [](uint64_t source, uint32_t session_id, const uint32_t* sequences, size_t records, uint64_t sampled) {
+            clients->Seen(source, session_id, sequences, records, sampled, time(nullptr));
+            dispatch_batch(*stream_shard);
+        });
+    if (stream_server->Listen(server_port, stream_path)) {
+        stream_server->Start();
+    }
+    shm_server = new LogShmServer(
+        [](uint64_t source, const LogRecordHeader& hdr, const char* payload) {
+            handle_record(*shm_shard, source, hdr, payload);
+        },
+        [](uint64_t source, uint32_t session_id, const uint32_t* sequences, size_t records, uint64_t sampled) {
+            clients->Seen(source, session_id, sequences, records, sampled, time(nullptr));
+            dispatch_batch(*shm_shard);
+        });
+    if (shm_server->Listen(shm_path)) {
+        shm_server->Start();
+    }
+    clients->SetCommandSender([](uint64_t source, const std::string& command) {
+        if (IsLogShmSource(source)) {
+            shm_server->SendCommand(source, command);
+        } else {
+            stream_server->SendCommand(source, command);
+        }
+    });
+    int control_fd = open_control_socket(control_path);
+    if (control_fd >= 0) {
+        control_thread = std::thread(control_loop, control_fd);
+    }
+
+    // Start the threads to receive incoming log messages
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards[i]->thread = std::thread(receive_logs, shards[i]);
+    }
+    if (adaptive_sampling) {
+        sampling_thread = std::thread(sampling_loop);
+    }
+
+    if (daemon_mode) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = [](int) { shutdown_flag = true; };
+        sigaction(SIGTERM, &action, nullptr);
+        sigaction(SIGINT, &action, nullptr);
+        while (!shutdown_flag) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
     }
-    
-    // Start the thread to receive incoming log messages
-    receive_thread = std::thread(receive_logs, server_fd);
 
     char choice;
     std::string input;
     while (!shutdown_flag) {
         std::cout << "\n==== Log Server Menu ====" << std::endl;
-        std::cout << "1. Set the log level (send 'Set Log Level=<n>' to client)" << std::endl;
+        std::cout << "1. Set the log level (send 'Set Log Level=<n>' to clients)" << std::endl;
         std::cout << "2. Dump the server log file here" << std::endl;
+        std::cout << "3. Dump the records of the last N minutes" << std::endl;
+        std::cout << "4. Dump the records containing some text" << std::endl;
+        std::cout << "5. List the clients" << std::endl;
+        std::cout << "6. Show record loss per client" << std::endl;
+        std::cout << "7. Search the records for words (needs --token-index)" << std::endl;
         std::cout << "0. Shut down" << std::endl;
         std::cout << "Enter choice: ";
-        std::getline(std::cin, input);
+        if (!std::getline(std::cin, input)) {
+            // End of input, e.g. when started with stdin from a pipe
+            break;
+        }
         if (input.length() > 0) {
             choice = input[0];
         } else {
@@ -137,43 +1560,40 @@ int main() {
                 std::string level_str;
                 std::getline(std::cin, level_str);
                 if (!level_str.empty()) {
-                    int level = std::stoi(level_str);
+                    int level = -1;
+                    try {
+                        level = std::stoi(level_str);
+                    } catch (const std::exception&) {
+                        // Reported as an invalid level below
+                    }
                     if (level >= 0 && level <= 3) {
-                        std::string command = "Set Log Level=" + std::to_string(level);
-                        
-                        // Update the server's log level filter
-                        current_server_log_level = static_cast<LOG_LEVEL>(level);
-                        
-                        int sock = 0;
-                        struct sockaddr_in client_addr; 
-                        
-                        if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-                            std::cerr << "\n Socket creation error \n";
-                            break;
-                        }
-                        client_addr.sin_family = AF_INET;
-                        client_addr.sin_port = htons(CLIENT_LISTEN_PORT);
-                        
-                        if (inet_pton(AF_INET, "127.0.0.1", &client_addr.sin_addr) <= 0) {
-                            std::cerr << "\nInvalid address/ Address not supported \n";
+                        std::cout << "Send to which clients (all, name=GLOB, group=GLOB, addr=IP:PORT) [all]: ";
+                        std::string selector_text;
+                        std::getline(std::cin, selector_text);
+                        LogClientSelector selector;
+                        std::string error;
+                        if (!ParseClientSelector(selector_text, selector, error)) {
+                            std::cerr << "Invalid selection: " << error << std::endl;
                             break;
                         }
-                        
-                        sendto(sock, command.c_str(), command.length(), 0, (const struct sockaddr *)&client_addr, sizeof(client_addr));
-                        std::cout << "Sent command to client. Waiting for new logs to arrive..." << std::endl;
-                        close(sock);
-
-                        // Wait for a few seconds to let the client send new logs
-                        std::this_thread::sleep_for(std::chrono::seconds(5));
-                        
-                        // Dump the log file to show the new messages, using exact match
-                        dump_log_file(true);
+
+                        // Update the server's log level filter
+                        current_server_log_level = static_cast<LOG_LEVEL>(level);
+                        bool confirmed;
+                        std::cout << "Level " << set_level(selector, level, 1000, confirmed);
+
+                        // Show the new messages live as they arrive, using exact match
+                        std::cout << "Showing new " << LogLevelName(level)
+                                  << " records as they arrive, press ENTER to stop..." << std::endl;
+                        LogSubscription sub;
+                        sub.level_mask = LogLevelMask(level, true);
+                        tail_until_enter(sub);
                     } else {
                         std::cerr << "Invalid log level." << std::endl;
+                        std::cout << "Press ENTER to continue..." << std::endl;
+                        std::cin.ignore();
                     }
                 }
-                std::cout << "Press ENTER to continue..." << std::endl;
-                std::cin.ignore();
                 break;
             }
             case '2': {
@@ -183,6 +1603,70 @@ int main() {
                 std::cin.ignore();
                 break;
             }
+            case '3': {
+                // Asks again until it gets a number; an empty answer goes back to the menu
+                uint64_t minutes = 0;
+                std::string minutes_str;
+                for (;;) {
+                    std::cout << "Show records from the last how many minutes? ";
+                    if (!std::getline(std::cin, minutes_str) || minutes_str.empty()) {
+                        break;
+                    }
+                    try {
+                        minutes = std::stoull(minutes_str);
+                        break;
+                    } catch (const std::exception&) {
+                        std::cerr << "Not a number of minutes: " << minutes_str << std::endl;
+                    }
+                }
+                if (!minutes_str.empty()) {
+                    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+                    uint64_t span_ns = minutes < now_ns / (60 * 1000000000ULL) ? minutes * 60 * 1000000000ULL : now_ns;
+                    dump_log_file(false, now_ns - span_ns);
+                }
+                std::cout << "Press ENTER to continue..." << std::endl;
+                std::cin.ignore();
+                break;
+            }
+            case '4': {
+                std::cout << "Show records containing: ";
+                std::string pattern;
+                std::getline(std::cin, pattern);
+                if (!pattern.empty()) {
+                    dump_log_file(false, 0, UINT64_MAX, pattern);
+                }
+                std::cout << "Press ENTER to continue..." << std::endl;
+                std::cin.ignore();
+                break;
+            }
+            case '5': {
+                std::cout << format_clients();
+                std::cout << "Press ENTER to continue..." << std::endl;
+                std::cin.ignore();
+                break;
+            }
+            case '6': {
+                std::cout << format_stats();
+                std::cout << "Press ENTER to continue..." << std::endl;
+                std::cin.ignore();
+                break;
+            }
+            case '7': {
+                std::cout << "Search for records with all of the words: ";
+                std::string text;
+                std::getline(std::cin, text);
+                std::string result;
+                std::string error;
+                if (search_logs(text, 100, result, error)) {
+                    std::cout << result;
+                } else {
+                    std::cerr << "Cannot search: " << error << std::endl;
+                }
+                std::cout << "Press ENTER to continue..." << std::endl;
+                std::cin.ignore();
+                break;
+            }
             case '0':
                 shutdown_flag = true;
                 break;
@@ -193,10 +1677,46 @@ int main() {
     }
 
     shutdown_flag = true;
-    if (receive_thread.joinable()) {
-        receive_thread.join();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (shards[i]->thread.joinable()) {
+            shards[i]->thread.join();
+        }
+    }
+    if (control_thread.joinable()) {
+        control_thread.join();
+    }
+    if (sampling_thread.joinable()) {
+        sampling_thread.join();
+    }
+    stream_server->Stop();
+    delete stream_server;
+    delete stream_shard;
+    shm_server->Stop();
+    delete shm_server;
+    delete shm_shard;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        close(shards[i]->fd);
+        delete shards[i];
+    }
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(control_path.c_str());
+    }
+    for (size_t i = 0; i < sinks.size(); ++i) {
+        sinks[i]->Stop();
+        delete sinks[i];
+    }
+    subscribers->Stop();
+    delete subscribers;
+    delete clients;
+    if (merger != nullptr) {
+        merger->Stop();
+        delete merger;
+    }
+    for (size_t i = 0; i < log_writers.size(); ++i) {
+        log_writers[i]->Close();
+        delete log_writers[i];
     }
-    close(server_fd);
     return 0;
 }
 
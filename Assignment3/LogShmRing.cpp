@@ -0,0 +1,174 @@
+//LogShmRing.cpp - Shared memory ring carrying records from one Logger to LogServer
+
+#include "LogShmRing.h"
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the ring positions must be lock free to be shared between processes");
+
+const uint32_t PADDING = 0xffffffff;    // rest of the ring is unused, go back to the start
+const size_t ENTRY_ALIGN = 8;
+const size_t LENGTH_BYTES = 4;
+
+static size_t round_capacity(size_t capacity) {
+    size_t size = 4096;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+static size_t entry_size(size_t len) {
+    return (LENGTH_BYTES + len + ENTRY_ALIGN - 1) & ~(ENTRY_ALIGN - 1);
+}
+
+LogShmRing::LogShmRing()
+    : header(nullptr), data(nullptr), map_len(0), capacity(0), reserved_at(0), head(0), front_size(0) {
+}
+
+LogShmRing::~LogShmRing() {
+    if (header != nullptr) {
+        munmap(header, map_len);
+    }
+}
+
+size_t LogShmRing::MapSize(size_t capacity) {
+    return sizeof(LogShmRingHeader) + round_capacity(capacity);
+}
+
+bool LogShmRing::Create(int fd, size_t requested) {
+    map_len = MapSize(requested);
+    if (ftruncate(fd, map_len) < 0) {
+        return false;
+    }
+    void* p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    header = new (p) LogShmRingHeader();
+    capacity = round_capacity(requested);
+    header->capacity = capacity;
+    header->tail.store(0, std::memory_order_relaxed);
+    header->head.store(0, std::memory_order_relaxed);
+    header->consumer_waiting.store(0, std::memory_order_relaxed);
+    header->magic = LOG_SHM_MAGIC;
+    data = static_cast<char*>(p) + sizeof(LogShmRingHeader);
+    return true;
+}
+
+bool LogShmRing::Attach(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(LogShmRingHeader)) {
+        return false;
+    }
+    map_len = st.st_size;
+    void* p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    header = static_cast<LogShmRingHeader*>(p);
+    capacity = header->capacity;
+    if (header->magic != LOG_SHM_MAGIC || capacity < ENTRY_ALIGN || (capacity & (capacity - 1)) != 0 ||
+        sizeof(LogShmRingHeader) + capacity > map_len) {
+        munmap(p, map_len);
+        header = nullptr;
+        return false;
+    }
+    data = static_cast<char*>(p) + sizeof(LogShmRingHeader);
+    head = header->head.load(std::memory_order_acquire) & ~static_cast<uint64_t>(ENTRY_ALIGN - 1);
+    return true;
+}
+
+char* LogShmRing::Reserve(size_t len) {
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t consumed = header->head.load(std::memory_order_acquire);
+    size_t size = entry_size(len);
+    size_t offset = tail & (capacity - 1);
+    size_t padding = capacity - offset < size ? capacity - offset : 0;
+    if (tail + padding + size - consumed > capacity) {
+        return nullptr;
+    }
+    if (padding > 0) {
+        // Published with the entry itself by Commit
+        memcpy(data + offset, &PADDING, LENGTH_BYTES);
+        tail += padding;
+        offset = 0;
+    }
+    reserved_at = tail;
+    return data + offset + LENGTH_BYTES;
+}
+
+bool LogShmRing::Commit(size_t len) {
+    uint32_t length = len;
+    memcpy(data + (reserved_at & (capacity - 1)), &length, LENGTH_BYTES);
+    header->tail.store(reserved_at + entry_size(len), std::memory_order_release);
+
+    // Pairs with the fence in PrepareWait: either the consumer sees the new
+    // tail before it sleeps or we see that it is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return header->consumer_waiting.load(std::memory_order_relaxed) != 0 &&
+           header->consumer_waiting.exchange(0) != 0;
+}
+
+const char* LogShmRing::Front(size_t& len) {
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+    for (;;) {
+        uint64_t fill = tail - head;
+        if (fill == 0) {
+            return nullptr;
+        }
+        size_t offset = head & (capacity - 1);
+        if (fill > capacity || fill < LENGTH_BYTES) {
+            break;
+        }
+        uint32_t length;
+        memcpy(&length, data + offset, LENGTH_BYTES);
+        if (length == PADDING) {
+            if (capacity - offset > fill) {
+                break;
+            }
+            head += capacity - offset;
+            header->head.store(head, std::memory_order_release);
+            continue;
+        }
+        if (length > capacity - offset - LENGTH_BYTES || entry_size(length) > fill) {
+            break;
+        }
+        front_size = entry_size(length);
+        len = length;
+        return data + offset + LENGTH_BYTES;
+    }
+
+    // A broken client; drop everything it wrote
+    head = tail;
+    header->head.store(head, std::memory_order_release);
+    return nullptr;
+}
+
+void LogShmRing::PopFront() {
+    head += front_size;
+    front_size = 0;
+    header->head.store(head, std::memory_order_release);
+}
+
+bool LogShmRing::PrepareWait() {
+    header->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!Empty()) {
+        header->consumer_waiting.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+double LogShmRing::Fill() const {
+    uint64_t used = header->tail.load(std::memory_order_relaxed) - head;
+    return used > capacity ? 1.0 : static_cast<double>(used) / capacity;
+}
+
+bool LogShmRing::Empty() const {
+    return head == header->tail.load(std::memory_order_acquire);
+}
@@ -0,0 +1,76 @@
+//LogShmRing.h - Shared memory ring carrying records from one Logger to LogServer
+//
+// The client creates the ring in a memfd and hands the descriptor, together
+// with an eventfd, to the server over a Unix socket. The ring has a single
+// producer (the client, whose threads take turns) and a single consumer (the
+// server), so each side only ever writes its own position.
+//
+// Every entry is a 4 byte length followed by the encoded record, padded to 8
+// bytes. An entry never wraps: when the space left before the end of the ring
+// is too small, a padding marker sends the consumer back to the start.
+//
+// The consumer flags that it is about to sleep only after finding the ring
+// empty, and the producer writes the eventfd only when it sees that flag, so
+// a busy ring costs no system calls at all.
+//
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+const uint32_t LOG_SHM_MAGIC = 0x4c47524e;     // "LGRN"
+
+struct LogShmRingHeader {
+    uint32_t magic;
+    uint32_t capacity;                          // data bytes, a power of two
+    alignas(64) std::atomic<uint64_t> tail;     // bytes ever written, producer owned
+    alignas(64) std::atomic<uint64_t> head;     // bytes ever consumed, consumer owned
+    std::atomic<uint32_t> consumer_waiting;
+};
+
+class LogShmRing {
+    private:
+        LogShmRingHeader* header;
+        char* data;
+        size_t map_len;
+        uint64_t capacity;      // as mapped; the header is writable by the client
+        uint64_t reserved_at;   // producer: tail when the entry was reserved
+        uint64_t head;          // consumer: its own copy of the head it publishes
+        size_t front_size;      // consumer: bytes of the entry Front returned
+
+    public:
+        LogShmRing();
+        ~LogShmRing();
+
+        // Size of the memfd holding a ring of capacity data bytes, which is
+        // rounded up to a power of two
+        static size_t MapSize(size_t capacity);
+
+        // Maps the ring in fd. The producer initializes it with room for at
+        // least requested bytes, the consumer checks that it is one. Returns
+        // false on failure.
+        bool Create(int fd, size_t requested);
+        bool Attach(int fd);
+
+        // Producer: room for a record of up to len bytes, or nullptr if the
+        // ring is full. Commit publishes the record actually written there and
+        // returns true if the consumer is asleep and must be woken.
+        char* Reserve(size_t len);
+        bool Commit(size_t len);
+
+        // Consumer: the oldest record, or nullptr if the ring is empty.
+        // Positions and lengths the client wrote are checked against the
+        // capacity seen at Attach; a ring that does not add up is emptied.
+        const char* Front(size_t& len);
+        void PopFront();
+
+        // Consumer: flags that it is going to sleep. Returns false, and clears
+        // the flag again, if a record arrived meanwhile.
+        bool PrepareWait();
+
+        bool Empty() const;
+
+        // Fraction of the ring in use, 0 to 1
+        double Fill() const;
+};
@@ -0,0 +1,333 @@
+//LogShmServer.cpp - Consumer of the shared memory rings of same-host clients
+
+#include "LogShmServer.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+const int MAX_EVENTS = 64;
+const int LOOP_TIMEOUT_MS = 1000;
+const int POLL_US = 100;                // pause between drains while records keep coming
+const size_t MAX_MESSAGE = 64 * 1024;   // records sent on the connection per message
+const uint64_t KIND_LISTEN = 0;
+const uint64_t KIND_WAKE = 1;
+const uint64_t KIND_CLIENT = 2;
+const uint64_t KIND_EVENT = 3;
+
+static uint64_t event_data(uint64_t kind, int fd) {
+    return (kind << 32) | static_cast<uint32_t>(fd);
+}
+
+static void add_fd(int epoll_fd, uint64_t kind, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = event_data(kind, fd);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+LogShmServer::LogShmServer(const RecordHandler& _on_record, const BatchHandler& _on_batch)
+    : on_record(_on_record), on_batch(_on_batch), listen_fd(-1), sampled(0), message(MAX_MESSAGE),
+      running(false), backlog(0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    add_fd(epoll_fd, KIND_WAKE, wake_fd);
+}
+
+LogShmServer::~LogShmServer() {
+    Stop();
+    while (!clients.empty()) {
+        close_client(clients.begin()->first);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+bool LogShmServer::Listen(const std::string& _path) {
+    struct sockaddr_un addr;
+    if (_path.empty() || _path.length() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("shm socket failed");
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(_path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("shm socket bind failed");
+        close(fd);
+        return false;
+    }
+    listen_fd = fd;
+    path = _path;
+    add_fd(epoll_fd, KIND_LISTEN, listen_fd);
+    return true;
+}
+
+void LogShmServer::Start() {
+    running = true;
+    thread = std::thread(&LogShmServer::loop, this);
+}
+
+void LogShmServer::Stop() {
+    running = false;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already raised, the thread wakes up anyway
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+double LogShmServer::Backlog() const {
+    return backlog / 1000.0;
+}
+
+void LogShmServer::SendCommand(uint64_t source, const std::string& command) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        commands.push_back(std::make_pair(source, command));
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already raised, the thread wakes up anyway
+    }
+}
+
+void LogShmServer::accept_all() {
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        Client& client = clients[fd];
+        client.fd = fd;
+        client.event_fd = -1;
+        client.ring = nullptr;
+        client.has_session = false;
+        client.session_id = 0;
+        add_fd(epoll_fd, KIND_CLIENT, fd);
+    }
+}
+
+// Takes the ring memfd and the eventfd passed with a message
+bool LogShmServer::attach(Client& client, struct cmsghdr* cmsg) {
+    if (client.ring != nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        return false;
+    }
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    LogShmRing* ring = new LogShmRing();
+    bool attached = ring->Attach(fds[0]);
+    close(fds[0]);     // the mapping stays
+    if (!attached) {
+        delete ring;
+        close(fds[1]);
+        return false;
+    }
+    client.ring = ring;
+    client.event_fd = fds[1];
+    add_fd(epoll_fd, KIND_EVENT, client.event_fd);
+    return true;
+}
+
+// Reads what the client sent on its connection: first the records it wants
+// the server to know before anything in the ring (its identity and call
+// sites), then the ring itself. Returns false once the client is gone.
+bool LogShmServer::receive(Client& client) {
+    for (;;) {
+        struct iovec iov = { &message[0], message.size() };
+        union {
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(client.fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            return false;
+        }
+        size_t sequenced = 0;
+        size_t offset = 0;
+        while (offset < static_cast<size_t>(n)) {
+            size_t len = PeekLogRecordLength(&message[offset], n - offset);
+            if (len == 0 || len > n - offset) {
+                break;
+            }
+            deliver(client, &message[offset], len, sequenced);
+            offset += len;
+        }
+        flush_batch(client, sequenced);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != nullptr && !attach(client, cmsg)) {
+            return false;
+        }
+    }
+}
+
+void LogShmServer::close_client(int fd) {
+    std::map<int, Client>::iterator it = clients.find(fd);
+    if (it == clients.end()) {
+        return;
+    }
+    Client& client = it->second;
+    if (client.ring != nullptr) {
+        // Whatever the client wrote before it went away is still logged
+        drain(client);
+        delete client.ring;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.event_fd, nullptr);
+        close(client.event_fd);
+    }
+    if (client.has_session) {
+        std::map<uint32_t, int>::iterator session = sessions.find(client.session_id);
+        if (session != sessions.end() && session->second == fd) {
+            sessions.erase(session);
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    clients.erase(it);
+}
+
+// Hands one record to the handlers, collecting its sequence number
+void LogShmServer::deliver(Client& client, const char* record, size_t len, size_t& sequenced) {
+    LogRecordHeader hdr;
+    const char* payload;
+    if (DecodeLogRecord(record, len, hdr, payload) == 0) {
+        return;
+    }
+    if (!client.has_session || hdr.session_id != client.session_id) {
+        flush_batch(client, sequenced);
+        client.has_session = true;
+        client.session_id = hdr.session_id;
+        sessions[hdr.session_id] = client.fd;
+    }
+    on_record(LogShmSourceKey(hdr.session_id), hdr, payload);
+    sampled += LogRecordSampledAway(hdr);
+    if (!(hdr.flags & RECORD_FLAG_UNSEQUENCED)) {
+        if (sequenced == sequences.size()) {
+            sequences.resize(sequences.size() * 2 + 64);
+        }
+        sequences[sequenced++] = hdr.sequence;
+    }
+}
+
+void LogShmServer::flush_batch(Client& client, size_t& sequenced) {
+    if (sequenced > 0 || sampled > 0) {
+        on_batch(LogShmSourceKey(client.session_id), client.session_id, sequences.data(), sequenced, sampled);
+        sequenced = 0;
+        sampled = 0;
+    }
+}
+
+// Hands every record in the client's ring to the handlers. Returns how many
+// there were.
+size_t LogShmServer::drain(Client& client) {
+    size_t records = 0;
+    size_t sequenced = 0;
+    size_t len;
+    const char* record;
+    while ((record = client.ring->Front(len)) != nullptr) {
+        deliver(client, record, len, sequenced);
+        client.ring->PopFront();
+        records++;
+    }
+    flush_batch(client, sequenced);
+    return records;
+}
+
+// Writes the queued commands to the connections of their sessions
+void LogShmServer::send_commands() {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0) {
+        // Nothing was signalled, the queue may still hold something
+    }
+    std::vector<std::pair<uint64_t, std::string> > pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.swap(commands);
+    }
+    for (size_t i = 0; i < pending.size(); ++i) {
+        std::map<uint32_t, int>::iterator session = sessions.find(static_cast<uint32_t>(pending[i].first));
+        if (session != sessions.end()) {
+            send(session->second, pending[i].second.c_str(), pending[i].second.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    }
+}
+
+void LogShmServer::loop() {
+    struct epoll_event events[MAX_EVENTS];
+    while (running) {
+        size_t drained = 0;
+        double fill = 0;
+        for (std::map<int, Client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+            if (it->second.ring != nullptr) {
+                fill = std::max(fill, it->second.ring->Fill());
+                drained += drain(it->second);
+            }
+        }
+        backlog = static_cast<uint32_t>(fill * 1000);
+
+        // Sleep only once every ring is empty and flagged, otherwise come
+        // back after a short pause and take what accumulated meanwhile
+        bool idle = drained == 0;
+        for (std::map<int, Client>::iterator it = clients.begin(); idle && it != clients.end(); ++it) {
+            if (it->second.ring != nullptr && !it->second.ring->PrepareWait()) {
+                idle = false;
+            }
+        }
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, idle ? LOOP_TIMEOUT_MS : 0);
+        for (int i = 0; i < count; ++i) {
+            uint64_t kind = events[i].data.u64 >> 32;
+            int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+            if (kind == KIND_LISTEN) {
+                accept_all();
+            } else if (kind == KIND_WAKE) {
+                send_commands();
+            } else if (kind == KIND_EVENT) {
+                uint64_t value;
+                if (read(fd, &value, sizeof(value)) < 0) {
+                    // Already reset by an earlier event
+                }
+            } else if (kind == KIND_CLIENT) {
+                std::map<int, Client>::iterator it = clients.find(fd);
+                if (it == clients.end()) {
+                    continue;
+                }
+                if (!receive(it->second)) {
+                    close_client(fd);
+                }
+            }
+        }
+        if (!idle && count == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(POLL_US));
+        }
+    }
+}
@@ -0,0 +1,92 @@
+//LogShmServer.h - Consumer of the shared memory rings of same-host clients
+//
+// A client connects to a Unix seqpacket socket, sends its identity and call
+// sites as plain records and then passes the memfd of its ring and an
+// eventfd. Sending those first means a server that restarted knows them
+// before it reads what piled up in the ring meanwhile.
+//
+// One thread drains every ring; while records keep coming it polls the
+// rings, and only once they are all empty does it flag them and sleep until
+// an eventfd or a socket wakes it. The socket stays open for level commands and tells the server when the
+// client is gone, at which point its ring is drained one last time.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <sys/socket.h>
+#include "LogRecord.h"
+#include "LogClients.h"
+#include "LogShmRing.h"
+
+class LogShmServer {
+    public:
+        // Called on the server thread for every record
+        typedef std::function<void(uint64_t source, const LogRecordHeader& hdr, const char* payload)> RecordHandler;
+
+        // Called after each drain of a ring with the sequence numbers it held
+        // and the records the client sampled away in their place
+        typedef std::function<void(uint64_t source, uint32_t session_id, const uint32_t* sequences,
+                                   size_t records, uint64_t sampled)> BatchHandler;
+
+    private:
+        struct Client {
+            int fd;                 // seqpacket connection
+            int event_fd;           // written by the client to wake us, -1 until attached
+            LogShmRing* ring;
+            bool has_session;
+            uint32_t session_id;
+        };
+
+        RecordHandler on_record;
+        BatchHandler on_batch;
+        int epoll_fd;
+        int wake_fd;
+        int listen_fd;
+        std::string path;
+        std::map<int, Client> clients;          // by connection
+        std::map<uint32_t, int> sessions;       // connection of each session
+        std::vector<uint32_t> sequences;       // of the batch being delivered
+        uint64_t sampled;
+        std::vector<char> message;              // one message from a connection
+
+        std::mutex mutex;                       // guards commands
+        std::vector<std::pair<uint64_t, std::string> > commands;
+
+        std::thread thread;
+        std::atomic<bool> running;
+        std::atomic<uint32_t> backlog;          // fill of the fullest ring, in 1/1000
+
+        void accept_all();
+        bool attach(Client& client, struct cmsghdr* cmsg);
+        bool receive(Client& client);
+        void close_client(int fd);
+        void deliver(Client& client, const char* record, size_t len, size_t& sequenced);
+        void flush_batch(Client& client, size_t& sequenced);
+        size_t drain(Client& client);
+        void send_commands();
+        void loop();
+
+    public:
+        LogShmServer(const RecordHandler& _on_record, const BatchHandler& _on_batch);
+        ~LogShmServer();
+
+        // Listens on the Unix socket path. Returns false on failure.
+        bool Listen(const std::string& _path);
+
+        void Start();
+        void Stop();
+
+        // Fill of the fullest ring when it was last drained, 0 to 1
+        double Backlog() const;
+
+        // Queues a command for the client of source. It is dropped if the
+        // client is not connected by the time it is written.
+        void SendCommand(uint64_t source, const std::string& command);
+};
@@ -0,0 +1,344 @@
+//LogSinks.cpp - Where LogServer sends the records it ingests
+
+#include "LogSinks.h"
+#include "LogWriter.h"
+#include "LogMerger.h"
+#include "LogSubscribers.h"
+#include "LogStreamSender.h"
+#include "LogClients.h"
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+
+const int SINK_IDLE_MS = 100;           // how often an idle sink is called while its queue is empty
+const int FORWARD_WAIT_MS = 100;        // longest wait for the upstream server in one go
+const int FORWARD_STOP_MS = 2000;       // how long a stopping forwarder still waits for it
+
+void LogSinkBatch::Add(uint64_t source, const LogRecordHeader& hdr, const char* line_text, size_t line_len,
+                       const char* file, const char* function, int line, const char* message, size_t message_len) {
+    LogSinkEntry entry;
+    entry.timestamp_ns = hdr.timestamp_ns;
+    entry.source = source;
+    entry.line = line;
+    entry.level = hdr.level;
+    entry.weight = hdr.weight > 1 ? hdr.weight : 1;
+
+    size_t file_len = strlen(file) + 1;
+    size_t function_len = strlen(function) + 1;
+    size_t offset = text.size();
+    text.resize(offset + line_len + 1 + file_len + function_len + message_len + 1);
+    char* out = &text[offset];
+
+    entry.text = offset;
+    entry.text_len = line_len;
+    memcpy(out, line_text, line_len);
+    out[line_len] = '\0';
+    offset += line_len + 1;
+
+    entry.file = offset;
+    memcpy(&text[offset], file, file_len);
+    offset += file_len;
+
+    entry.function = offset;
+    memcpy(&text[offset], function, function_len);
+    offset += function_len;
+
+    entry.message = offset;
+    entry.message_len = message_len;
+    memcpy(&text[offset], message, message_len);
+    text[offset + message_len] = '\0';
+
+    entries.push_back(entry);
+}
+
+LogSink::LogSink(const std::string& _name, size_t max_queued_bytes, bool _lossless)
+    : name(_name), max_bytes(max_queued_bytes), lossless(_lossless), queued_records(0), queued_bytes(0), consumed(0),
+      dropped(0), running(false) {}
+
+LogSink::~LogSink() {
+    Stop();
+}
+
+void LogSink::Start() {
+    running = true;
+    thread = std::thread(&LogSink::run, this);
+}
+
+void LogSink::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    cv.notify_one();
+    room_cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+bool LogSink::Offer(const std::shared_ptr<const LogSinkBatch>& batch) {
+    size_t bytes = batch->Bytes();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (lossless) {
+            // A batch larger than the whole queue goes in once it is empty
+            room_cv.wait(lock, [this, bytes] { return queued_bytes == 0 || queued_bytes + bytes <= max_bytes ||
+                                                      !running; });
+        } else if (queued_bytes + bytes > max_bytes) {
+            dropped += batch->entries.size();
+            return false;
+        }
+        queue.push_back(batch);
+        queued_records += batch->entries.size();
+        queued_bytes += bytes;
+    }
+    cv.notify_one();
+    return true;
+}
+
+bool LogSink::Drain(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return drained_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                               [this] { return queue.empty() && !current; });
+}
+
+LogSinkLag LogSink::Lag() const {
+    LogSinkLag lag;
+    std::lock_guard<std::mutex> lock(mutex);
+    lag.batches = queue.size() + (current ? 1 : 0);
+    lag.records = queued_records;
+    lag.bytes = queued_bytes;
+    lag.consumed = consumed;
+    lag.dropped = dropped;
+    lag.oldest_ms = 0;
+    const LogSinkBatch* oldest = current ? current.get() : (queue.empty() ? nullptr : queue.front().get());
+    if (oldest != nullptr) {
+        lag.oldest_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - oldest->received).count();
+    }
+    return lag;
+}
+
+// A batch stays counted as queued until it is consumed, so the lag shows
+// what the sink is working through as well
+void LogSink::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (queue.empty()) {
+            drained_cv.notify_all();
+            if (!running) {
+                break;
+            }
+            cv.wait_for(lock, std::chrono::milliseconds(SINK_IDLE_MS));
+            if (queue.empty() && running) {
+                lock.unlock();
+                Idle();
+                lock.lock();
+            }
+            continue;
+        }
+        current = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        Consume(*current);
+        lock.lock();
+        queued_records -= current->entries.size();
+        queued_bytes -= current->Bytes();
+        consumed += current->entries.size();
+        current.reset();
+        room_cv.notify_all();
+    }
+    lock.unlock();
+    Finish();
+}
+
+LogFileSink::LogFileSink(const std::vector<LogWriter*>& shard_writers, LogMerger* _merger, size_t max_queued_bytes)
+    : LogSink("file", max_queued_bytes, true), writers(shard_writers), merger(_merger) {}
+
+void LogFileSink::Consume(const LogSinkBatch& batch) {
+    LogWriter* writer = batch.shard < writers.size() ? writers[batch.shard] : nullptr;
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+        const LogSinkEntry& entry = batch.entries[i];
+        if (writer != nullptr) {
+            writer->Append(batch.At(entry.text), entry.text_len, entry.level, entry.timestamp_ns);
+        } else {
+            merger->Append(batch.shard, batch.At(entry.text), entry.text_len, entry.level, entry.timestamp_ns);
+        }
+    }
+}
+
+LogSubscriberSink::LogSubscriberSink(LogSubscribers* _subscribers, size_t max_queued_bytes)
+    : LogSink("subscribers", max_queued_bytes), subscribers(_subscribers) {}
+
+void LogSubscriberSink::Consume(const LogSinkBatch& batch) {
+    if (subscribers->Count() == 0) {
+        return;
+    }
+    char source_text[32];
+    uint64_t formatted_source = 0;
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+        const LogSinkEntry& entry = batch.entries[i];
+        if (i == 0 || entry.source != formatted_source) {
+            FormatLogSource(entry.source, source_text, sizeof(source_text));
+            formatted_source = entry.source;
+        }
+        subscribers->Publish(batch.At(entry.text), entry.text_len, entry.level, batch.At(entry.file), source_text);
+    }
+}
+
+LogForwardSink::LogForwardSink(const struct sockaddr* addr, socklen_t addr_len, size_t buffer_bytes,
+                               size_t max_queued_bytes)
+    : LogSink("forward", max_queued_bytes), sender(new LogStreamSender(addr, addr_len, buffer_bytes)),
+      session_id(std::random_device()()) {
+    char host[256];
+    if (gethostname(host, sizeof(host)) != 0) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    hello_name = std::string("logserver@") + host;
+}
+
+LogForwardSink::~LogForwardSink() {
+    Stop();
+    delete sender;
+}
+
+// Connects if need be and moves records and acknowledgements, waiting up to
+// timeout_ms for the socket to have something to do
+void LogForwardSink::pump(int timeout_ms) {
+    LogStreamSender::ConnectHandler on_connect = [this](std::vector<char>& preamble) {
+        char payload[LOG_RECORD_MAX_LEN];
+        char record[LOG_RECORD_MAX_LEN];
+        LogRecordHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = RECORD_HELLO;
+        hdr.level = DEBUG;
+        hdr.flags = RECORD_FLAG_UNSEQUENCED;
+        hdr.weight = 1;
+        hdr.session_id = session_id;
+        hdr.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        size_t len = EncodeLogHello(payload, sizeof(payload), getpid(), hello_name.c_str(), "forward");
+        size_t record_len = EncodeLogRecord(record, sizeof(record), hdr, payload, len);
+        preamble.insert(preamble.end(), record, record + record_len);
+    };
+    LogStreamSender::CommandHandler on_command = [](const char*, size_t) {};
+
+    sender->Pump(on_connect, on_command);
+    if (timeout_ms <= 0) {
+        return;
+    }
+    int fd = sender->Fd();
+    if (fd < 0) {
+        // Reconnects are paced by the sender
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    } else {
+        struct pollfd p = { fd, static_cast<short>(POLLIN | (sender->Blocked() ? POLLOUT : 0)), 0 };
+        poll(&p, 1, timeout_ms);
+    }
+    sender->Pump(on_connect, on_command);
+}
+
+// Buffers one entry as an ENTRY record with its call site inline. Waits for
+// the upstream server to make room, except for a stopping forwarder whose
+// time is up.
+bool LogForwardSink::send_entry(const LogSinkBatch& batch, const LogSinkEntry& entry) {
+    char source_text[32];
+    char payload[LOG_RECORD_MAX_LEN];
+    char record[LOG_RECORD_MAX_LEN];
+    FormatLogSource(entry.source, source_text, sizeof(source_text));
+    size_t len = EncodeLogSite(payload, sizeof(payload), batch.At(entry.file), batch.At(entry.function), entry.line);
+    int prefix = snprintf(payload + len, sizeof(payload) - len, "[%s] ", source_text);
+    len += std::min(static_cast<size_t>(prefix), sizeof(payload) - len - 1);
+    size_t message_len = std::min(static_cast<size_t>(entry.message_len), sizeof(payload) - len);
+    memcpy(payload + len, batch.At(entry.message), message_len);
+    len += message_len;
+
+    LogRecordHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = RECORD_ENTRY;
+    hdr.level = entry.level;
+    hdr.flags = RECORD_FLAG_INLINE_SITE;
+    hdr.weight = entry.weight;
+    hdr.session_id = session_id;
+    hdr.timestamp_ns = entry.timestamp_ns;
+    size_t record_len = EncodeLogRecord(record, sizeof(record), hdr, payload, len);
+
+    while (!sender->Add(record, record_len)) {
+        if (Stopping()) {
+            if (give_up == std::chrono::steady_clock::time_point()) {
+                give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(FORWARD_STOP_MS);
+            } else if (std::chrono::steady_clock::now() >= give_up) {
+                return false;
+            }
+        }
+        pump(FORWARD_WAIT_MS);
+    }
+    return true;
+}
+
+void LogForwardSink::Consume(const LogSinkBatch& batch) {
+    for (size_t i = 0; i < batch.entries.size(); ++i) {
+        if (!send_entry(batch, batch.entries[i])) {
+            break;
+        }
+    }
+    pump(0);
+}
+
+void LogForwardSink::Idle() {
+    pump(0);
+}
+
+void LogForwardSink::Finish() {
+    std::chrono::steady_clock::time_point deadline = give_up != std::chrono::steady_clock::time_point()
+        ? give_up : std::chrono::steady_clock::now() + std::chrono::milliseconds(FORWARD_STOP_MS);
+    pump(0);
+    while (!sender->Idle() && std::chrono::steady_clock::now() < deadline) {
+        pump(FORWARD_WAIT_MS);
+    }
+}
+
+bool ParseForwardTarget(const std::string& text, struct sockaddr_storage& addr, socklen_t& addr_len,
+                        std::string& error) {
+    memset(&addr, 0, sizeof(addr));
+    if (!text.empty() && text[0] == '/') {
+        struct sockaddr_un* un = reinterpret_cast<struct sockaddr_un*>(&addr);
+        if (text.length() >= sizeof(un->sun_path)) {
+            error = "socket path too long";
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, text.c_str());
+        addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == text.length()) {
+        error = "expected HOST:PORT or a socket path";
+        return false;
+    }
+    std::string host = text.substr(0, colon);
+    std::string port = text.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* found = nullptr;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+    if (rc != 0) {
+        error = gai_strerror(rc);
+        return false;
+    }
+    memcpy(&addr, found->ai_addr, found->ai_addrlen);
+    addr_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
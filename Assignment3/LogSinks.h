@@ -0,0 +1,192 @@
+//LogSinks.h - Where LogServer sends the records it ingests
+//
+// A receiver thread collects the entries it renders into a LogSinkBatch and
+// hands each finished batch (one recvmmsg round, stream read or ring drain)
+// to every configured sink. Each sink keeps the batches in its own queue and
+// consumes them on its own thread, so a slow sink (a subscriber that stopped
+// reading, an upstream server that went away) only lets its own queue grow.
+// A queue never holds more than its byte limit; a batch that does not fit is
+// dropped for that sink alone and counted, and ingestion goes on at full
+// speed. The file sink is the exception: it must not lose records, so a full
+// queue makes the receiver wait for room, which stops it reading its sockets
+// and rings and pushes back on the clients.
+//
+// Batches are shared read-only between the sinks, so a batch is built once
+// however many sinks there are. Every sink reports its lag: what it has
+// queued and how long the oldest of it has been waiting.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sys/socket.h>
+#include "LogRecord.h"
+
+class LogWriter;
+class LogMerger;
+class LogSubscribers;
+class LogStreamSender;
+
+// One rendered entry; the strings are NUL terminated and live in the text
+// of its batch
+struct LogSinkEntry {
+    uint64_t timestamp_ns;
+    uint64_t source;
+    uint32_t text;              // the log line
+    uint32_t text_len;
+    uint32_t file;
+    uint32_t function;
+    uint32_t message;           // as logged, without the "[xN] " of a sampled record
+    uint32_t message_len;
+    int line;
+    uint8_t level;
+    uint16_t weight;
+};
+
+// The entries one shard received in one go
+struct LogSinkBatch {
+    size_t shard;
+    std::vector<char> text;
+    std::vector<LogSinkEntry> entries;
+    std::chrono::steady_clock::time_point received;    // when it was handed to the sinks
+
+    explicit LogSinkBatch(size_t _shard) : shard(_shard) {}
+
+    void Add(uint64_t source, const LogRecordHeader& hdr, const char* line_text, size_t line_len,
+             const char* file, const char* function, int line, const char* message, size_t message_len);
+    const char* At(uint32_t offset) const { return text.data() + offset; }
+    size_t Bytes() const { return text.size() + entries.size() * sizeof(LogSinkEntry); }
+};
+
+// What a sink is behind by
+struct LogSinkLag {
+    size_t batches;             // queued, counting the one being consumed
+    size_t records;
+    size_t bytes;
+    uint64_t oldest_ms;         // how long the oldest of them has waited
+    uint64_t consumed;          // records since the server started
+    uint64_t dropped;           // records that found the queue full
+};
+
+class LogSink {
+    private:
+        std::string name;
+        size_t max_bytes;
+        bool lossless;              // Offer waits for room rather than dropping
+
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable drained_cv;
+        std::condition_variable room_cv;
+        std::deque<std::shared_ptr<const LogSinkBatch> > queue;
+        std::shared_ptr<const LogSinkBatch> current;    // being consumed
+        size_t queued_records;
+        size_t queued_bytes;
+        uint64_t consumed;
+        uint64_t dropped;
+        std::atomic<bool> running;
+        std::thread thread;
+
+        void run();
+
+    protected:
+        // Called on the sink's thread with every batch, in the order offered
+        virtual void Consume(const LogSinkBatch& batch) = 0;
+
+        // Called on the sink's thread every so often while the queue is empty
+        virtual void Idle() {}
+
+        // Called on the sink's thread once the queue is empty after Stop
+        virtual void Finish() {}
+
+        // True once Stop was called
+        bool Stopping() const { return !running; }
+
+    public:
+        LogSink(const std::string& _name, size_t max_queued_bytes, bool _lossless = false);
+        virtual ~LogSink();
+
+        void Start();
+
+        // Consumes what is queued, then stops the thread
+        void Stop();
+
+        // Queues batch for the sink. When the queue has no room a lossless
+        // sink waits until it has, or the sink stops; any other returns false
+        // at once and counts the records as dropped.
+        bool Offer(const std::shared_ptr<const LogSinkBatch>& batch);
+
+        // Waits up to timeout_ms for the sink to consume everything offered
+        // so far. Returns false if it did not.
+        bool Drain(int timeout_ms);
+
+        LogSinkLag Lag() const;
+        const std::string& Name() const { return name; }
+};
+
+// Appends the lines to the shard's log file, or to the merge when the shards
+// share one log. It is lossless: a full queue holds up the receivers.
+class LogFileSink : public LogSink {
+    private:
+        std::vector<LogWriter*> writers;    // by shard, nullptr when merged
+        LogMerger* merger;
+
+    protected:
+        void Consume(const LogSinkBatch& batch) override;
+
+    public:
+        LogFileSink(const std::vector<LogWriter*>& shard_writers, LogMerger* _merger, size_t max_queued_bytes);
+};
+
+// Publishes the lines to the live subscribers, which filter them and hold
+// them for their connection
+class LogSubscriberSink : public LogSink {
+    private:
+        LogSubscribers* subscribers;
+
+    protected:
+        void Consume(const LogSinkBatch& batch) override;
+
+    public:
+        LogSubscriberSink(LogSubscribers* _subscribers, size_t max_queued_bytes);
+};
+
+// Sends the entries on to another LogServer as a stream client (see
+// LogStreamSender.h), so servers can be stacked into a hierarchy. Each entry
+// goes up with its own level, time, weight and call site, and its message
+// says which client it came from: "[<source>] <message>". The upstream server
+// lists the forwarder as one client named "logserver@<host>" in group
+// "forward"; the level and sampling commands it sends are not acted on.
+class LogForwardSink : public LogSink {
+    private:
+        LogStreamSender* sender;
+        uint32_t session_id;
+        std::string hello_name;
+        std::chrono::steady_clock::time_point give_up;  // when stopping: stop waiting for room
+
+        void pump(int timeout_ms);
+        bool send_entry(const LogSinkBatch& batch, const LogSinkEntry& entry);
+
+    protected:
+        void Consume(const LogSinkBatch& batch) override;
+        void Idle() override;
+        void Finish() override;
+
+    public:
+        LogForwardSink(const struct sockaddr* addr, socklen_t addr_len, size_t buffer_bytes,
+                       size_t max_queued_bytes);
+        ~LogForwardSink();
+};
+
+// Resolves the upstream server of a forwarder: "HOST:PORT" for TCP, or the
+// path of a Unix stream socket. Returns false and sets error when it cannot.
+bool ParseForwardTarget(const std::string& text, struct sockaddr_storage& addr, socklen_t& addr_len,
+                        std::string& error);
@@ -0,0 +1,198 @@
+//LogStreamSender.cpp - Lossless record stream from the Logger to LogServer
+
+#include "LogStreamSender.h"
+#include "LogRecord.h"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+const int FIRST_RETRY_MS = 100;
+const int MAX_RETRY_MS = 5000;
+const int CONNECT_TIMEOUT_MS = 1000;
+const size_t READ_CHUNK = 4096;
+const size_t COMPACT_BYTES = 64 * 1024;
+const size_t SEQUENCE_OFFSET = 12;      // of the sequence in a record header
+
+LogStreamSender::LogStreamSender(const struct sockaddr* _addr, socklen_t _addr_len, size_t max_buffer_bytes)
+    : addr_len(_addr_len), max_buffer(max_buffer_bytes), fd(-1), acked(0), sent(0), next_sequence(0),
+      preamble_sent(0), in(READ_CHUNK * 2), in_used(0), retry_ms(FIRST_RETRY_MS),
+      next_attempt(std::chrono::steady_clock::now()), blocked(false) {
+    memcpy(&addr, _addr, _addr_len);
+    out.reserve(max_buffer);
+}
+
+LogStreamSender::~LogStreamSender() {
+    disconnect();
+}
+
+bool LogStreamSender::Add(const char* record, size_t len) {
+    if (out.size() - acked + len > max_buffer) {
+        return false;
+    }
+    size_t offset = out.size();
+    out.insert(out.end(), record, record + len);
+    uint32_t sequence = htole32(next_sequence++);
+    memcpy(&out[offset + SEQUENCE_OFFSET], &sequence, 4);
+    return true;
+}
+
+int LogStreamSender::Fd() const {
+    return fd;
+}
+
+bool LogStreamSender::Blocked() const {
+    return blocked;
+}
+
+bool LogStreamSender::Idle() const {
+    return acked == out.size();
+}
+
+void LogStreamSender::Unacknowledged(const char*& data, size_t& len) const {
+    data = out.data() + acked;
+    len = out.size() - acked;
+}
+
+void LogStreamSender::disconnect() {
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    blocked = false;
+}
+
+// Opens a new connection unless the retry delay since the last failure is
+// still running. Everything unacknowledged goes out again after the preamble.
+bool LogStreamSender::connect_now(const ConnectHandler& on_connect) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < next_attempt) {
+        return false;
+    }
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    bool connected = false;
+    if (fd >= 0) {
+        if (connect(fd, (const struct sockaddr*)&addr, addr_len) == 0) {
+            connected = true;
+        } else if (errno == EINPROGRESS) {
+            struct pollfd p = { fd, POLLOUT, 0 };
+            int error = 0;
+            socklen_t len = sizeof(error);
+            connected = poll(&p, 1, CONNECT_TIMEOUT_MS) == 1 &&
+                        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+        }
+    }
+    if (!connected) {
+        disconnect();
+        next_attempt = now + std::chrono::milliseconds(retry_ms);
+        retry_ms = retry_ms * 2 > MAX_RETRY_MS ? MAX_RETRY_MS : retry_ms * 2;
+        return false;
+    }
+    retry_ms = FIRST_RETRY_MS;
+    if (addr.ss_family == AF_INET) {
+        // Batches are written whole, there is nothing for Nagle to coalesce
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    sent = acked;
+    preamble.clear();
+    preamble_sent = 0;
+    on_connect(preamble);
+    in_used = 0;
+    return true;
+}
+
+// Writes the preamble, then the records not written to this connection yet
+bool LogStreamSender::write_pending() {
+    blocked = false;
+    while (preamble_sent < preamble.size() || sent < out.size()) {
+        bool in_preamble = preamble_sent < preamble.size();
+        const char* data = in_preamble ? &preamble[preamble_sent] : &out[sent];
+        size_t len = in_preamble ? preamble.size() - preamble_sent : out.size() - sent;
+        ssize_t n = send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                blocked = true;
+                return true;
+            }
+            disconnect();
+            return false;
+        }
+        (in_preamble ? preamble_sent : sent) += n;
+    }
+    return true;
+}
+
+// Drops the acknowledged records from the front of the buffer
+void LogStreamSender::acknowledge(uint32_t sequence) {
+    while (acked < sent) {
+        uint32_t record_sequence;
+        memcpy(&record_sequence, &out[acked + SEQUENCE_OFFSET], 4);
+        if (static_cast<int32_t>(le32toh(record_sequence) - sequence) > 0) {
+            break;
+        }
+        acked += PeekLogRecordLength(&out[acked], out.size() - acked);
+    }
+    // Move the rest to the front once that is cheap compared to what was freed
+    if (acked >= COMPACT_BYTES && acked * 2 >= out.size()) {
+        out.erase(out.begin(), out.begin() + acked);
+        sent -= acked;
+        acked = 0;
+    }
+}
+
+// Handles the acknowledgements and commands the server has sent
+bool LogStreamSender::read_replies(const CommandHandler& on_command) {
+    for (;;) {
+        if (in.size() - in_used < READ_CHUNK) {
+            in.resize(in.size() * 2);
+        }
+        ssize_t n = recv(fd, &in[in_used], in.size() - in_used, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            disconnect();
+            return false;
+        }
+        if (n < 0) {
+            return true;
+        }
+        in_used += n;
+
+        size_t offset = 0;
+        for (;;) {
+            size_t len = PeekLogRecordLength(&in[offset], in_used - offset);
+            if (len == SIZE_MAX) {
+                disconnect();
+                return false;
+            }
+            if (len == 0 || len > in_used - offset) {
+                break;
+            }
+            LogRecordHeader hdr;
+            const char* payload;
+            DecodeLogRecord(&in[offset], len, hdr, payload);
+            if (hdr.type == RECORD_ACK) {
+                acknowledge(hdr.sequence);
+            } else if (hdr.type == RECORD_COMMAND) {
+                on_command(payload, hdr.payload_len);
+            }
+            offset += len;
+        }
+        memmove(&in[0], &in[offset], in_used - offset);
+        in_used -= offset;
+    }
+}
+
+void LogStreamSender::Pump(const ConnectHandler& on_connect, const CommandHandler& on_command) {
+    if (fd < 0 && !connect_now(on_connect)) {
+        return;
+    }
+    if (write_pending()) {
+        read_replies(on_command);
+    }
+}
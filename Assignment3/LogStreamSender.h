@@ -0,0 +1,81 @@
+//LogStreamSender.h - Lossless record stream from the Logger to LogServer
+//
+// Records are kept in an in-memory buffer and written back to back to a TCP
+// or Unix stream socket; the record header is the framing. The server
+// acknowledges the sequence numbers it has processed and only acknowledged
+// records leave the buffer. After a reconnect everything unacknowledged is
+// sent again, and the server drops what it had already seen, so no record is
+// lost or doubled as long as the buffer has room.
+//
+// Records get their sequence numbers here, in the order they are sent, which
+// is what lets the server tell a resent record from a new one.
+//
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <sys/socket.h>
+
+class LogStreamSender {
+    public:
+        // Called with the text of each command the server sends
+        typedef std::function<void(const char* command, size_t len)> CommandHandler;
+
+        // Called after every (re)connect to fill in records that must precede
+        // the resent ones, such as the client identity and its call sites.
+        // They are not acknowledged and are sent again on every connect.
+        typedef std::function<void(std::vector<char>& preamble)> ConnectHandler;
+
+    private:
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        size_t max_buffer;
+        int fd;
+
+        std::vector<char> out;      // records not acknowledged yet, oldest first
+        size_t acked;               // bytes at the front of out already acknowledged
+        size_t sent;                // bytes of out written to this connection
+        uint32_t next_sequence;
+        std::vector<char> preamble;
+        size_t preamble_sent;
+        std::vector<char> in;       // partial records from the server
+        size_t in_used;
+
+        int retry_ms;
+        std::chrono::steady_clock::time_point next_attempt;
+        bool blocked;               // the last write did not take everything
+
+        bool connect_now(const ConnectHandler& on_connect);
+        void disconnect();
+        bool write_pending();
+        bool read_replies(const CommandHandler& on_command);
+        void acknowledge(uint32_t sequence);
+
+    public:
+        LogStreamSender(const struct sockaddr* _addr, socklen_t _addr_len, size_t max_buffer_bytes);
+        ~LogStreamSender();
+
+        // Buffers a copy of the encoded record with the next sequence number.
+        // Returns false when the buffer has no room for it.
+        bool Add(const char* record, size_t len);
+
+        // Connects if needed, then writes what the socket takes and handles
+        // acknowledgements and commands. Never blocks for long.
+        void Pump(const ConnectHandler& on_connect, const CommandHandler& on_command);
+
+        // Socket to poll, -1 while disconnected
+        int Fd() const;
+
+        // True when the socket could not take everything at the last Pump
+        bool Blocked() const;
+
+        // True when the server has acknowledged every record
+        bool Idle() const;
+
+        // The buffered records the server has not acknowledged, for a last
+        // copy when the process is about to die
+        void Unacknowledged(const char*& data, size_t& len) const;
+};
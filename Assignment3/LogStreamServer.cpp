@@ -0,0 +1,365 @@
+//LogStreamServer.cpp - Receiving side of the lossless stream transports
+
+#include "LogStreamServer.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+const int MAX_EVENTS = 64;
+const int LOOP_TIMEOUT_MS = 1000;
+const size_t READ_CHUNK = 64 * 1024;
+const size_t MAX_PENDING_REPLIES = 1024 * 1024;   // a client that stops reading is cut off
+const time_t SESSION_IDLE_SECONDS = 600;          // disconnected sessions are forgotten after
+
+LogStreamServer::LogStreamServer(const RecordHandler& _on_record, const BatchHandler& _on_batch)
+    : on_record(_on_record), on_batch(_on_batch), running(false) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+LogStreamServer::~LogStreamServer() {
+    Stop();
+    while (!connections.empty()) {
+        close_connection(connections.begin()->first);
+    }
+    for (size_t i = 0; i < listen_fds.size(); ++i) {
+        close(listen_fds[i]);
+    }
+    if (!unix_path.empty()) {
+        unlink(unix_path.c_str());
+    }
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+bool LogStreamServer::add_listener(int fd) {
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("stream listen failed");
+        close(fd);
+        return false;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    listen_fds.push_back(fd);
+    return true;
+}
+
+bool LogStreamServer::Listen(int tcp_port, const std::string& _unix_path) {
+    int tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (tcp_fd >= 0) {
+        int optval = 1;
+        setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(tcp_port);
+        if (bind(tcp_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("stream bind failed");
+            close(tcp_fd);
+        } else {
+            add_listener(tcp_fd);
+        }
+    }
+
+    struct sockaddr_un addr;
+    if (!_unix_path.empty() && _unix_path.length() < sizeof(addr.sun_path)) {
+        int unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, _unix_path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(_unix_path.c_str());
+        if (unix_fd >= 0 && bind(unix_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("stream socket bind failed");
+            close(unix_fd);
+        } else if (unix_fd >= 0 && add_listener(unix_fd)) {
+            unix_path = _unix_path;
+        }
+    }
+    return !listen_fds.empty();
+}
+
+void LogStreamServer::Start() {
+    running = true;
+    thread = std::thread(&LogStreamServer::loop, this);
+}
+
+void LogStreamServer::Stop() {
+    running = false;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already raised, the thread wakes up anyway
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void LogStreamServer::SendCommand(uint64_t source, const std::string& command) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        commands.push_back(std::make_pair(source, command));
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already raised, the thread wakes up anyway
+    }
+}
+
+void LogStreamServer::accept_all(int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        Connection& conn = connections[fd];
+        conn.fd = fd;
+        conn.in.resize(READ_CHUNK * 2);
+        conn.in_used = 0;
+        conn.has_session = false;
+        conn.session_id = 0;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void LogStreamServer::close_connection(int fd) {
+    std::map<int, Connection>::iterator it = connections.find(fd);
+    if (it == connections.end()) {
+        return;
+    }
+    if (it->second.has_session) {
+        std::map<uint32_t, Session>::iterator session = sessions.find(it->second.session_id);
+        if (session != sessions.end() && session->second.fd == fd) {
+            session->second.fd = -1;
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(it);
+}
+
+void LogStreamServer::queue_reply(Connection& conn, LOG_RECORD_TYPE type, uint32_t session_id, uint32_t sequence,
+                                  const char* payload, size_t len) {
+    char record[LOG_RECORD_MAX_LEN];
+    LogRecordHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.sequence = sequence;
+    hdr.session_id = session_id;
+    hdr.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    size_t record_len = EncodeLogRecord(record, sizeof(record), hdr, payload, len);
+    conn.out.append(record, record_len);
+}
+
+// Sends what the socket takes and waits for EPOLLOUT while anything is left
+void LogStreamServer::write_replies(Connection& conn) {
+    while (!conn.out.empty()) {
+        ssize_t n = send(conn.fd, conn.out.data(), conn.out.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        conn.out.erase(0, n);
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = conn.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    ev.data.fd = conn.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+// Hands the complete records in data to the handlers, skipping those of the
+// session that were processed before, and acknowledges them
+void LogStreamServer::deliver(Connection& conn, uint32_t session_id, const char* data, size_t len) {
+    Session& session = sessions[session_id];
+    conn.has_session = true;
+    conn.session_id = session_id;
+    session.fd = conn.fd;
+    session.last_seen = time(nullptr);
+
+    uint64_t source = LogStreamSourceKey(session_id);
+    size_t records = 0;
+    uint64_t sampled = 0;
+    size_t offset = 0;
+    while (offset < len) {
+        LogRecordHeader hdr;
+        const char* payload;
+        size_t record_len = DecodeLogRecord(data + offset, len - offset, hdr, payload);
+        if (record_len == 0) {
+            break;
+        }
+        offset += record_len;
+        if (!(hdr.flags & RECORD_FLAG_UNSEQUENCED)) {
+            // Serial number arithmetic, so the counter may wrap
+            if (session.started && static_cast<int32_t>(hdr.sequence - session.last_sequence) <= 0) {
+                continue;
+            }
+            session.started = true;
+            session.last_sequence = hdr.sequence;
+            if (records == sequences.size()) {
+                sequences.resize(sequences.size() * 2 + 64);
+            }
+            sequences[records++] = hdr.sequence;
+        }
+        sampled += LogRecordSampledAway(hdr);
+        on_record(source, hdr, payload);
+    }
+    if (records > 0) {
+        on_batch(source, session_id, sequences.data(), records, sampled);
+    }
+    if (session.started) {
+        queue_reply(conn, RECORD_ACK, session_id, session.last_sequence, "", 0);
+    }
+}
+
+// Reads everything available and passes on the complete records, a run of
+// records of the same session at a time
+void LogStreamServer::read_connection(Connection& conn) {
+    int fd = conn.fd;
+    for (;;) {
+        if (conn.in.size() - conn.in_used < READ_CHUNK) {
+            conn.in.resize(conn.in.size() * 2);
+        }
+        ssize_t n = recv(fd, &conn.in[conn.in_used], conn.in.size() - conn.in_used, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            close_connection(fd);
+            return;
+        }
+        conn.in_used += n;
+
+        size_t offset = 0;
+        size_t run_start = 0;
+        uint32_t run_session = 0;
+        for (;;) {
+            size_t record_len = PeekLogRecordLength(&conn.in[offset], conn.in_used - offset);
+            if (record_len == SIZE_MAX) {
+                close_connection(fd);
+                return;
+            }
+            if (record_len == 0 || record_len > conn.in_used - offset) {
+                break;
+            }
+            LogRecordHeader hdr;
+            const char* payload;
+            DecodeLogRecord(&conn.in[offset], record_len, hdr, payload);
+            if (offset > run_start && hdr.session_id != run_session) {
+                deliver(conn, run_session, &conn.in[run_start], offset - run_start);
+                run_start = offset;
+            }
+            run_session = hdr.session_id;
+            offset += record_len;
+        }
+        if (offset > run_start) {
+            deliver(conn, run_session, &conn.in[run_start], offset - run_start);
+        }
+        memmove(&conn.in[0], &conn.in[offset], conn.in_used - offset);
+        conn.in_used -= offset;
+    }
+
+    if (conn.out.length() > MAX_PENDING_REPLIES) {
+        close_connection(fd);
+        return;
+    }
+    write_replies(conn);
+}
+
+// Writes the queued commands to the connections of their sessions
+void LogStreamServer::send_commands() {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0) {
+        // Nothing was signalled, the queue may still hold something
+    }
+    std::vector<std::pair<uint64_t, std::string> > pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.swap(commands);
+    }
+    for (size_t i = 0; i < pending.size(); ++i) {
+        std::map<uint32_t, Session>::iterator session = sessions.find(static_cast<uint32_t>(pending[i].first));
+        if (session == sessions.end() || session->second.fd < 0) {
+            continue;
+        }
+        Connection& conn = connections[session->second.fd];
+        queue_reply(conn, RECORD_COMMAND, session->first, 0, pending[i].second.c_str(), pending[i].second.length());
+        write_replies(conn);
+    }
+}
+
+// Forgets sessions whose client has been gone for a long time
+void LogStreamServer::prune(time_t now) {
+    std::map<uint32_t, Session>::iterator it = sessions.begin();
+    while (it != sessions.end()) {
+        if (it->second.fd < 0 && now - it->second.last_seen > SESSION_IDLE_SECONDS) {
+            sessions.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void LogStreamServer::loop() {
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_prune = time(nullptr);
+    while (running) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, LOOP_TIMEOUT_MS);
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                send_commands();
+                continue;
+            }
+            bool listener = false;
+            for (size_t j = 0; j < listen_fds.size(); ++j) {
+                listener = listener || listen_fds[j] == fd;
+            }
+            if (listener) {
+                accept_all(fd);
+                continue;
+            }
+            std::map<int, Connection>::iterator it = connections.find(fd);
+            if (it == connections.end()) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                write_replies(it->second);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_connection(it->second);
+            }
+        }
+        time_t now = time(nullptr);
+        if (now - last_prune >= LOOP_TIMEOUT_MS / 1000) {
+            prune(now);
+            last_prune = now;
+        }
+    }
+}
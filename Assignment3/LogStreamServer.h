@@ -0,0 +1,96 @@
+//LogStreamServer.h - Receiving side of the lossless stream transports
+//
+// Accepts Logger connections on a TCP port and a Unix socket and splits the
+// byte stream back into records. A client is identified by its session ID
+// rather than its connection, so a client that reconnects keeps its call
+// sites and registry entry. The last sequence number processed per session
+// is remembered: records a client resends after a reconnect are dropped, and
+// every read is answered with an ACK so the client can free its buffer.
+//
+// Commands for stream clients are queued by any thread and written to the
+// client's connection by the single server thread.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <ctime>
+#include "LogRecord.h"
+#include "LogClients.h"
+
+class LogStreamServer {
+    public:
+        // Called on the server thread for every record not seen before
+        typedef std::function<void(uint64_t source, const LogRecordHeader& hdr, const char* payload)> RecordHandler;
+
+        // Called after each read with the sequence numbers it delivered and
+        // the records the client sampled away in their place
+        typedef std::function<void(uint64_t source, uint32_t session_id, const uint32_t* sequences,
+                                   size_t records, uint64_t sampled)> BatchHandler;
+
+    private:
+        struct Connection {
+            int fd;
+            std::vector<char> in;
+            size_t in_used;
+            std::string out;        // ACKs and commands the socket did not take yet
+            bool has_session;
+            uint32_t session_id;
+        };
+
+        struct Session {
+            uint32_t last_sequence; // highest sequence processed
+            bool started;
+            int fd;                 // current connection, -1 while disconnected
+            time_t last_seen;
+        };
+
+        RecordHandler on_record;
+        BatchHandler on_batch;
+        int epoll_fd;
+        int wake_fd;
+        std::vector<int> listen_fds;
+        std::string unix_path;
+        std::map<int, Connection> connections;
+        std::map<uint32_t, Session> sessions;
+        std::vector<uint32_t> sequences;
+
+        std::mutex mutex;           // guards commands
+        std::vector<std::pair<uint64_t, std::string> > commands;
+
+        std::thread thread;
+        std::atomic<bool> running;
+
+        bool add_listener(int fd);
+        void accept_all(int listen_fd);
+        void close_connection(int fd);
+        void read_connection(Connection& conn);
+        void deliver(Connection& conn, uint32_t session_id, const char* data, size_t len);
+        void queue_reply(Connection& conn, LOG_RECORD_TYPE type, uint32_t session_id, uint32_t sequence,
+                         const char* payload, size_t len);
+        void write_replies(Connection& conn);
+        void send_commands();
+        void prune(time_t now);
+        void loop();
+
+    public:
+        LogStreamServer(const RecordHandler& _on_record, const BatchHandler& _on_batch);
+        ~LogStreamServer();
+
+        // Listens on the TCP port and the Unix socket path. Returns false if
+        // neither could be opened.
+        bool Listen(int tcp_port, const std::string& _unix_path);
+
+        void Start();
+        void Stop();
+
+        // Queues a command for the stream client of source. It is dropped if
+        // the client is not connected by the time it is written.
+        void SendCommand(uint64_t source, const std::string& command);
+};
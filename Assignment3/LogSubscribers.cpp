@@ -0,0 +1,217 @@
+//LogSubscribers.cpp - Live filtered tail subscriptions
+
+#include "LogSubscribers.h"
+#include "LogIndex.h"
+#include <sstream>
+#include <cerrno>
+#include <fnmatch.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+bool ParseSubscription(const std::string& text, LogSubscription& sub, std::string& error) {
+    std::istringstream in(text);
+    std::string word;
+    int level = 0;
+    bool exact_match = false;
+    while (in >> word) {
+        size_t eq = word.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + word;
+            return false;
+        }
+        std::string key = word.substr(0, eq);
+        std::string value = word.substr(eq + 1);
+        if (key == "level") {
+            level = atoi(value.c_str());
+            if (level < 0 || level > 3) {
+                error = "level must be 0-3";
+                return false;
+            }
+        } else if (key == "match") {
+            if (value != "exact" && value != "cumulative") {
+                error = "match must be exact or cumulative";
+                return false;
+            }
+            exact_match = value == "exact";
+        } else if (key == "file") {
+            sub.file_pattern = value;
+        } else if (key == "source") {
+            sub.source_pattern = value;
+        } else {
+            error = "unknown key " + key;
+            return false;
+        }
+    }
+    sub.level_mask = LogLevelMask(level, exact_match);
+    return true;
+}
+
+LogSubscribers::LogSubscribers(size_t max_pending_bytes)
+    : max_pending(max_pending_bytes), count(0), next_id(1), wake_fd(-1), running(false) {
+}
+
+LogSubscribers::~LogSubscribers() {
+    Stop();
+}
+
+void LogSubscribers::Start() {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    running = true;
+    sender_thread = std::thread(&LogSubscribers::send_loop, this);
+}
+
+void LogSubscribers::Stop() {
+    if (running) {
+        running = false;
+        wake();
+    }
+    if (sender_thread.joinable()) {
+        sender_thread.join();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        close(subscribers[i]->fd);
+        delete subscribers[i];
+    }
+    subscribers.clear();
+    count = 0;
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+void LogSubscribers::wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, so the sender is awake anyway
+    }
+}
+
+int LogSubscribers::Add(int fd, const LogSubscription& filter) {
+    Subscriber* sub = new Subscriber();
+    sub->fd = fd;
+    sub->filter = filter;
+    sub->sent = 0;
+    sub->dropped = 0;
+    sub->closed = false;
+    std::lock_guard<std::mutex> lock(mutex);
+    sub->id = next_id++;
+    subscribers.push_back(sub);
+    count = subscribers.size();
+    return sub->id;
+}
+
+void LogSubscribers::Remove(int id) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            if (subscribers[i]->id == id) {
+                subscribers[i]->closed = true;
+            }
+        }
+    }
+    wake();
+}
+
+size_t LogSubscribers::Count() const {
+    return count;
+}
+
+void LogSubscribers::Publish(const char* line, size_t len, int level, const char* file, const char* source) {
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < subscribers.size(); ++i) {
+            Subscriber* sub = subscribers[i];
+            const LogSubscription& filter = sub->filter;
+            if (!(filter.level_mask & (1u << level)) ||
+                (!filter.file_pattern.empty() && fnmatch(filter.file_pattern.c_str(), file, 0) != 0) ||
+                (!filter.source_pattern.empty() && fnmatch(filter.source_pattern.c_str(), source, 0) != 0)) {
+                continue;
+            }
+            if (sub->pending.size() + len + 1 > max_pending) {
+                sub->dropped++;
+                continue;
+            }
+            queued = queued || sub->pending.empty();
+            sub->pending.append(line, len);
+            sub->pending.push_back('\n');
+        }
+    }
+    // Only the first line of a batch needs to wake the sender
+    if (queued) {
+        wake();
+    }
+}
+
+// Thread function writing each subscriber's pending lines without blocking.
+// A subscriber that hangs up, fails or was removed is dropped here.
+void LogSubscribers::send_loop() {
+    std::vector<struct pollfd> fds;
+    std::vector<Subscriber*> polled;
+
+    while (running) {
+        fds.clear();
+        polled.clear();
+        struct pollfd wake_poll = { wake_fd, POLLIN, 0 };
+        fds.push_back(wake_poll);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < subscribers.size();) {
+                Subscriber* sub = subscribers[i];
+                if (sub->closed) {
+                    close(sub->fd);
+                    delete sub;
+                    subscribers.erase(subscribers.begin() + i);
+                    continue;
+                }
+                if (sub->outgoing.size() == sub->sent) {
+                    sub->outgoing.clear();
+                    sub->sent = 0;
+                    sub->outgoing.swap(sub->pending);
+                }
+                // Subscribers never send after subscribing, so readable means hung up
+                struct pollfd p = { sub->fd, static_cast<short>(POLLRDHUP | (sub->outgoing.empty() ? 0 : POLLOUT)), 0 };
+                fds.push_back(p);
+                polled.push_back(sub);
+                ++i;
+            }
+            count = subscribers.size();
+        }
+
+        if (poll(fds.data(), fds.size(), 1000) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t value;
+            if (read(wake_fd, &value, sizeof(value)) < 0) {
+                // Spurious wakeup, nothing to drain
+            }
+        }
+
+        // Only the sender thread deletes subscribers, so these stay valid
+        for (size_t i = 0; i < polled.size(); ++i) {
+            Subscriber* sub = polled[i];
+            short revents = fds[i + 1].revents;
+            if (revents & (POLLERR | POLLHUP | POLLNVAL | POLLRDHUP)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                sub->closed = true;
+                continue;
+            }
+            if (!(revents & POLLOUT)) {
+                continue;
+            }
+            ssize_t n = send(sub->fd, sub->outgoing.data() + sub->sent, sub->outgoing.size() - sub->sent,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                sub->sent += n;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::lock_guard<std::mutex> lock(mutex);
+                sub->closed = true;
+            }
+        }
+    }
+}
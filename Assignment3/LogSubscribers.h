@@ -0,0 +1,73 @@
+//LogSubscribers.h - Live filtered tail subscriptions
+//
+// A subscriber is a connected stream socket plus a filter. Publish() runs on
+// the ingest path and only appends matching lines to the subscriber's pending
+// buffer; a single sender thread writes the buffers out with non-blocking
+// sends. A subscriber whose buffer is full loses lines (they are counted)
+// instead of slowing ingestion down.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+struct LogSubscription {
+    uint32_t level_mask;            // see LogLevelMask
+    std::string file_pattern;       // fnmatch glob on the source file, empty = any
+    std::string source_pattern;     // fnmatch glob on the client, empty = any
+
+    LogSubscription() : level_mask(~0u) {}
+};
+
+// Parses "level=<n> match=exact|cumulative file=<glob> source=<glob>"; every
+// key is optional. Returns false and sets error for anything else.
+bool ParseSubscription(const std::string& text, LogSubscription& sub, std::string& error);
+
+class LogSubscribers {
+    private:
+        struct Subscriber {
+            int id;
+            int fd;
+            LogSubscription filter;
+            std::string pending;    // filled by Publish, guarded by mutex
+            std::string outgoing;   // owned by the sender thread
+            size_t sent;            // bytes of outgoing already sent
+            uint64_t dropped;
+            bool closed;
+        };
+
+        size_t max_pending;
+        std::mutex mutex;
+        std::vector<Subscriber*> subscribers;
+        std::atomic<size_t> count;
+        int next_id;
+        int wake_fd;
+        std::atomic<bool> running;
+        std::thread sender_thread;
+
+        void send_loop();
+        void wake();
+
+    public:
+        explicit LogSubscribers(size_t max_pending_bytes);
+        ~LogSubscribers();
+
+        void Start();
+        void Stop();
+
+        // Takes ownership of the connected socket fd. Returns the subscriber ID.
+        int Add(int fd, const LogSubscription& filter);
+
+        // Disconnects a subscriber
+        void Remove(int id);
+
+        // Queues a rendered line for every subscriber whose filter matches.
+        // Never blocks on a subscriber.
+        void Publish(const char* line, size_t len, int level, const char* file, const char* source);
+
+        size_t Count() const;
+};
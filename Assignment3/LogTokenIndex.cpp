@@ -0,0 +1,512 @@
+//LogTokenIndex.cpp - Inverted index of the words in the server log
+
+#include "LogTokenIndex.h"
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+const size_t INDEX_CHUNK = 1024 * 1024;     // read back per step of the thread
+const size_t MAX_LINE_READ = 8192;          // of a line found by a search
+const char TOKEN_MAGIC[4] = { 'L', 'T', 'I', '1' };
+
+// The message of a line rendered by FormatLogLine follows the date, the time,
+// the level and file:function:line, each ended by a space
+static const char* message_of(const char* line, const char* end) {
+    const char* p = line;
+    for (int spaces = 0; spaces < 4; ++spaces) {
+        p = static_cast<const char*>(memchr(p, ' ', end - p));
+        if (p == nullptr) {
+            return line;
+        }
+        ++p;
+    }
+    return p;
+}
+
+static bool is_token_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Moves p past the next word of [p, end) and puts it into token, lowercased.
+// Returns false once there are no more words.
+static bool next_token(const char*& p, const char* end, std::string& token) {
+    while (true) {
+        while (p < end && !is_token_char(*p)) {
+            ++p;
+        }
+        if (p == end) {
+            return false;
+        }
+        const char* start = p;
+        while (p < end && is_token_char(*p)) {
+            ++p;
+        }
+        size_t len = p - start;
+        if (len < 2 || len > MAX_TOKEN_LEN) {
+            continue;       // single letters and digits are too common to help
+        }
+        token.resize(len);
+        for (size_t i = 0; i < len; ++i) {
+            char c = start[i];
+            token[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+        return true;
+    }
+}
+
+std::vector<std::string> LogTokens(const std::string& text) {
+    std::vector<std::string> words;
+    const char* p = text.data();
+    std::string token;
+    while (next_token(p, text.data() + text.length(), token)) {
+        if (std::find(words.begin(), words.end(), token) == words.end()) {
+            words.push_back(token);
+        }
+    }
+    return words;
+}
+
+static void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Reads the varint at data[pos], moving pos past it
+static uint64_t get_varint(const char* data, size_t len, size_t& pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (pos < len && shift < 64) {
+        uint8_t byte = data[pos++];
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
+
+static void decode_postings(const char* data, size_t len, std::vector<uint64_t>& offsets) {
+    uint64_t offset = 0;
+    size_t i = 0;
+    while (i < len) {
+        offset += get_varint(data, len, i);
+        offsets.push_back(offset);
+    }
+}
+
+// Offsets present in every list, which are each sorted
+static std::vector<uint64_t> intersect(std::vector<std::vector<uint64_t>>& lists) {
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) { return a.size() < b.size(); });
+    std::vector<uint64_t> result = lists[0];
+    for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+        std::vector<uint64_t> next;
+        std::set_intersection(result.begin(), result.end(), lists[i].begin(), lists[i].end(),
+                              std::back_inserter(next));
+        result.swap(next);
+    }
+    return result;
+}
+
+static void put_le32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+static uint32_t get_le32(const char* p) {
+    const uint8_t* b = reinterpret_cast<const uint8_t*>(p);
+    return b[0] | b[1] << 8 | b[2] << 16 | static_cast<uint32_t>(b[3]) << 24;
+}
+
+LogTokenIndex::LogTokenIndex() : current_written(0), waiting(false), indexed(0), running(false) {
+}
+
+LogTokenIndex::~LogTokenIndex() {
+    Stop();
+}
+
+void LogTokenIndex::Start(int fd, uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Segment segment = { fd, "", 0, false };
+    segments.push_back(segment);
+    current_written.store(size);
+    indexed = 0;
+    running = true;
+    thread = std::thread(&LogTokenIndex::index_loop, this);
+}
+
+// Either the thread sees the new size before it waits, or it has set
+// waiting by then and is woken
+void LogTokenIndex::Written(uint64_t size) {
+    current_written.store(size);
+    if (waiting.exchange(false)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_one();
+    }
+}
+
+void LogTokenIndex::Rotated(const std::string& segment, uint64_t size, int next_fd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!segments.empty() && !segments.back().closed) {
+        segments.back().name = segment;
+        segments.back().written = size;
+        segments.back().closed = true;
+    }
+    if (next_fd >= 0) {
+        Segment next = { next_fd, "", 0, false };
+        segments.push_back(next);
+    }
+    current_written.store(0);
+    cv.notify_one();
+}
+
+// Bytes on disk of segment. The caller holds mutex.
+uint64_t LogTokenIndex::written_of(const Segment& segment) const {
+    return segment.closed ? segment.written : current_written.load();
+}
+
+// Adds every complete line of data, which starts at offset in the front
+// segment, to batch, whose deltas start from 0
+void LogTokenIndex::index_lines(const char* data, size_t len, uint64_t offset, TokenMap& batch) {
+    const char* end = data + len;
+    std::string token;
+    for (const char* line = data; line < end;) {
+        const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (eol == nullptr) {
+            break;
+        }
+        uint64_t line_offset = offset + (line - data);
+        const char* p = message_of(line, eol);
+        while (next_token(p, eol, token)) {
+            Postings& postings = batch[token];
+            if (postings.records > 0 && postings.last == line_offset) {
+                continue;       // the word came up before in this line
+            }
+            put_varint(postings.deltas, line_offset - postings.last);
+            postings.last = line_offset;
+            ++postings.records;
+        }
+        line = eol + 1;
+    }
+}
+
+// Appends the postings of batch, which all follow those in tokens, and
+// empties it. The caller holds mutex.
+void LogTokenIndex::merge(TokenMap& batch) {
+    for (TokenMap::iterator it = batch.begin(); it != batch.end(); ++it) {
+        const Postings& more = it->second;
+        Postings& postings = tokens[it->first];
+        size_t pos = 0;
+        uint64_t first = get_varint(more.deltas.data(), more.deltas.length(), pos);
+        put_varint(postings.deltas, first - postings.last);
+        postings.deltas.append(more.deltas, pos, std::string::npos);
+        postings.last = more.last;
+        postings.records += more.records;
+    }
+    batch.clear();
+}
+
+// Writes the index of the front segment to <segment>.tok. Only the thread
+// changes tokens, so it runs without mutex.
+bool LogTokenIndex::persist(const std::string& segment) {
+    std::vector<const TokenMap::value_type*> sorted;
+    sorted.reserve(tokens.size());
+    for (TokenMap::const_iterator it = tokens.begin(); it != tokens.end(); ++it) {
+        sorted.push_back(&*it);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const TokenMap::value_type* a, const TokenMap::value_type* b) { return a->first < b->first; });
+
+    std::string out(TOKEN_MAGIC, sizeof(TOKEN_MAGIC));
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const std::string& word = sorted[i]->first;
+        const Postings& postings = sorted[i]->second;
+        out.push_back(static_cast<char>(word.length()));
+        out += word;
+        put_le32(out, postings.records);
+        put_le32(out, postings.deltas.length());
+        out += postings.deltas;
+    }
+
+    std::string path = segment + ".tok";
+    std::string partial = path + ".tmp";
+    FILE* file = fopen(partial.c_str(), "wb");
+    if (file == nullptr) {
+        perror("LogTokenIndex: cannot create the index");
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.length(), file) == out.length();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(partial.c_str(), path.c_str()) != 0) {
+        std::cerr << "LogTokenIndex: failed to write " << path << std::endl;
+        unlink(partial.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Thread function reading back what was written, a chunk at a time, and
+// writing out the index of every segment it finishes. Only the front of
+// segments is popped, and only here, so its fd stays open while the chunk is
+// read and tokenized without mutex.
+void LogTokenIndex::index_loop() {
+    std::vector<char> buffer(INDEX_CHUNK);
+    TokenMap batch;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv.wait(lock, [this] {
+            waiting.store(true);
+            return !running || (!segments.empty() && (written_of(segments.front()) > indexed ||
+                                                      segments.front().closed));
+        });
+        waiting.store(false);
+        if (!running) {
+            break;
+        }
+
+        Segment& segment = segments.front();
+        uint64_t written = written_of(segment);
+        if (indexed < written) {
+            int fd = segment.fd;
+            uint64_t begin = indexed;
+            size_t want = std::min<uint64_t>(written - indexed, buffer.size());
+            lock.unlock();
+            ssize_t got = pread(fd, buffer.data(), want, begin);
+            size_t used = 0;
+            if (got > 0) {
+                // Only whole lines; a line longer than a chunk is skipped
+                const char* last = static_cast<const char*>(memrchr(buffer.data(), '\n', got));
+                used = last != nullptr ? last + 1 - buffer.data() : got;
+                index_lines(buffer.data(), used, begin, batch);
+            }
+            lock.lock();
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("LogTokenIndex: cannot read the log back");
+                indexed = written;
+                continue;
+            }
+            merge(batch);
+            indexed += used;
+            continue;
+        }
+
+        // Closed and complete: the index goes next to the segment
+        std::string name = segment.name;
+        lock.unlock();
+        bool saved = persist(name);
+        lock.lock();
+        if (saved) {
+            persisted.push_back(name);
+        }
+        close(segments.front().fd);
+        segments.pop_front();
+        tokens.clear();
+        indexed = 0;
+    }
+}
+
+// Reads the postings of words from the sidecar of segment. Returns false if
+// there is none or a word does not occur.
+bool LogTokenIndex::load_postings(const std::string& segment, const std::vector<std::string>& words,
+                                  std::vector<std::vector<uint64_t>>& lists) {
+    FILE* file = fopen((segment + ".tok").c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    std::string data;
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, n);
+    }
+    fclose(file);
+    if (data.length() < sizeof(TOKEN_MAGIC) || memcmp(data.data(), TOKEN_MAGIC, sizeof(TOKEN_MAGIC)) != 0) {
+        return false;
+    }
+
+    lists.assign(words.size(), std::vector<uint64_t>());
+    size_t found = 0;
+    size_t pos = sizeof(TOKEN_MAGIC);
+    while (pos < data.length() && found < words.size()) {
+        size_t word_len = static_cast<uint8_t>(data[pos]);
+        if (pos + 1 + word_len + 8 > data.length()) {
+            break;
+        }
+        const char* word = data.data() + pos + 1;
+        uint32_t deltas_len = get_le32(word + word_len + 4);
+        const char* deltas = word + word_len + 8;
+        if (deltas + deltas_len > data.data() + data.length()) {
+            break;
+        }
+        for (size_t i = 0; i < words.size(); ++i) {
+            if (words[i].length() == word_len && memcmp(words[i].data(), word, word_len) == 0) {
+                decode_postings(deltas, deltas_len, lists[i]);
+                ++found;
+            }
+        }
+        pos = deltas + deltas_len - data.data();
+    }
+    return found == words.size();
+}
+
+// Finds the lines of [begin, end) containing all of words the slow way
+void LogTokenIndex::scan_segment(int fd, uint64_t begin, uint64_t end, const std::vector<std::string>& words,
+                                 std::vector<uint64_t>& offsets) {
+    std::vector<char> buffer(INDEX_CHUNK);
+    std::vector<std::string> line_tokens;
+    std::string token;
+    while (begin < end) {
+        ssize_t got = pread(fd, buffer.data(), std::min<uint64_t>(end - begin, buffer.size()), begin);
+        if (got <= 0) {
+            return;
+        }
+        const char* data = buffer.data();
+        const char* stop = data + got;
+        const char* line = data;
+        for (const char* eol; (eol = static_cast<const char*>(memchr(line, '\n', stop - line))) != nullptr;
+             line = eol + 1) {
+            line_tokens.clear();
+            const char* p = message_of(line, eol);
+            while (next_token(p, eol, token)) {
+                line_tokens.push_back(token);
+            }
+            size_t matched = 0;
+            while (matched < words.size() &&
+                   std::find(line_tokens.begin(), line_tokens.end(), words[matched]) != line_tokens.end()) {
+                ++matched;
+            }
+            if (matched == words.size()) {
+                offsets.push_back(begin + (line - data));
+            }
+        }
+        if (line == data) {
+            line = stop;        // no line end in a whole chunk
+        }
+        begin += line - data;
+    }
+}
+
+size_t LogTokenIndex::Search(const std::vector<std::string>& words, size_t limit, std::vector<std::string>& lines) {
+    if (words.empty()) {
+        return 0;
+    }
+
+    // Matches per segment, oldest first; closed segments are read by name.
+    // Under mutex the state is only copied, with the fds of the segments
+    // still being indexed duplicated so the thread may close its own.
+    struct Hits {
+        int fd;                 // owned, or -1 to open name
+        std::string name;
+        std::vector<uint64_t> offsets;
+        uint64_t unindexed;     // lines from here to written are scanned
+        uint64_t written;
+    };
+    std::vector<Hits> hits;
+    std::vector<std::string> closed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = persisted;
+        for (size_t i = 0; i < segments.size(); ++i) {
+            Hits segment_hits = { fcntl(segments[i].fd, F_DUPFD_CLOEXEC, 0), "", std::vector<uint64_t>(), 0,
+                                  written_of(segments[i]) };
+            if (segment_hits.fd < 0) {
+                perror("LogTokenIndex: cannot search the log");
+                continue;
+            }
+            if (i == 0) {
+                std::vector<std::vector<uint64_t>> lists;
+                for (size_t w = 0; w < words.size(); ++w) {
+                    TokenMap::const_iterator it = tokens.find(words[w]);
+                    if (it == tokens.end()) {
+                        lists.clear();
+                        break;
+                    }
+                    lists.push_back(std::vector<uint64_t>());
+                    decode_postings(it->second.deltas.data(), it->second.deltas.length(), lists.back());
+                }
+                if (!lists.empty()) {
+                    segment_hits.offsets = intersect(lists);
+                }
+                segment_hits.unindexed = indexed;
+            }
+            hits.push_back(segment_hits);
+        }
+    }
+    for (size_t i = 0; i < hits.size(); ++i) {
+        scan_segment(hits[i].fd, hits[i].unindexed, hits[i].written, words, hits[i].offsets);
+    }
+    std::vector<Hits> closed_hits;
+    for (size_t i = 0; i < closed.size(); ++i) {
+        std::vector<std::vector<uint64_t>> lists;
+        if (load_postings(closed[i], words, lists)) {
+            Hits segment_hits = { -1, closed[i], intersect(lists), 0, 0 };
+            closed_hits.push_back(segment_hits);
+        }
+    }
+    hits.insert(hits.begin(), closed_hits.begin(), closed_hits.end());
+
+    // Only the newest limit lines are read
+    size_t total = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        total += hits[i].offsets.size();
+    }
+    size_t skip = total > limit ? total - limit : 0;
+    char buffer[MAX_LINE_READ];
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (skip >= hits[i].offsets.size()) {
+            skip -= hits[i].offsets.size();
+            continue;
+        }
+        int fd = hits[i].fd;
+        if (fd < 0) {
+            fd = hits[i].fd = open(hits[i].name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                skip = 0;
+                continue;       // compressed and removed by now
+            }
+        }
+        for (size_t j = skip; j < hits[i].offsets.size(); ++j) {
+            ssize_t got = pread(fd, buffer, sizeof(buffer), hits[i].offsets[j]);
+            if (got <= 0) {
+                continue;
+            }
+            const char* eol = static_cast<const char*>(memchr(buffer, '\n', got));
+            lines.push_back(std::string(buffer, eol != nullptr ? eol - buffer : got));
+        }
+        skip = 0;
+    }
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (hits[i].fd >= 0) {
+            close(hits[i].fd);
+        }
+    }
+    return total;
+}
+
+void LogTokenIndex::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+        cv.notify_one();
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        close(segments[i].fd);
+    }
+    segments.clear();
+    tokens.clear();
+}
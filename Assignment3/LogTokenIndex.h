@@ -0,0 +1,107 @@
+//LogTokenIndex.h - Inverted index of the words in the server log
+//
+// A background thread reads back what LogWriter has written and maps every
+// word of a record's message (runs of letters, digits and '_', lowercased) to
+// the file offsets of the records containing it. The offsets of a word are
+// kept as varint deltas, a few bits per record for common words. Appending
+// lines never waits for the index: the writer only tells the thread how far
+// the file has grown, and a search scans whatever the thread has not reached
+// yet.
+//
+// The index of the current segment lives in memory. When a segment is
+// closed its index is written next to it as <segment>.tok:
+//
+//   "LTI1", then per word in sorted order: word length (1 byte), the word,
+//   the number of records (4 bytes), the length of the deltas (4 bytes) and
+//   the deltas; lengths are little-endian.
+//
+// Closed segments are searchable for as long as their uncompressed file is
+// around.
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+
+const size_t MAX_TOKEN_LEN = 64;            // longer words are not indexed
+
+class LogTokenIndex {
+    private:
+        struct Postings {
+            std::string deltas;         // varint offset deltas, the first from 0
+            uint64_t last;              // offset of the last record added
+            uint32_t records;
+
+            Postings() : last(0), records(0) {}
+        };
+        typedef std::unordered_map<std::string, Postings> TokenMap;
+
+        // A segment the thread has still to finish. The fd reads it even
+        // after it is renamed.
+        struct Segment {
+            int fd;
+            std::string name;           // closed segment, empty while current
+            uint64_t written;           // bytes on disk once closed; see current_written
+            bool closed;
+        };
+
+        // The writer calls Written() under its own lock for every flush, so
+        // it never takes mutex: the size of the current segment is published
+        // through current_written, and mutex is only taken to wake the
+        // thread when it is waiting for more. The thread and Search() do
+        // their reading and tokenizing without mutex and hold it only to
+        // merge or copy the results.
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Segment> segments;   // the front one is being indexed
+        std::atomic<uint64_t> current_written;  // bytes on disk of the current segment
+        std::atomic<bool> waiting;      // the thread is about to wait for Written()
+        TokenMap tokens;                // of the front segment, changed by the thread only
+        uint64_t indexed;               // lines of the front segment before this offset are in tokens
+        std::vector<std::string> persisted;     // closed segments with a sidecar, oldest first
+        bool running;
+        std::thread thread;
+
+        uint64_t written_of(const Segment& segment) const;
+        void index_loop();
+        static void index_lines(const char* data, size_t len, uint64_t offset, TokenMap& batch);
+        void merge(TokenMap& batch);
+        bool persist(const std::string& segment);
+        static bool load_postings(const std::string& segment, const std::vector<std::string>& words,
+                                  std::vector<std::vector<uint64_t>>& lists);
+        static void scan_segment(int fd, uint64_t begin, uint64_t end, const std::vector<std::string>& words,
+                                 std::vector<uint64_t>& offsets);
+
+    public:
+        LogTokenIndex();
+        ~LogTokenIndex();
+
+        // Starts indexing the current segment, open for reading on fd, of
+        // which size bytes are written so far. The index owns fd.
+        void Start(int fd, uint64_t size);
+
+        // The current segment has grown to size bytes
+        void Written(uint64_t size);
+
+        // The current segment was closed at size bytes and renamed to
+        // segment; next_fd reads the new current segment
+        void Rotated(const std::string& segment, uint64_t size, int next_fd);
+
+        // Finds the records containing all of words, newest last, at most
+        // limit of them. Returns the number found, which may exceed limit.
+        size_t Search(const std::vector<std::string>& words, size_t limit, std::vector<std::string>& lines);
+
+        // Stops the thread and closes the segments
+        void Stop();
+};
+
+// Splits text into the words the index knows, lowercased
+std::vector<std::string> LogTokens(const std::string& text);
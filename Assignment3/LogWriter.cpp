@@ -0,0 +1,548 @@
+//LogWriter.cpp - Persistent buffered writer for the server log file
+
+#include "LogWriter.h"
+#include "LogCodec.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool file_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+LogWriter::LogWriter(const LogWriterConfig& _config)
+    : config(_config), fd(-1), index_fd(-1), append_offset(0), index(_config.index_every),
+      unsynced(false), running(false), segment_bytes(0), next_segment(1), compress_running(false), tokens(nullptr) {
+    active.reserve(config.buffer_bytes);
+    spare.reserve(config.buffer_bytes);
+}
+
+LogWriter::~LogWriter() {
+    Close();
+}
+
+bool LogWriter::Open(bool truncate) {
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    if (truncate) {
+        flags |= O_TRUNC;
+    }
+    fd = open(config.path.c_str(), flags, 0644);
+    if (fd < 0) {
+        perror("LogWriter: open failed");
+        return false;
+    }
+    std::string index_path = config.path + ".idx";
+    index_fd = open(index_path.c_str(), flags, 0644);
+    if (index_fd < 0) {
+        perror("LogWriter: cannot open the index");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    struct stat st;
+    segment_bytes = fstat(fd, &st) == 0 ? st.st_size : 0;
+    append_offset = segment_bytes;
+    find_segments();
+    last_sync = std::chrono::steady_clock::now();
+    segment_start = last_sync;
+    running = true;
+    flush_thread = std::thread(&LogWriter::flush_loop, this);
+    if (config.compress) {
+        compress_running = true;
+        compress_thread = std::thread(&LogWriter::compress_loop, this);
+    }
+    if (config.token_index) {
+        int read_fd = open(config.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (read_fd < 0) {
+            perror("LogWriter: cannot open the log for the token index");
+        } else {
+            tokens = new LogTokenIndex();
+            tokens->Start(read_fd, segment_bytes);
+        }
+    }
+    return true;
+}
+
+void LogWriter::Append(const char* line, size_t len, int level, uint64_t timestamp_ns) {
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        index.Add(append_offset, level, timestamp_ns);
+        append_offset += len + 1;
+        active.insert(active.end(), line, line + len);
+        active.push_back('\n');
+        full = active.size() >= config.buffer_bytes;
+    }
+    if (full) {
+        Flush();
+    }
+}
+
+void LogWriter::write_all(int out_fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(out_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("LogWriter: write failed");
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Writes the buffered lines out. The caller holds io_mutex.
+void LogWriter::flush_locked() {
+    {
+        // Swap buffers so producers keep appending while the write runs
+        std::lock_guard<std::mutex> lock(append_mutex);
+        active.swap(spare);
+        index.TakeUnpersisted(index_spare, false);
+    }
+    if (spare.empty() || fd < 0) {
+        spare.clear();
+        return;
+    }
+    write_all(fd, spare.data(), spare.size());
+    segment_bytes += spare.size();
+    spare.clear();
+    if (tokens != nullptr) {
+        tokens->Written(segment_bytes);
+    }
+    if (!index_spare.empty() && index_fd >= 0) {
+        write_all(index_fd, index_spare.data(), index_spare.size());
+    }
+    index_spare.clear();
+    unsynced = true;
+
+    if (config.durability == DURABILITY_ALWAYS) {
+        fdatasync(fd);
+        if (index_fd >= 0) {
+            fdatasync(index_fd);
+        }
+        unsynced = false;
+        last_sync = std::chrono::steady_clock::now();
+    }
+}
+
+void LogWriter::Flush() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    flush_locked();
+    if (rotate_due()) {
+        rotate_locked();
+    }
+}
+
+bool LogWriter::rotate_due() const {
+    if (segment_bytes == 0) {
+        return false;
+    }
+    if (config.rotate_bytes > 0 && segment_bytes >= config.rotate_bytes) {
+        return true;
+    }
+    return config.rotate_seconds > 0 &&
+           std::chrono::steady_clock::now() - segment_start >= std::chrono::seconds(config.rotate_seconds);
+}
+
+// Splits "dir/server_log.txt" into "dir/server_log" and ".txt"
+static void split_extension(const std::string& path, std::string& stem, std::string& ext) {
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        stem = path;
+        ext = "";
+    } else {
+        stem = path.substr(0, dot);
+        ext = path.substr(dot);
+    }
+}
+
+// Picks an unused name for the segment being closed
+std::string LogWriter::segment_path() {
+    std::string stem, ext;
+    split_extension(config.path, stem, ext);
+
+    std::string label;
+    if (config.naming == NAMING_DATED) {
+        char stamp[32];
+        time_t now = time(nullptr);
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_now);
+        label = stamp;
+    }
+    for (int attempt = 0;; ++attempt) {
+        std::string name;
+        if (config.naming == NAMING_DATED) {
+            name = stem + "." + label + (attempt ? "-" + std::to_string(attempt) : "") + ext;
+        } else {
+            name = stem + "." + std::to_string(next_segment++) + ext;
+        }
+        if (!file_exists(name) && !file_exists(name + ".lz") && !file_exists(name + ".idx")) {
+            return name;
+        }
+    }
+}
+
+// Orders "<n>" by number and "<date>-<time>[-<attempt>]" by time and attempt
+static bool segment_label_before(const std::string& a, const std::string& b) {
+    const size_t DATED_LEN = 15;    // "%Y%m%d-%H%M%S"
+    if (a.find('-') == std::string::npos && b.find('-') == std::string::npos) {
+        return strtoull(a.c_str(), nullptr, 10) < strtoull(b.c_str(), nullptr, 10);
+    }
+    std::string a_stamp = a.substr(0, DATED_LEN);
+    std::string b_stamp = b.substr(0, DATED_LEN);
+    if (a_stamp != b_stamp) {
+        return a_stamp < b_stamp;
+    }
+    unsigned long long a_attempt = a.length() > DATED_LEN ? strtoull(a.c_str() + DATED_LEN + 1, nullptr, 10) : 0;
+    unsigned long long b_attempt = b.length() > DATED_LEN ? strtoull(b.c_str() + DATED_LEN + 1, nullptr, 10) : 0;
+    return a_attempt < b_attempt;
+}
+
+// Collects the segments earlier runs closed, named as segment_path would
+// name them, compressed or not
+void LogWriter::find_segments() {
+    std::string stem, ext;
+    split_extension(config.path, stem, ext);
+    size_t slash = stem.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : stem.substr(0, slash + 1);
+    std::string prefix = (slash == std::string::npos ? stem : stem.substr(slash + 1)) + ".";
+
+    DIR* listing = opendir(dir.c_str());
+    if (listing == nullptr) {
+        return;
+    }
+    std::vector<std::string> labels;
+    struct dirent* entry;
+    while ((entry = readdir(listing)) != nullptr) {
+        std::string name = entry->d_name;
+        if (name.length() > 3 && name.compare(name.length() - 3, 3, ".lz") == 0) {
+            name.erase(name.length() - 3);
+        }
+        if (name.length() <= prefix.length() + ext.length() || name.compare(0, prefix.length(), prefix) != 0 ||
+            name.compare(name.length() - ext.length(), ext.length(), ext) != 0) {
+            continue;
+        }
+        std::string label = name.substr(prefix.length(), name.length() - prefix.length() - ext.length());
+        bool dated = label.find('-') != std::string::npos;
+        if (label.find_first_not_of("0123456789-") != std::string::npos ||
+            dated != (config.naming == NAMING_DATED) ||
+            std::find(labels.begin(), labels.end(), label) != labels.end()) {
+            continue;
+        }
+        labels.push_back(label);
+    }
+    closedir(listing);
+    std::sort(labels.begin(), labels.end(), segment_label_before);
+    closed.clear();
+    for (size_t i = 0; i < labels.size(); ++i) {
+        closed.push_back(stem + "." + labels[i] + ext);
+    }
+}
+
+// Creates path + ".new", hard-links path to segment and renames the new
+// file over path, so path always names a complete file. Returns the new file
+// descriptor, or -1 with nothing changed.
+static int switch_file(const std::string& path, const std::string& segment) {
+    std::string next_path = path + ".new";
+    int next_fd = open(next_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (next_fd < 0) {
+        perror("LogWriter: cannot create the next segment");
+        return -1;
+    }
+    if (link(path.c_str(), segment.c_str()) != 0) {
+        perror("LogWriter: cannot link the closed segment");
+        close(next_fd);
+        unlink(next_path.c_str());
+        return -1;
+    }
+    if (rename(next_path.c_str(), path.c_str()) != 0) {
+        perror("LogWriter: cannot switch segments");
+        unlink(segment.c_str());
+        close(next_fd);
+        unlink(next_path.c_str());
+        return -1;
+    }
+    return next_fd;
+}
+
+// Switches to a new segment. The caller holds io_mutex and has flushed.
+// The files are switched first; the old descriptors still refer to the closed
+// segment, so lines appended in the meantime are cut off afterwards and
+// written to it. Lines appended after the cut go to the new segment.
+void LogWriter::rotate_locked() {
+    if (fd < 0) {
+        return;
+    }
+    std::string segment = segment_path();
+    int next_fd = switch_file(config.path, segment);
+    if (next_fd < 0) {
+        return;
+    }
+    std::string index_path = config.path + ".idx";
+    int next_index_fd;
+    if (index_fd >= 0) {
+        next_index_fd = switch_file(index_path, segment + ".idx");
+        if (next_index_fd < 0) {
+            // The sidecar left under index_path describes the closed segment,
+            // not the one starting now
+            std::cerr << "LogWriter: " << segment << " and the segment after it are not indexed" << std::endl;
+            close(index_fd);
+            index_fd = -1;
+            unlink(index_path.c_str());
+        }
+    } else {
+        // Try again for the new segment
+        next_index_fd = open(index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    // Close off the segment, including the partial last index block
+    {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        active.swap(spare);
+        index.TakeUnpersisted(index_spare, true);
+        index.Reset();
+        append_offset = 0;
+    }
+    write_all(fd, spare.data(), spare.size());
+    segment_bytes += spare.size();
+    spare.clear();
+    if (index_fd >= 0) {
+        write_all(index_fd, index_spare.data(), index_spare.size());
+    }
+    index_spare.clear();
+    if (tokens != nullptr) {
+        // config.path names the new segment by now
+        tokens->Rotated(segment, segment_bytes, open(config.path.c_str(), O_RDONLY | O_CLOEXEC));
+    }
+
+    if (config.durability != DURABILITY_NONE) {
+        fdatasync(fd);
+        if (index_fd >= 0) {
+            fdatasync(index_fd);
+        }
+    }
+    close(fd);
+    fd = next_fd;
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
+    index_fd = next_index_fd;
+    unsynced = false;
+    segment_bytes = 0;
+    segment_start = std::chrono::steady_clock::now();
+
+    closed.push_back(segment);
+
+    if (config.compress) {
+        std::lock_guard<std::mutex> lock(compress_mutex);
+        compress_queue.push_back(segment);
+        compress_cv.notify_one();
+    }
+}
+
+void LogWriter::Rotate() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    flush_locked();
+    if (segment_bytes > 0) {
+        rotate_locked();
+    }
+}
+
+int LogWriter::OpenSegment(std::vector<LogIndexBlock>& blocks) {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    flush_locked();
+    {
+        std::lock_guard<std::mutex> lock(append_mutex);
+        blocks = index.Blocks();
+    }
+    int read_fd = open(config.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (read_fd < 0) {
+        perror("LogWriter: cannot open the log for reading");
+    }
+    return read_fd;
+}
+
+std::vector<std::string> LogWriter::ClosedSegments() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    return closed;
+}
+
+bool LogWriter::ReadSegmentIndex(const std::string& segment, std::vector<LogIndexBlock>& blocks) {
+    int sidecar_fd = open((segment + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+    if (sidecar_fd < 0) {
+        return false;
+    }
+    bool ok = ReadLogIndex(sidecar_fd, blocks);
+    close(sidecar_fd);
+    return ok && !blocks.empty();
+}
+
+int LogWriter::OpenClosedSegment(const std::string& segment) {
+    int read_fd = open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+    if (read_fd >= 0 || errno != ENOENT) {
+        return read_fd;
+    }
+
+    // Compressed since; the segment is only removed once its .lz is complete
+    read_fd = memfd_create("log-segment", MFD_CLOEXEC);
+    if (read_fd < 0) {
+        return -1;
+    }
+    if (!DecompressLogFile(segment + ".lz", read_fd)) {
+        close(read_fd);
+        return -1;
+    }
+    return read_fd;
+}
+
+bool LogWriter::Search(const std::vector<std::string>& words, size_t limit, std::vector<std::string>& lines,
+                       size_t& found) {
+    if (tokens == nullptr) {
+        return false;
+    }
+    Flush();
+    found = tokens->Search(words, limit, lines);
+    return true;
+}
+
+// Thread function compressing closed segments one at a time. The segment is
+// only removed once its .lz file is complete.
+void LogWriter::compress_loop() {
+    std::unique_lock<std::mutex> lock(compress_mutex);
+    while (compress_running || !compress_queue.empty()) {
+        if (compress_queue.empty()) {
+            compress_cv.wait(lock);
+            continue;
+        }
+        std::string segment = compress_queue.front();
+        compress_queue.pop_front();
+        lock.unlock();
+
+        std::string packed = segment + ".lz";
+        std::string partial = packed + ".tmp";
+        if (CompressLogFile(segment, partial) && rename(partial.c_str(), packed.c_str()) == 0) {
+            unlink(segment.c_str());
+        } else {
+            std::cerr << "LogWriter: failed to compress " << segment << std::endl;
+            unlink(partial.c_str());
+        }
+        lock.lock();
+    }
+}
+
+void LogWriter::Sync() {
+    Flush();
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    if (fd >= 0 && unsynced) {
+        fdatasync(fd);
+        if (index_fd >= 0) {
+            fdatasync(index_fd);
+        }
+        unsynced = false;
+    }
+    last_sync = std::chrono::steady_clock::now();
+}
+
+bool LogWriter::sync_due() {
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    return std::chrono::steady_clock::now() - last_sync >= std::chrono::milliseconds(config.sync_interval_ms);
+}
+
+// Thread function flushing the buffer every flush interval and committing
+// all flushed data with a single fdatasync every sync interval
+void LogWriter::flush_loop() {
+    while (running) {
+        {
+            std::unique_lock<std::mutex> lock(timer_mutex);
+            timer_cv.wait_for(lock, std::chrono::milliseconds(config.flush_interval_ms),
+                              [this] { return !running; });
+        }
+        Flush();
+        if (config.durability == DURABILITY_INTERVAL && sync_due()) {
+            Sync();
+        }
+    }
+}
+
+void LogWriter::Close() {
+    if (running) {
+        running = false;
+        timer_cv.notify_one();
+    }
+    if (flush_thread.joinable()) {
+        flush_thread.join();
+    }
+    if (fd < 0) {
+        return;
+    }
+    if (config.durability == DURABILITY_NONE) {
+        Flush();
+    } else {
+        Sync();
+    }
+    {
+        // The partial last block is persisted too, so the sidecar covers the file
+        std::lock_guard<std::mutex> lock(append_mutex);
+        index.TakeUnpersisted(index_spare, true);
+    }
+    if (index_fd >= 0) {
+        write_all(index_fd, index_spare.data(), index_spare.size());
+        close(index_fd);
+        index_fd = -1;
+    }
+    index_spare.clear();
+    close(fd);
+    fd = -1;
+    if (tokens != nullptr) {
+        tokens->Stop();
+        delete tokens;
+        tokens = nullptr;
+    }
+
+    // Let the compression thread finish the segments already queued
+    {
+        std::lock_guard<std::mutex> lock(compress_mutex);
+        compress_running = false;
+        compress_cv.notify_one();
+    }
+    if (compress_thread.joinable()) {
+        compress_thread.join();
+    }
+}
+
+bool ParseDurability(const std::string& text, DURABILITY& durability) {
+    if (text == "none") {
+        durability = DURABILITY_NONE;
+    } else if (text == "interval") {
+        durability = DURABILITY_INTERVAL;
+    } else if (text == "always") {
+        durability = DURABILITY_ALWAYS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ParseSegmentNaming(const std::string& text, SEGMENT_NAMING& naming) {
+    if (text == "numbered") {
+        naming = NAMING_NUMBERED;
+    } else if (text == "dated") {
+        naming = NAMING_DATED;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,157 @@
+//LogWriter.h - Persistent buffered writer for the server log file
+//
+// The file stays open for the life of the server. Lines are appended to an
+// in-memory buffer which is written out when it fills up or when the flush
+// timer fires, whichever comes first. fdatasync is optional: it can run after
+// every flush, or once per sync interval for everything written since the
+// previous sync (group commit).
+//
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include "LogIndex.h"
+#include "LogTokenIndex.h"
+
+enum DURABILITY {
+    DURABILITY_NONE,        // leave write-back to the kernel
+    DURABILITY_INTERVAL,    // fdatasync once per sync interval (group commit)
+    DURABILITY_ALWAYS       // fdatasync after every flush
+};
+
+enum SEGMENT_NAMING {
+    NAMING_NUMBERED,        // server_log.1.txt, server_log.2.txt, ...
+    NAMING_DATED            // server_log.20190312-153000.txt
+};
+
+struct LogWriterConfig {
+    std::string path;
+    size_t buffer_bytes;        // flush once this much is buffered
+    int flush_interval_ms;      // flush at least this often
+    DURABILITY durability;
+    int sync_interval_ms;       // group commit interval for DURABILITY_INTERVAL
+    size_t rotate_bytes;        // rotate once the file reaches this size, 0 = never
+    int rotate_seconds;         // rotate once the file is this old, 0 = never
+    SEGMENT_NAMING naming;
+    bool compress;              // compress closed segments into <segment>.lz
+    uint32_t index_every;       // records per sparse index block
+    bool token_index;           // keep an inverted index of the words, for Search
+
+    LogWriterConfig()
+        : path("server_log.txt"), buffer_bytes(1024 * 1024), flush_interval_ms(100),
+          durability(DURABILITY_NONE), sync_interval_ms(1000), rotate_bytes(0),
+          rotate_seconds(0), naming(NAMING_NUMBERED), compress(false), index_every(256),
+          token_index(false) {}
+};
+
+class LogWriter {
+    private:
+        LogWriterConfig config;
+        int fd;
+        int index_fd;               // -1 for a segment whose sidecar could not be switched
+        std::vector<char> active;   // filled by Append
+        std::vector<char> spare;    // written out by Flush while Append continues
+        std::vector<char> index_spare;
+
+        // Guarded by append_mutex: offset the next appended line will have in
+        // the current segment, and the index over the segment
+        uint64_t append_offset;
+        LogIndex index;
+        bool unsynced;              // data written since the last fdatasync
+        std::chrono::steady_clock::time_point last_sync;
+        std::mutex append_mutex;
+        std::mutex io_mutex;
+        std::mutex timer_mutex;
+        std::condition_variable timer_cv;
+        std::atomic<bool> running;
+        std::thread flush_thread;
+
+        // Current segment, guarded by io_mutex
+        size_t segment_bytes;
+        std::chrono::steady_clock::time_point segment_start;
+        int next_segment;
+        std::vector<std::string> closed;    // closed segments, oldest first
+
+
+        // Closed segments waiting for the compression thread
+        std::deque<std::string> compress_queue;
+        std::mutex compress_mutex;
+        std::condition_variable compress_cv;
+        bool compress_running;
+        std::thread compress_thread;
+
+        // Built in the background from what is written, nullptr if disabled
+        LogTokenIndex* tokens;
+
+        void flush_loop();
+        void compress_loop();
+        bool sync_due();
+        void write_all(int out_fd, const char* data, size_t len);
+        void flush_locked();
+        bool rotate_due() const;
+        void rotate_locked();
+        std::string segment_path();
+        void find_segments();
+
+    public:
+        explicit LogWriter(const LogWriterConfig& _config);
+        ~LogWriter();
+
+        // Opens the log file, emptying it first if truncate is set, and starts
+        // the flush timer. Returns false if the file cannot be opened.
+        bool Open(bool truncate);
+
+        // Appends one line; the newline is added here. The level and the
+        // timestamp are recorded in the sparse index.
+        void Append(const char* line, size_t len, int level, uint64_t timestamp_ns);
+
+        // Writes everything buffered so far to the file
+        void Flush();
+
+        // Flushes and fdatasyncs the file
+        void Sync();
+
+        // Closes the current segment and starts a new one. Readers opening the
+        // log file see either the complete old segment or the new one.
+        void Rotate();
+
+        // Flushes and opens the current segment for reading. blocks receives
+        // the index over it; the last block may still be growing.
+        // Returns the file descriptor, or -1 on error.
+        int OpenSegment(std::vector<LogIndexBlock>& blocks);
+
+        // Segments closed by rotation, this run's and those found next to
+        // the log at Open, oldest first, by the name they were closed under.
+        // A segment compressed since is only on disk as <segment>.lz.
+        std::vector<std::string> ClosedSegments();
+
+        // Reads the sidecar index of a closed segment. Returns false if it
+        // has none, and the whole segment has to be scanned.
+        static bool ReadSegmentIndex(const std::string& segment, std::vector<LogIndexBlock>& blocks);
+
+        // Opens a closed segment for reading, decompressed into memory if it
+        // was compressed. Returns the file descriptor, or -1 if it is gone.
+        static int OpenClosedSegment(const std::string& segment);
+
+        // Finds the records containing all of words through the token index,
+        // newest last, at most limit of them. Returns false if the writer
+        // keeps no token index; found is the number of matches.
+        bool Search(const std::vector<std::string>& words, size_t limit, std::vector<std::string>& lines,
+                    size_t& found);
+
+        // Stops the flush timer, flushes, syncs unless durability is NONE,
+        // and closes the file
+        void Close();
+};
+
+// Parses "none", "interval" or "always". Returns false for anything else.
+bool ParseDurability(const std::string& text, DURABILITY& durability);
+
+// Parses "numbered" or "dated". Returns false for anything else.
+bool ParseSegmentNaming(const std::string& text, SEGMENT_NAMING& naming);
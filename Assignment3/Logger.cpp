@@ -1,24 +1,717 @@
 //Logger.cpp - Logging system for the client
 
 #include "Logger.h"
-#include <chrono>
+#include "LogQueue.h"
+#include "LogStreamSender.h"
+#include "LogShmRing.h"
+#include "LogDedup.h"
 #include <ctime>
-#include <iomanip>
-#include <sstream>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <poll.h>
+#include <endian.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 
-const int CLIENT_LISTEN_PORT = 8081;
 const int SERVER_PORT = 8080;
 const int BUF_LEN = 1024;
+const int SEND_BATCH = 64;              // datagrams handed to one sendmmsg call
+const size_t MAX_UDP_PAYLOAD = 65507;
+const size_t IP_UDP_HEADER_LEN = 28;
+const int HELLO_INTERVAL_SECONDS = 10;  // repeated so a restarted server relearns us
+const int FULL_QUEUE_WAIT_US = 100;     // stream producers retry this often when full
+const int STREAM_EXIT_WAIT_MS = 2000;   // ExitLog waits this long for acknowledgements
+const size_t SHM_MESSAGE_BYTES = 60 * 1024;     // records per message on the shared memory socket
+const size_t STAGING_BYTES = 8 * 1024;  // records a thread collects before queueing them
+const size_t FLAGS_OFFSET = 3;          // of the flags in a record header
+const size_t SEQUENCE_OFFSET = 12;      // of the sequence in a record header
+
+Logger default_logger;
+
+// Records one thread encoded and has not queued yet. Only that thread
+// appends; the backend takes the lock to queue what a slow thread left.
+struct LogStaging {
+    std::mutex mutex;
+    std::atomic<size_t> used;           // bytes of complete records in data
+    size_t records;
+    std::atomic<bool> retired;          // its Logger closed
+    char data[STAGING_BYTES];
+
+    LogStaging() : used(0), records(0), retired(false) {}
+};
+
+// The staging buffers of the calling thread, one per Logger it logged through
+struct StagingRef {
+    uint64_t serial;
+    std::shared_ptr<LogStaging> staging;
+};
+static thread_local std::vector<StagingRef> thread_stagings;
+static std::atomic<uint64_t> next_serial(1);
+
+// Interned call sites, indexed by site ID
+static LogSite log_sites[MAX_LOG_SITES];
+static std::atomic<int> next_site_id(1);
+
+// Fatal signals get one last flush of what is still pending. Everything the
+// handler needs is set up beforehand.
+static const int CRASH_SIGNALS[] = { SIGSEGV, SIGABRT, SIGBUS };
+const int CRASH_SIGNAL_COUNT = sizeof(CRASH_SIGNALS) / sizeof(CRASH_SIGNALS[0]);
+static struct sigaction previous_actions[CRASH_SIGNAL_COUNT];
+static std::atomic<Logger*> crash_logger(nullptr);
+static std::atomic<bool> crashing(false);
+static int crash_fd = -1;
+static std::vector<char> crash_datagrams;   // room for one sendmmsg of queued records
+static std::vector<char> crash_stack;       // alternate stack, a stack overflow leaves none
+
+static std::atomic<size_t> next_producer_stripe(0);
+static thread_local size_t producer_stripe = next_producer_stripe.fetch_add(1) % LOG_PRODUCER_STRIPES;
+
+// Counts a producer call in while it may use what Close frees. Close turns
+// new calls away with is_open and then waits for every stripe to drop to
+// zero; both sides go through sequentially consistent operations, so either
+// the call sees is_open cleared or Close sees it counted.
+class ProducerScope {
+    private:
+        std::atomic<int>& count;
+        bool open;
+
+    public:
+        ProducerScope(LogProducerCount* producers, const std::atomic<bool>& is_open)
+            : count(producers[producer_stripe].count) {
+            count.fetch_add(1);
+            open = is_open.load();
+        }
+        ~ProducerScope() {
+            count.fetch_sub(1);
+        }
+        bool Open() const {
+            return open;
+        }
+};
+
+Logger::Logger()
+    : level(DEBUG), is_open(false), serial(0), command_fd(-1), session_id(0), next_sequence(0), skipped(0),
+      queue(nullptr), max_datagram(BUF_LEN), backend_running(false), backend_wakeup(false), dropped(0),
+      stream_sender(nullptr), shm_ring(nullptr), shm_memfd(-1), shm_event_fd(-1), dedup(nullptr),
+      listening(false) {
+    for (size_t i = 0; i < LOG_MAX_STAGINGS; ++i) {
+        staging_view[i].store(nullptr, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < LOG_PRODUCER_STRIPES; ++i) {
+        producers[i].count.store(0, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < MAX_LOG_SITES / 32; ++i) {
+        announced[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+Logger::~Logger() {
+    if (is_open) {
+        Close();
+    }
+}
+
+// Encodes a record of this session. Queued records are numbered by the
+// backend as they leave (see number_record) and get 0 here.
+size_t Logger::encode_record(char* out, size_t out_len, LOG_RECORD_TYPE type, int record_level, int site_id,
+                             uint8_t flags, const char* payload, size_t len, uint32_t weight, uint32_t sequence) {
+    LogRecordHeader hdr;
+    hdr.type = type;
+    hdr.weight = weight;
+    hdr.level = record_level;
+    hdr.flags = flags;
+    hdr.site_id = site_id;
+    hdr.sequence = (flags & RECORD_FLAG_UNSEQUENCED) ? 0 : sequence;
+    hdr.session_id = session_id;
+    hdr.timestamp_ns = record_clock.Now();
+    return EncodeLogRecord(out, out_len, hdr, payload, len);
+}
+
+// Gives a record that left the queue the next sequence number, so numbers
+// follow the order records are sent in whichever thread queued them
+void Logger::number_record(char* record) {
+    if (record[FLAGS_OFFSET] & RECORD_FLAG_UNSEQUENCED) {
+        return;
+    }
+    uint32_t sequence = htole32(next_sequence.fetch_add(1, std::memory_order_relaxed));
+    memcpy(record + SEQUENCE_OFFSET, &sequence, sizeof(sequence));
+}
+
+// Has the backend send what is queued now rather than at the next flush
+void Logger::wake_backend() {
+    if (!backend_wakeup.exchange(true)) {
+        backend_cv.notify_one();
+    }
+}
+
+// Encodes a record straight into the shared memory ring. The server is only
+// woken through the eventfd when it sleeps on an empty ring.
+void Logger::send_shm(LOG_RECORD_TYPE type, int record_level, int site_id, uint8_t flags, const char* payload,
+                      size_t len, uint32_t weight) {
+    size_t room = LOG_RECORD_HEADER_LEN + len < LOG_RECORD_MAX_LEN ? LOG_RECORD_HEADER_LEN + len : LOG_RECORD_MAX_LEN;
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(shm_mutex);
+        char* slot = shm_ring != nullptr ? shm_ring->Reserve(room) : nullptr;
+        bool sequenced = !(flags & RECORD_FLAG_UNSEQUENCED);
+        uint32_t sequence = sequenced ? next_sequence.fetch_add(1, std::memory_order_relaxed) : 0;
+        if (slot == nullptr) {
+            // Its number is skipped, so the server counts the record as lost
+            dropped++;
+            return;
+        }
+        wake = shm_ring->Commit(encode_record(slot, room, type, record_level, site_id, flags, payload, len, weight,
+                                              sequence));
+    }
+    if (wake) {
+        uint64_t one = 1;
+        if (write(shm_event_fd, &one, sizeof(one)) < 0) {
+            // The counter is already raised, the server wakes up anyway
+        }
+    }
+}
 
-// Global variables for the logger
-int log_level = DEBUG;
-int client_fd;
-struct sockaddr_in server_addr;
-std::atomic<bool> listen_flag(false);
-std::thread listen_thread;
+// Queues one encoded record, waiting for room on a stream
+void Logger::push_record(const char* record, size_t len) {
+    while (!queue->Push(record, len)) {
+        // A stream must not lose records, so wait for the backend to make room
+        // unless the Logger is closing
+        if (stream_sender == nullptr || !backend_running || !is_open) {
+            dropped++;
+            skipped++;
+            return;
+        }
+        wake_backend();
+        std::this_thread::sleep_for(std::chrono::microseconds(FULL_QUEUE_WAIT_US));
+    }
+    // Wake the backend early once a quarter of the queue is waiting
+    if (queue->Size() >= config.queue_capacity / 4) {
+        wake_backend();
+    }
+}
+
+// The calling thread's staging buffer for this Logger, registered on its
+// first record. nullptr once LOG_MAX_STAGINGS threads have one; the others
+// queue their records directly.
+LogStaging* Logger::staging() {
+    std::vector<StagingRef>& mine = thread_stagings;
+    for (size_t i = 0; i < mine.size(); ++i) {
+        if (mine[i].serial == serial) {
+            return mine[i].staging.get();
+        }
+    }
+
+    // Buffers of Loggers closed since are of no use any more
+    for (size_t i = 0; i < mine.size();) {
+        if (mine[i].staging->retired) {
+            mine.erase(mine.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    std::shared_ptr<LogStaging> created = std::make_shared<LogStaging>();
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        size_t slot = 0;
+        while (slot < LOG_MAX_STAGINGS && stagings[slot]) {
+            ++slot;
+        }
+        if (slot == LOG_MAX_STAGINGS) {
+            return nullptr;
+        }
+        stagings[slot] = created;
+        staging_view[slot].store(created.get(), std::memory_order_release);
+    }
+    StagingRef ref = { serial, created };
+    mine.push_back(ref);
+    return created.get();
+}
+
+// Moves the staged records into the queue, all at once if there is room.
+// Otherwise a stream waits for room when may_wait, or leaves the rest staged
+// for the next round, and UDP drops the rest. The caller holds the staging
+// lock. Returns false if records are left.
+bool Logger::publish_staging(LogStaging& staging, bool may_wait) {
+    size_t used = staging.used.load(std::memory_order_relaxed);
+    if (used == 0) {
+        return true;
+    }
+    if (!queue->PushAll(staging.data, staging.records)) {
+        size_t offset = 0;
+        while (offset < used) {
+            size_t len = PeekLogRecordLength(staging.data + offset, used - offset);
+            if (queue->Push(staging.data + offset, len)) {
+                offset += len;
+                staging.records--;
+                continue;
+            }
+            if (stream_sender == nullptr || !backend_running || (may_wait && !is_open)) {
+                dropped += staging.records;
+                skipped += staging.records;
+                staging.records = 0;
+                offset = used;
+                break;
+            }
+            if (!may_wait) {
+                break;
+            }
+            wake_backend();
+            std::this_thread::sleep_for(std::chrono::microseconds(FULL_QUEUE_WAIT_US));
+        }
+        if (offset < used) {
+            memmove(staging.data, staging.data + offset, used - offset);
+            staging.used.store(used - offset, std::memory_order_release);
+            return false;
+        }
+    }
+    staging.used.store(0, std::memory_order_release);
+    staging.records = 0;
+    if (queue->Size() >= config.queue_capacity / 4) {
+        wake_backend();
+    }
+    return true;
+}
+
+// Queues what every thread has staged. The backend does not wait for a
+// thread busy with its own buffer, and frees the buffers of threads that
+// have exited once they are empty.
+void Logger::collect_stagings(bool wait) {
+    std::unique_lock<std::mutex> lock(staging_mutex, std::defer_lock);
+    if (wait) {
+        lock.lock();
+    } else if (!lock.try_lock()) {
+        return;
+    }
+    for (size_t i = 0; i < LOG_MAX_STAGINGS; ++i) {
+        std::shared_ptr<LogStaging>& staging = stagings[i];
+        if (!staging) {
+            continue;
+        }
+        std::unique_lock<std::mutex> staging_lock(staging->mutex, std::defer_lock);
+        if (wait) {
+            staging_lock.lock();
+        } else if (!staging_lock.try_lock()) {
+            continue;
+        }
+        bool empty = publish_staging(*staging, wait);
+        staging_lock.unlock();
+        if (empty && staging.use_count() == 1) {
+            staging_view[i].store(nullptr, std::memory_order_release);
+            staging.reset();
+        }
+    }
+}
+
+// Sends a single record to the server. ENTRY records wait in the calling
+// thread's staging buffer when there is a queue; everything else is queued
+// at once, so a call site or level change is known before later entries.
+void Logger::send_record(LOG_RECORD_TYPE type, int record_level, int site_id, uint8_t flags, const char* payload,
+                         size_t len, uint32_t weight) {
+    ProducerScope scope(producers, is_open);
+    if (!scope.Open()) {
+        return;
+    }
+    if (shm_ring != nullptr) {
+        send_shm(type, record_level, site_id, flags, payload, len, weight);
+        return;
+    }
+    if (queue == nullptr) {
+        static thread_local char record_buf[LOG_RECORD_MAX_LEN];
+        uint32_t sequence = next_sequence.fetch_add(1, std::memory_order_relaxed);
+        size_t record_len = encode_record(record_buf, sizeof(record_buf), type, record_level, site_id, flags,
+                                          payload, len, weight, sequence);
+        sendto(command_fd.load(std::memory_order_relaxed), record_buf, record_len, 0,
+               (const struct sockaddr *)&server_addr, sizeof(server_addr));
+        return;
+    }
+
+    LogStaging* mine = type == RECORD_ENTRY ? staging() : nullptr;
+    if (mine == nullptr) {
+        static thread_local char record_buf[LOG_RECORD_MAX_LEN];
+        size_t record_len = encode_record(record_buf, sizeof(record_buf), type, record_level, site_id, flags,
+                                          payload, len, weight, 0);
+        push_record(record_buf, record_len);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mine->mutex);
+    size_t used = mine->used.load(std::memory_order_relaxed);
+    if (STAGING_BYTES - used < LOG_RECORD_MAX_LEN) {
+        publish_staging(*mine, true);
+        used = mine->used.load(std::memory_order_relaxed);
+        if (STAGING_BYTES - used < LOG_RECORD_MAX_LEN) {
+            // Only a stream whose backend is gone gets here
+            dropped++;
+            return;
+        }
+    }
+    size_t record_len = encode_record(mine->data + used, LOG_RECORD_MAX_LEN, type, record_level, site_id, flags,
+                                      payload, len, weight, 0);
+    mine->records++;
+    mine->used.store(used + record_len, std::memory_order_release);
+}
+
+// Encodes the payload of a HELLO record
+size_t Logger::encode_hello(char* out, size_t out_len) {
+    const char* name = config.name.empty() ? program_invocation_short_name : config.name.c_str();
+    return EncodeLogHello(out, out_len, getpid(), name, config.group.c_str());
+}
+
+// Tells the server who this client is and which level it logs at. It is also
+// the acknowledgement of a level command.
+void Logger::send_hello() {
+    char hello_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_hello(hello_buf, sizeof(hello_buf));
+    if (len > 0) {
+        send_record(RECORD_HELLO, Level(), 0, 0, hello_buf, len);
+    }
+}
+
+// Applies a command from the server. Returns true if it changed the level.
+// "Set Sampling=<debug one in>,<warning one in>,<lease ms>" throttles the
+// sampled levels for a while.
+bool Logger::apply_command(const char* text, size_t len) {
+    std::string command(text, len);
+    unsigned int debug_one_in;
+    unsigned int warning_one_in;
+    unsigned int lease_ms;
+    if (sscanf(command.c_str(), "Set Sampling=%u,%u,%u", &debug_one_in, &warning_one_in, &lease_ms) == 3) {
+        sampler.Throttle(DEBUG, debug_one_in, lease_ms);
+        sampler.Throttle(WARNING, warning_one_in, lease_ms);
+        return false;
+    }
+    if (command.find("Set Log Level=") != std::string::npos) {
+        try {
+            int new_level = std::stoi(command.substr(command.find("=") + 1));
+            if (new_level >= DEBUG && new_level <= CRITICAL) {
+                level.store(new_level, std::memory_order_relaxed);
+                std::cout << "Client received new log level: " << new_level << std::endl;
+                return true;
+            }
+        } catch (...) {
+            // Ignore malformed commands
+        }
+    }
+    return false;
+}
+
+// Largest datagram that reaches the server without IP fragmentation
+size_t Logger::path_max_datagram() {
+    size_t payload = BUF_LEN;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0) {
+        int mtu = 0;
+        socklen_t len = sizeof(mtu);
+        if (connect(fd, (const struct sockaddr*)&server_addr, sizeof(server_addr)) == 0 &&
+            getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu > (int)IP_UDP_HEADER_LEN) {
+            payload = mtu - IP_UDP_HEADER_LEN;
+        }
+        close(fd);
+    }
+    return payload;
+}
+
+// Packs queued records into datagrams of up to max_datagram bytes and sends
+// them SEND_BATCH at a time with sendmmsg. Returns once the queue is empty.
+void Logger::flush_queue(char* batch_buf) {
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+
+    // Records dropped before they got a number still leave a gap, so the
+    // server counts them as lost
+    next_sequence.fetch_add(skipped.exchange(0), std::memory_order_relaxed);
+    for (;;) {
+        int count = 0;
+        size_t len = 0;
+        const char* record = queue->Front(len);
+        while (count < SEND_BATCH && record != nullptr) {
+            char* datagram = batch_buf + count * max_datagram;
+            size_t used = 0;
+            while (record != nullptr && used + len <= max_datagram) {
+                memcpy(datagram + used, record, len);
+                number_record(datagram + used);
+                used += len;
+                queue->PopFront();
+                record = queue->Front(len);
+            }
+            iovs[count].iov_base = datagram;
+            iovs[count].iov_len = used;
+            memset(&msgs[count], 0, sizeof(msgs[count]));
+            msgs[count].msg_hdr.msg_name = &server_addr;
+            msgs[count].msg_hdr.msg_namelen = sizeof(server_addr);
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            ++count;
+        }
+        if (count == 0) {
+            return;
+        }
+
+        int sent = 0;
+        int fd = command_fd.load(std::memory_order_relaxed);
+        while (sent < count) {
+            int n = sendmmsg(fd, msgs + sent, count - sent, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        if (count < SEND_BATCH) {
+            return;
+        }
+    }
+}
+
+// Moves queued records into the stream buffer while it has room. The sender
+// numbers them.
+void Logger::fill_stream() {
+    size_t len = 0;
+    const char* record = queue->Front(len);
+    while (record != nullptr && stream_sender->Add(record, len)) {
+        queue->PopFront();
+        record = queue->Front(len);
+    }
+}
+
+// The backend thread is the only one touching the stream, so it hands its
+// HELLO straight to the sender instead of queueing it behind a full queue
+void Logger::stream_hello() {
+    char hello_buf[LOG_RECORD_MAX_LEN];
+    char record_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_hello(hello_buf, sizeof(hello_buf));
+    size_t record_len = encode_record(record_buf, sizeof(record_buf), RECORD_HELLO, Level(), 0, 0, hello_buf, len,
+                                      1, 0);
+    stream_sender->Add(record_buf, record_len);
+}
+
+// Payload of the SITE record of a call site
+static size_t encode_site(char* out, size_t out_len, const LogSite& site) {
+    size_t len = EncodeLogSite(out, out_len, site.file, site.function, site.line);
+    if (len > 0 && site.format != nullptr) {
+        size_t format_len = strlen(site.format) + 1;
+        if (format_len > out_len - len) {
+            return 0;
+        }
+        memcpy(out + len, site.format, format_len);
+        len += format_len;
+    }
+    return len;
+}
+
+// An unnumbered SITE record repeating what a site ID stands for. Returns 0
+// for a site still being registered, whose own record follows.
+size_t Logger::encode_site_record(char* out, size_t out_len, int site_id) {
+    const LogSite& site = log_sites[site_id];
+    if (site.file == nullptr) {
+        return 0;
+    }
+    char payload_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_site(payload_buf, sizeof(payload_buf), site);
+    return encode_record(out, out_len, RECORD_SITE, DEBUG, site_id, RECORD_FLAG_UNSEQUENCED, payload_buf, len, 1, 0);
+}
+
+// After every connect the server first hears who we are and all call sites
+// registered so far, in case it restarted and forgot them
+void Logger::encode_preamble(std::vector<char>& preamble) {
+    char payload_buf[LOG_RECORD_MAX_LEN];
+    char record_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_hello(payload_buf, sizeof(payload_buf));
+    size_t record_len = encode_record(record_buf, sizeof(record_buf), RECORD_HELLO, Level(), 0,
+                                      RECORD_FLAG_UNSEQUENCED, payload_buf, len, 1, 0);
+    preamble.insert(preamble.end(), record_buf, record_buf + record_len);
+
+    int sites = next_site_id < MAX_LOG_SITES ? next_site_id.load() : MAX_LOG_SITES;
+    for (int site_id = 1; site_id < sites; ++site_id) {
+        record_len = encode_site_record(record_buf, sizeof(record_buf), site_id);
+        preamble.insert(preamble.end(), record_buf, record_buf + record_len);
+    }
+}
+
+void Logger::stream_command(const char* text, size_t len) {
+    if (apply_command(text, len)) {
+        // The HELLO confirms the change, the server may be waiting for it
+        stream_hello();
+        wake_backend();
+    }
+}
+
+void Logger::pump_stream() {
+    fill_stream();
+    stream_sender->Pump([this](std::vector<char>& preamble) { encode_preamble(preamble); },
+                        [this](const char* text, size_t len) { stream_command(text, len); });
+}
+
+// Sends one summary for every repeated message whose window closed by now
+void Logger::expire_repeats(uint64_t now) {
+    if (dedup == nullptr) {
+        return;
+    }
+    std::vector<LogDedup::Summary> summaries = dedup->Expire(now);
+    for (size_t i = 0; i < summaries.size(); ++i) {
+        const LogDedup::Summary& summary = summaries[i];
+        char payload_buf[LOG_RECORD_MAX_LEN];
+        size_t len = 0;
+        if (summary.site_id == 0) {
+            len = EncodeLogSite(payload_buf, sizeof(payload_buf), summary.file, summary.function, summary.line);
+            if (len == 0) {
+                len = EncodeLogSite(payload_buf, sizeof(payload_buf), "unknown", "unknown", summary.line);
+            }
+        }
+        // A LOGF message is formatted here; the summary carries text
+        char message_buf[LOG_RECORD_MAX_LEN];
+        const char* message = summary.message.c_str();
+        const LogSite* site = GetLogSite(summary.site_id);
+        if (site != nullptr && site->format != nullptr) {
+            FormatLogArgs(message_buf, sizeof(message_buf), site->format, summary.message.data(),
+                          summary.message.length());
+            message = message_buf;
+        }
+        int written = snprintf(payload_buf + len, sizeof(payload_buf) - len, "last message repeated %u %s: %s",
+                               summary.repeats, summary.repeats == 1 ? "time" : "times", message);
+        if (written > 0) {
+            len += std::min(static_cast<size_t>(written), sizeof(payload_buf) - len - 1);
+        }
+        send_record(RECORD_ENTRY, summary.level, summary.site_id, summary.site_id == 0 ? RECORD_FLAG_INLINE_SITE : 0,
+                    payload_buf, len);
+    }
+}
+
+// Backend of the stream transports. It waits for the socket while the socket
+// is what holds it up, and for the producers otherwise.
+void Logger::stream_loop() {
+    time_t last_hello = time(nullptr);
+    while (backend_running) {
+        if (stream_sender->Blocked()) {
+            struct pollfd p = { stream_sender->Fd(), POLLIN | POLLOUT, 0 };
+            poll(&p, 1, config.flush_interval_ms);
+        } else {
+            std::unique_lock<std::mutex> lock(backend_mutex);
+            backend_cv.wait_for(lock, std::chrono::milliseconds(config.flush_interval_ms),
+                                [this] { return backend_wakeup.load() || !backend_running; });
+        }
+        backend_wakeup = false;
+        record_clock.Recalibrate();
+        expire_repeats(record_clock.Now());
+        collect_stagings(false);
+        pump_stream();
+        if (time(nullptr) - last_hello >= HELLO_INTERVAL_SECONDS) {
+            stream_hello();
+            last_hello = time(nullptr);
+        }
+    }
+
+    // Give the server a moment to take and acknowledge what is left
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(STREAM_EXIT_WAIT_MS);
+    collect_stagings(false);
+    pump_stream();
+    while ((queue->Size() > 0 || !stream_sender->Idle()) && std::chrono::steady_clock::now() < deadline) {
+        struct pollfd p = { stream_sender->Fd(), POLLIN | POLLOUT, 0 };
+        if (p.fd < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        } else {
+            poll(&p, 1, 10);
+        }
+        pump_stream();
+    }
+}
 
-// Thread function to listen for commands from the server
-void listen_for_commands() {
+// Thread function sending queued records every flush interval, or earlier
+// when the producers signal that the queue is filling up
+void Logger::backend_loop() {
+    if (stream_sender != nullptr) {
+        stream_loop();
+        return;
+    }
+    std::vector<char> batch_buf(SEND_BATCH * max_datagram);
+
+    while (backend_running) {
+        {
+            std::unique_lock<std::mutex> lock(backend_mutex);
+            backend_cv.wait_for(lock, std::chrono::milliseconds(config.flush_interval_ms),
+                                [this] { return backend_wakeup.load() || !backend_running; });
+        }
+        backend_wakeup = false;
+        record_clock.Recalibrate();
+        expire_repeats(record_clock.Now());
+        collect_stagings(false);
+        flush_queue(batch_buf.data());
+    }
+    collect_stagings(false);
+    flush_queue(batch_buf.data());
+}
+
+// Connects to the server's shared memory socket, tells it who we are and
+// hands it the ring and the eventfd. The connection then carries level
+// commands.
+bool Logger::shm_connect() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config.shm_path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    // The identity and call sites go first, in messages of whole records, so
+    // a restarted server knows them before it reads the ring
+    std::vector<char> preamble;
+    encode_preamble(preamble);
+    size_t offset = 0;
+    while (offset < preamble.size()) {
+        size_t end = offset;
+        while (end < preamble.size() && end - offset < SHM_MESSAGE_BYTES) {
+            end += PeekLogRecordLength(&preamble[end], preamble.size() - end);
+        }
+        if (send(fd, &preamble[offset], end - offset, MSG_NOSIGNAL) < 0) {
+            close(fd);
+            return false;
+        }
+        offset = end;
+    }
+
+    int fds[2] = { shm_memfd, shm_event_fd };
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return false;
+    }
+    command_fd = fd;
+    return true;
+}
+
+// Thread function to listen for commands from the server. Without a backend
+// thread it also closes the windows of repeated messages.
+void Logger::listen_for_commands() {
     char buffer[BUF_LEN];
     struct sockaddr_in server_addr_listen;
     socklen_t addr_len = sizeof(server_addr_listen);
@@ -27,54 +720,275 @@ void listen_for_commands() {
     struct timeval tv;
     tv.tv_sec = 1;
     tv.tv_usec = 0;
-    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    while (listen_flag) {
-        int len = recvfrom(client_fd, buffer, BUF_LEN, 0, (struct sockaddr*)&server_addr_listen, &addr_len);
-        if (len > 0) {
-            std::string command(buffer, len);
-            if (command.find("Set Log Level=") != std::string::npos) {
-                try {
-                    int new_level = std::stoi(command.substr(command.find("=") + 1));
-                    if (new_level >= DEBUG && new_level <= CRITICAL) {
-                        log_level = new_level;
-                        std::cout << "Client received new log level: " << log_level << std::endl;
-                    }
-                } catch (...) {
-                    // Ignore malformed commands
-                }
+    if (command_fd != -1) {
+        setsockopt(command_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    }
+
+    time_t last_hello = time(nullptr);
+    while (listening) {
+        int fd = command_fd;
+        if (fd == -1) {
+            // The shared memory server went away; once it is back it gets
+            // the ring again and relearns who we are
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if (!listening || !shm_connect()) {
+                continue;
             }
+            fd = command_fd;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+        }
+        int len = recvfrom(fd, buffer, BUF_LEN, 0, (struct sockaddr*)&server_addr_listen, &addr_len);
+        if (len == 0 && shm_ring != nullptr) {
+            command_fd = -1;
+            close(fd);
+            continue;
+        }
+        if (len > 0 && apply_command(buffer, len)) {
+            // The HELLO confirms the change, the server may be waiting for it
+            send_hello();
+            wake_backend();
+            last_hello = time(nullptr);
         }
         memset(buffer, 0, BUF_LEN);
+        record_clock.Recalibrate();
+        expire_repeats(record_clock.Now());
+        if (time(nullptr) - last_hello >= HELLO_INTERVAL_SECONDS) {
+            send_hello();
+            last_hello = time(nullptr);
+        }
     }
 }
 
-void InitializeLog() {
-    // Create a UDP socket for the client to listen on
-    if ((client_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+// Creates the UDP socket records are sent from and commands arrive on
+bool Logger::open_udp() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
         perror("socket failed");
-        return;
-    }
-
-    // FIX: Set the SO_REUSEADDR option to prevent "Bind failed" errors
-    int optval = 1;
-    if (setsockopt(client_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        perror("setsockopt failed");
-        return;
+        return false;
     }
 
     struct sockaddr_in client_addr_listen;
     memset(&client_addr_listen, 0, sizeof(client_addr_listen));
     client_addr_listen.sin_family = AF_INET;
     client_addr_listen.sin_addr.s_addr = INADDR_ANY;
-    client_addr_listen.sin_port = htons(CLIENT_LISTEN_PORT);
+    client_addr_listen.sin_port = 0;    // any free port, the server learns it from our records
 
-    if (bind(client_fd, (const struct sockaddr*)&client_addr_listen, sizeof(client_addr_listen)) < 0) {
+    if (bind(fd, (const struct sockaddr*)&client_addr_listen, sizeof(client_addr_listen)) < 0) {
         perror("Logger: Bind failed for client listener");
-        close(client_fd);
-        client_fd = -1;
+        close(fd);
+        return false;
+    }
+    command_fd = fd;
+    return true;
+}
+
+static void crash_write(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Writes the client identity, every call site and then every pending record
+// to the crash file, so the file can be read on its own (logserver --read)
+void Logger::crash_write_records(int fd) {
+    char payload_buf[LOG_RECORD_MAX_LEN];
+    char record_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_hello(payload_buf, sizeof(payload_buf));
+    crash_write(fd, record_buf, encode_record(record_buf, sizeof(record_buf), RECORD_HELLO, Level(), 0,
+                                              RECORD_FLAG_UNSEQUENCED, payload_buf, len, 1, 0));
+    int sites = next_site_id < MAX_LOG_SITES ? next_site_id.load() : MAX_LOG_SITES;
+    for (int site_id = 1; site_id < sites; ++site_id) {
+        crash_write(fd, record_buf, encode_site_record(record_buf, sizeof(record_buf), site_id));
+    }
+    if (stream_sender != nullptr) {
+        const char* data;
+        stream_sender->Unacknowledged(data, len);
+        crash_write(fd, data, len);
+    }
+    const char* record;
+    for (size_t i = 0; queue != nullptr && (record = queue->Peek(i, len)) != nullptr; ++i) {
+        crash_write(fd, record, len);
+    }
+    for (size_t i = 0; i < LOG_MAX_STAGINGS; ++i) {
+        LogStaging* staging = staging_view[i].load(std::memory_order_acquire);
+        if (staging != nullptr) {
+            crash_write(fd, staging->data, staging->used.load(std::memory_order_acquire));
+        }
+    }
+}
+
+// Packs what is queued, then what the threads staged, into the datagrams set
+// aside for this and sends them with a single sendmmsg; whatever does not
+// fit is lost
+void Logger::crash_send_records(char* datagrams) {
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+    int count = 0;
+    size_t index = 0;
+    size_t staging_index = 0;
+    size_t staging_offset = 0;
+    size_t len = 0;
+
+    // The next pending record, queued ones first
+    auto next = [&]() -> const char* {
+        const char* record = queue->Peek(index, len);
+        if (record != nullptr) {
+            return record;
+        }
+        while (staging_index < LOG_MAX_STAGINGS) {
+            LogStaging* staging = staging_view[staging_index].load(std::memory_order_acquire);
+            size_t used = staging != nullptr ? staging->used.load(std::memory_order_acquire) : 0;
+            if (staging_offset < used) {
+                len = PeekLogRecordLength(staging->data + staging_offset, used - staging_offset);
+                if (len > 0 && len <= used - staging_offset) {
+                    return staging->data + staging_offset;
+                }
+            }
+            staging_index++;
+            staging_offset = 0;
+        }
+        return nullptr;
+    };
+    auto advance = [&]() {
+        if (queue->Peek(index, len) != nullptr) {
+            index++;
+        } else {
+            staging_offset += len;
+        }
+    };
+
+    const char* record = next();
+    while (count < SEND_BATCH && record != nullptr) {
+        char* datagram = datagrams + count * max_datagram;
+        size_t used = 0;
+        while (record != nullptr && used + len <= max_datagram) {
+            memcpy(datagram + used, record, len);
+            number_record(datagram + used);
+            used += len;
+            advance();
+            record = next();
+        }
+        iovs[count].iov_base = datagram;
+        iovs[count].iov_len = used;
+        memset(&msgs[count], 0, sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_name = &server_addr;
+        msgs[count].msg_hdr.msg_namelen = sizeof(server_addr);
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        ++count;
+    }
+    if (count > 0) {
+        sendmmsg(command_fd.load(std::memory_order_relaxed), msgs, count, 0);
+    }
+}
+
+// Handler of the fatal signals. It only reads what the interrupted threads
+// left behind and makes async-signal-safe calls, then hands the signal on
+// to whatever handled it before.
+void LogCrashHandler(int sig, siginfo_t* info, void* context) {
+    Logger* logger = crash_logger.load();
+    if (!crashing.exchange(true) && logger != nullptr && logger->is_open) {
+        if (crash_fd >= 0) {
+            logger->crash_write_records(crash_fd);
+        }
+        if (logger->queue != nullptr && logger->stream_sender == nullptr && logger->command_fd >= 0) {
+            logger->crash_send_records(crash_datagrams.data());
+        }
+    }
+
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        if (CRASH_SIGNALS[i] != sig) {
+            continue;
+        }
+        const struct sigaction& previous = previous_actions[i];
+        sigaction(sig, &previous, nullptr);
+        if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(sig, info, context);
+        } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(sig);
+        } else {
+            // Delivered with the default action once we return; a fault
+            // would also simply happen again
+            raise(sig);
+        }
+    }
+}
+
+// Only the first Logger to ask gets the signals, until it closes
+void Logger::install_crash_handlers() {
+    Logger* none = nullptr;
+    if (!crash_logger.compare_exchange_strong(none, this)) {
+        return;
+    }
+    if (!config.crash_path.empty()) {
+        crash_fd = open(config.crash_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (crash_fd < 0) {
+            perror("Logger: cannot open the crash file");
+        }
+    }
+    if (queue != nullptr && stream_sender == nullptr) {
+        crash_datagrams.resize(SEND_BATCH * max_datagram);
+    }
+
+    crash_stack.resize(std::max<size_t>(SIGSTKSZ, 64 * 1024));
+    stack_t stack;
+    memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = crash_stack.data();
+    stack.ss_size = crash_stack.size();
+    sigaltstack(&stack, nullptr);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = LogCrashHandler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        sigaction(CRASH_SIGNALS[i], &action, &previous_actions[i]);
+    }
+    crashing = false;
+}
+
+void Logger::remove_crash_handlers() {
+    if (crash_logger.load() != this) {
         return;
     }
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; ++i) {
+        sigaction(CRASH_SIGNALS[i], &previous_actions[i], nullptr);
+    }
+    if (crash_fd >= 0) {
+        close(crash_fd);
+        crash_fd = -1;
+    }
+    crash_logger = nullptr;
+}
+
+void Logger::Open(const LogConfig& _config) {
+    config = _config;
+    serial = next_serial++;
+    session_id = std::random_device()();
+    if (record_clock.Configure(config.clock) != config.clock) {
+        std::cerr << "Logger: no invariant TSC, timestamps come from CLOCK_REALTIME" << std::endl;
+    }
+    next_sequence = 0;
+    skipped = 0;
+    for (int i = 0; i < MAX_LOG_SITES / 32; ++i) {
+        announced[i].store(0, std::memory_order_relaxed);
+    }
+    for (int record_level = 0; record_level < LOG_SAMPLED_LEVELS; ++record_level) {
+        sampler.Configure(record_level, config.sample_one_in[record_level], config.sample_max_per_sec[record_level]);
+        sampler.Throttle(record_level, 1, 0);
+    }
+    if (config.dedup_window_ms > 0) {
+        dedup = new LogDedup(config.dedup_capacity, config.dedup_window_ms);
+    }
 
     // Set up server address for sending logs
     memset(&server_addr, 0, sizeof(server_addr));
@@ -82,53 +996,261 @@ void InitializeLog() {
     server_addr.sin_port = htons(SERVER_PORT);
     if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
         perror("Invalid address/ Address not supported");
-        close(client_fd);
-        client_fd = -1;
+        Close();
         return;
     }
-    
-    listen_flag = true;
-    listen_thread = std::thread(listen_for_commands);
+
+    if (config.transport == TRANSPORT_UDP) {
+        if (!open_udp()) {
+            Close();
+            return;
+        }
+    } else if (config.transport == TRANSPORT_SHM) {
+        shm_memfd = memfd_create("logger-ring", MFD_CLOEXEC);
+        shm_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shm_ring = new LogShmRing();
+        if (shm_memfd < 0 || shm_event_fd < 0 || !shm_ring->Create(shm_memfd, config.shm_ring_bytes)) {
+            perror("Logger: shared memory ring failed");
+            Close();
+            return;
+        }
+        if (!shm_connect()) {
+            perror("Logger: shared memory server not reachable, retrying");
+        }
+    } else if (config.transport == TRANSPORT_TCP) {
+        stream_sender = new LogStreamSender((const struct sockaddr*)&server_addr, sizeof(server_addr),
+                                            config.stream_buffer_bytes);
+    } else if (config.transport == TRANSPORT_UNIX) {
+        struct sockaddr_un stream_addr;
+        memset(&stream_addr, 0, sizeof(stream_addr));
+        stream_addr.sun_family = AF_UNIX;
+        strncpy(stream_addr.sun_path, config.stream_path.c_str(), sizeof(stream_addr.sun_path) - 1);
+        stream_sender = new LogStreamSender((const struct sockaddr*)&stream_addr, sizeof(stream_addr),
+                                            config.stream_buffer_bytes);
+    }
+
+    if ((config.async && shm_ring == nullptr) || stream_sender != nullptr) {
+        max_datagram = config.max_datagram ? config.max_datagram : path_max_datagram();
+        if (max_datagram > MAX_UDP_PAYLOAD) {
+            max_datagram = MAX_UDP_PAYLOAD;
+        }
+        if (max_datagram < LOG_RECORD_MAX_LEN) {
+            max_datagram = LOG_RECORD_MAX_LEN;
+        }
+        queue = new LogQueue(config.queue_capacity);
+        backend_running = true;
+        backend_thread = std::thread(&Logger::backend_loop, this);
+    }
+    if (config.crash_handler) {
+        install_crash_handlers();
+    }
+    is_open.store(true, std::memory_order_release);
+    send_hello();
+
+    // Stream clients get their commands over the stream
+    if (command_fd != -1 || shm_ring != nullptr) {
+        listening = true;
+        listen_thread = std::thread(&Logger::listen_for_commands, this);
+    }
 }
 
-void SetLogLevel(LOG_LEVEL level) {
-    log_level = level;
+void Logger::SetLevel(LOG_LEVEL new_level) {
+    level.store(new_level, std::memory_order_relaxed);
 }
 
-void Log(LOG_LEVEL level, const std::string& file, const std::string& function, int line, const std::string& message) {
-    if (level < log_level) {
+// Tells the server what a call site stands for the first time this Logger
+// logs from it. The SITE record is queued before the bit is set, so no
+// thread's entry can get to the server ahead of it.
+void Logger::announce_site(int site_id) {
+    std::atomic<uint32_t>& word = announced[site_id / 32];
+    uint32_t bit = 1u << (site_id % 32);
+    if (word.load(std::memory_order_acquire) & bit) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(announce_mutex);
+    if (word.load(std::memory_order_relaxed) & bit) {
+        return;
+    }
+    char site_buf[LOG_RECORD_MAX_LEN];
+    size_t len = encode_site(site_buf, sizeof(site_buf), log_sites[site_id]);
+    send_record(RECORD_SITE, DEBUG, site_id, 0, site_buf, len);
+    word.fetch_or(bit, std::memory_order_release);
+}
+
+void Logger::Log(LOG_LEVEL record_level, const char* file, const char* function, int line, const char* message) {
+    if (record_level < Level()) {
+        return;
+    }
+    ProducerScope scope(producers, is_open);
+    if (!scope.Open()) {
         return;
     }
-    
-    // Get current time
-    auto now = std::chrono::system_clock::now();
-    auto in_time_t = std::chrono::system_clock::to_time_t(now);
-    
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d %H:%M:%S");
 
-    std::string level_str;
-    switch(level) {
-        case DEBUG: level_str = "DEBUG"; break;
-        case WARNING: level_str = "WARNING"; break;
-        case ERROR: level_str = "ERROR"; break;
-        case CRITICAL: level_str = "CRITICAL"; break;
+    // Without a registered site the file, function and line travel in the payload
+    static thread_local char payload_buf[LOG_RECORD_MAX_LEN];
+    size_t len = EncodeLogSite(payload_buf, sizeof(payload_buf), file, function, line);
+    if (len == 0) {
+        len = EncodeLogSite(payload_buf, sizeof(payload_buf), "unknown", "unknown", line);
     }
+    size_t message_len = strlen(message);
+    if (dedup != nullptr) {
+        uint64_t key = LogDedup::Key(0, file, line, message, message_len);
+        if (dedup->Repeat(key) ||
+            !dedup->Open(key, record_level, 0, file, function, line, message, message_len, record_clock.Now())) {
+            return;
+        }
+    }
+    if (message_len > sizeof(payload_buf) - len) {
+        message_len = sizeof(payload_buf) - len;
+    }
+    uint32_t weight = sampler.Sample(record_level);
+    if (weight == 0) {
+        return;
+    }
+    memcpy(payload_buf + len, message, message_len);
 
-    std::string log_message_str = ss.str() + " " + level_str + " " + file + ":" + function + ":" + std::to_string(line) + " " + message;
-    
-    if (client_fd != -1) {
-        sendto(client_fd, log_message_str.c_str(), log_message_str.length(), 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    send_record(RECORD_ENTRY, record_level, 0, RECORD_FLAG_INLINE_SITE, payload_buf, len + message_len, weight);
+}
+
+int RegisterLogSite(const char* file, const char* function, int line, const char* format) {
+    int site_id = next_site_id.fetch_add(1);
+    if (site_id >= MAX_LOG_SITES) {
+        return 0;
     }
+    log_sites[site_id].format = format;
+    log_sites[site_id].function = function;
+    log_sites[site_id].line = line;
+    log_sites[site_id].file = file;
+    return site_id;
 }
 
-void ExitLog() {
-    listen_flag = false;
+const LogSite* GetLogSite(int site_id) {
+    if (site_id <= 0 || site_id >= MAX_LOG_SITES || site_id >= next_site_id) {
+        return nullptr;
+    }
+    return &log_sites[site_id];
+}
+
+void Logger::LogAtSite(LOG_LEVEL record_level, int site_id, const char* message) {
+    ProducerScope scope(producers, is_open);
+    if (!scope.Open()) {
+        return;
+    }
+    size_t len = strlen(message);
+    if (dedup != nullptr) {
+        uint64_t key = LogDedup::Key(site_id, nullptr, 0, message, len);
+        if (dedup->Repeat(key) ||
+            !dedup->Open(key, record_level, site_id, nullptr, nullptr, 0, message, len, record_clock.Now())) {
+            return;
+        }
+    }
+    uint32_t weight = sampler.Sample(record_level);
+    if (weight != 0) {
+        if (site_id != 0) {
+            announce_site(site_id);
+        }
+        send_record(RECORD_ENTRY, record_level, site_id, 0, message, len, weight);
+    }
+}
+
+void Logger::LogArgsAtSite(LOG_LEVEL record_level, int site_id, const char* format, const char* args, size_t len) {
+    if (site_id == 0) {
+        // The site table is full, so the server cannot learn the format
+        char message[LOG_RECORD_MAX_LEN];
+        FormatLogArgs(message, sizeof(message), format, args, len);
+        LogAtSite(record_level, site_id, message);
+        return;
+    }
+    ProducerScope scope(producers, is_open);
+    if (!scope.Open()) {
+        return;
+    }
+    if (dedup != nullptr) {
+        uint64_t key = LogDedup::Key(site_id, nullptr, 0, args, len);
+        if (dedup->Repeat(key) ||
+            !dedup->Open(key, record_level, site_id, nullptr, nullptr, 0, args, len, record_clock.Now())) {
+            return;
+        }
+    }
+    uint32_t weight = sampler.Sample(record_level);
+    if (weight != 0) {
+        announce_site(site_id);
+        send_record(RECORD_ENTRY, record_level, site_id, RECORD_FLAG_DEFERRED, args, len, weight);
+    }
+}
+
+unsigned long Logger::DroppedCount() const {
+    return dropped;
+}
+
+// Also undoes an Open() that failed part way, freeing what it got to
+void Logger::Close() {
+    // Whatever was suppressed is summarised now rather than lost, and what
+    // the threads staged is queued
+    expire_repeats(UINT64_MAX);
+    if (queue != nullptr) {
+        collect_stagings(true);
+    }
+
+    // No new records from here on; calls already past the check may still
+    // be queueing, or using dedup, while the backend runs
+    is_open = false;
+    for (size_t i = 0; i < LOG_PRODUCER_STRIPES; ++i) {
+        while (producers[i].count.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Stop the backend first so everything still queued gets sent
+    remove_crash_handlers();
+    backend_running = false;
+    backend_cv.notify_one();
+    if (backend_thread.joinable()) {
+        backend_thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        for (size_t i = 0; i < LOG_MAX_STAGINGS; ++i) {
+            if (stagings[i]) {
+                stagings[i]->retired = true;
+                staging_view[i].store(nullptr, std::memory_order_release);
+                stagings[i].reset();
+            }
+        }
+    }
+    delete queue;
+    queue = nullptr;
+    delete stream_sender;
+    stream_sender = nullptr;
+
+    // Wakes the listener from its receive timeout
+    listening = false;
+    if (command_fd != -1) {
+        shutdown(command_fd, SHUT_RD);
+    }
     if (listen_thread.joinable()) {
         listen_thread.join();
     }
-    if (client_fd != -1) {
-        close(client_fd);
+    if (command_fd != -1) {
+        close(command_fd);
+        command_fd = -1;
     }
-}
 
+    // The server keeps its own mapping and drains the ring once it sees the
+    // connection close
+    {
+        std::lock_guard<std::mutex> lock(shm_mutex);
+        delete shm_ring;
+        shm_ring = nullptr;
+    }
+    if (shm_memfd != -1) {
+        close(shm_memfd);
+        shm_memfd = -1;
+    }
+    if (shm_event_fd != -1) {
+        close(shm_event_fd);
+        shm_event_fd = -1;
+    }
+    delete dedup;
+    dedup = nullptr;
+}
@@ -11,20 +11,358 @@
 #include <cstring>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <signal.h>
+#include "LogRecord.h"
+#include "LogSampler.h"
+#include "LogArgs.h"
+#include "LogClock.h"
 
-// This is the new definition of the log levels.
-enum LOG_LEVEL { DEBUG, WARNING, ERROR, CRITICAL };
-
-// Global variables for the logger
-extern int log_level;
-extern int client_fd;
-extern struct sockaddr_in server_addr;
-extern std::atomic<bool> listen_flag;
-extern std::thread listen_thread;
-
-// Function prototypes
-void InitializeLog();
-void SetLogLevel(LOG_LEVEL level);
-void Log(LOG_LEVEL level, const std::string& file, const std::string& function, int line, const std::string& message);
-void ExitLog();
+// Call sites below LOG_MIN_LEVEL are removed at compile time, together with
+// the evaluation of their arguments (e.g. build with -DLOG_MIN_LEVEL=2)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+// A call site is interned once in a static table and afterwards referred to
+// by its small integer ID. ID 0 is reserved for records without a site.
+struct LogSite {
+    const char* file;
+    const char* function;
+    int line;
+    const char* format;     // of a LOGF site, nullptr otherwise
+};
+const int MAX_LOG_SITES = 4096;
+
+// How records travel to the server. UDP datagrams are cheapest but may be
+// lost; the stream transports never lose a record while the client runs. A
+// client on the server's host can write into a shared memory ring instead,
+// which takes no system call per record.
+enum LOG_TRANSPORT {
+    TRANSPORT_UDP,          // datagrams to port 8080
+    TRANSPORT_TCP,          // framed stream to TCP port 8080
+    TRANSPORT_UNIX,         // framed stream to the Unix socket stream_path
+    TRANSPORT_SHM           // ring handed to the server through shm_path
+};
+
+// Options for InitializeLog. By default Log() only queues the record and a
+// background thread packs queued records into datagrams and sends them in
+// batches with sendmmsg. The client listens for level commands on the same
+// ephemeral port it sends from and introduces itself with a HELLO record.
+//
+// A stream transport always uses the background thread. It reconnects by
+// itself and keeps unacknowledged records in memory meanwhile; once that
+// buffer and the queue are full, Log() waits instead of dropping.
+//
+// With shared memory Log() writes the record into the ring itself and there
+// is no background thread; a full ring drops records like a full queue.
+//
+// A message logged again from the same call site with the same text within
+// dedup_window_ms is only counted. When the window closes the server gets one
+// "last message repeated N times" record in place of the repeats.
+//
+// DEBUG and WARNING records can be sampled (see LogSampler.h); a server that
+// falls behind thins them out further for as long as it needs to.
+//
+// On SIGSEGV, SIGABRT or SIGBUS whatever is still queued or staged goes out
+// with one last sendmmsg (UDP), and everything pending is appended to
+// crash_path if one is given, before the signal is passed on to the handler
+// installed before ours. Shared memory records need neither: the server
+// drains the ring once the process is gone. Only one open Logger at a time
+// handles the signals.
+//
+// Records carry their time as nanoseconds since the epoch, read from the clock
+// source (see LogClock.h); the server renders it.
+struct LogConfig {
+    bool async;                 // false sends one datagram per record from the caller
+    int flush_interval_ms;      // longest time a queued record waits to be sent
+    size_t queue_capacity;      // queued records before Log() starts dropping
+    size_t max_datagram;        // bytes per datagram, 0 derives it from the path MTU
+    std::string name;           // how the server lists this client, empty = program name
+    std::string group;          // lets the server set the level of several clients at once
+    LOG_TRANSPORT transport;
+    std::string stream_path;    // server socket for TRANSPORT_UNIX
+    size_t stream_buffer_bytes; // unacknowledged stream records kept for resending
+    std::string shm_path;       // server socket for TRANSPORT_SHM
+    size_t shm_ring_bytes;      // size of the shared memory ring
+    int dedup_window_ms;        // 0 sends every repeated message
+    size_t dedup_capacity;      // distinct messages tracked at once
+    uint32_t sample_one_in[LOG_SAMPLED_LEVELS];         // keep 1 in N DEBUG / WARNING records
+    uint32_t sample_max_per_sec[LOG_SAMPLED_LEVELS];    // token bucket rate, 0 = unlimited
+    bool crash_handler;         // flush pending records on fatal signals
+    std::string crash_path;     // file pending records are written to on a crash, empty = none
+    LOG_CLOCK clock;            // where record timestamps come from
+
+    LogConfig()
+        : async(true), flush_interval_ms(20), queue_capacity(8192), max_datagram(0), transport(TRANSPORT_UDP),
+          stream_path("/tmp/logserver.stream"), stream_buffer_bytes(4 * 1024 * 1024),
+          shm_path("/tmp/logserver.shm"), shm_ring_bytes(4 * 1024 * 1024),
+          dedup_window_ms(1000), dedup_capacity(1024), sample_one_in{ 1, 1 }, sample_max_per_sec{ 0, 0 },
+          crash_handler(true), clock(CLOCK_SOURCE_REALTIME) {}
+};
+
+class LogQueue;
+class LogStreamSender;
+class LogShmRing;
+class LogDedup;
+struct LogStaging;
+
+const size_t LOG_MAX_STAGINGS = 256;       // threads with a staging buffer per Logger
+const size_t LOG_PRODUCER_STRIPES = 16;    // counters the threads logging are spread over
+
+// Calls under way in the threads mapped to one stripe, a cache line each so
+// threads logging side by side do not share it
+struct alignas(64) LogProducerCount {
+    std::atomic<int> count;
+};
+
+// A connection to the server and everything needed to send records over it.
+// Any number of threads may log through one Logger while a server command
+// changes its level: what Log() checks on every call is atomic and read with
+// relaxed loads, and the rest is set up by Open() before the first record
+// can get past it. Close() frees it again only after the calls already past
+// that point have returned.
+//
+// With a queue (async UDP and the stream transports) every thread encodes its
+// records into a staging buffer of its own and moves them to the queue a
+// buffer at a time, so threads logging side by side share no cache line per
+// record. The backend collects buffers that fill slowly every flush interval
+// and numbers records as they leave the queue. A process has one Logger
+// behind InitializeLog() and the LOG_ macros; more of them can talk to other
+// servers or use other settings.
+class Logger {
+    private:
+        std::atomic<int> level;
+        std::atomic<bool> is_open;
+        LogProducerCount producers[LOG_PRODUCER_STRIPES];  // calls past the is_open check, Close waits them out
+        uint64_t serial;                    // tells this Open's staging buffers from older ones
+
+        LogConfig config;
+        struct sockaddr_in server_addr;
+        std::atomic<int> command_fd;        // UDP socket or shared memory connection, -1 if none
+        uint32_t session_id;
+        std::atomic<uint32_t> next_sequence;
+        std::atomic<uint32_t> skipped;      // records dropped before they were numbered
+
+        // Asynchronous backend: records queued by Log() and the thread sending them
+        LogQueue* queue;
+        size_t max_datagram;
+        std::atomic<bool> backend_running;
+        std::atomic<bool> backend_wakeup;
+        std::atomic<unsigned long> dropped;
+        std::mutex backend_mutex;
+        std::condition_variable backend_cv;
+        std::thread backend_thread;
+        LogStreamSender* stream_sender;     // owned by the backend thread
+
+        // Shared memory ring; producers take turns on it under shm_mutex
+        LogShmRing* shm_ring;
+        std::mutex shm_mutex;
+        int shm_memfd;
+        int shm_event_fd;
+
+        LogDedup* dedup;                    // nullptr when every message is sent
+        LogSampler sampler;
+        LogClock record_clock;
+
+        std::atomic<bool> listening;
+        std::thread listen_thread;
+
+        // Staging buffers of the threads logging through this Logger. The
+        // crash handler reads staging_view, which needs no lock.
+        std::mutex staging_mutex;
+        std::shared_ptr<LogStaging> stagings[LOG_MAX_STAGINGS];
+        std::atomic<LogStaging*> staging_view[LOG_MAX_STAGINGS];
+
+        // Call sites the server has been told about over this connection
+        std::atomic<uint32_t> announced[MAX_LOG_SITES / 32];
+        std::mutex announce_mutex;
+
+        size_t encode_record(char* out, size_t out_len, LOG_RECORD_TYPE type, int record_level, int site_id,
+                             uint8_t flags, const char* payload, size_t len, uint32_t weight, uint32_t sequence);
+        size_t encode_hello(char* out, size_t out_len);
+        size_t encode_site_record(char* out, size_t out_len, int site_id);
+        void encode_preamble(std::vector<char>& preamble);
+        void wake_backend();
+        void send_record(LOG_RECORD_TYPE type, int record_level, int site_id, uint8_t flags, const char* payload,
+                         size_t len, uint32_t weight = 1);
+        void send_shm(LOG_RECORD_TYPE type, int record_level, int site_id, uint8_t flags, const char* payload,
+                      size_t len, uint32_t weight);
+        void push_record(const char* record, size_t len);
+        LogStaging* staging();
+        bool publish_staging(LogStaging& staging, bool may_wait);
+        void collect_stagings(bool wait);
+        void number_record(char* record);
+        void announce_site(int site_id);
+        void send_hello();
+        bool apply_command(const char* text, size_t len);
+        size_t path_max_datagram();
+        void flush_queue(char* batch_buf);
+        void fill_stream();
+        void stream_hello();
+        void stream_command(const char* text, size_t len);
+        void pump_stream();
+        void expire_repeats(uint64_t now);
+        void stream_loop();
+        void backend_loop();
+        bool shm_connect();
+        void listen_for_commands();
+        bool open_udp();
+        void crash_write_records(int fd);
+        void crash_send_records(char* datagrams);
+        void install_crash_handlers();
+        void remove_crash_handlers();
+
+        friend void LogCrashHandler(int sig, siginfo_t* info, void* context);
+
+    public:
+        Logger();
+        ~Logger();
+        Logger(const Logger&) = delete;
+        Logger& operator=(const Logger&) = delete;
+
+        // Connects to the server as config says and starts the threads. If
+        // that fails the Logger stays closed and keeps nothing allocated.
+        void Open(const LogConfig& config = LogConfig());
+
+        // Sends what is still pending and disconnects
+        void Close();
+
+        // Records below level are not sent; server commands change it too
+        void SetLevel(LOG_LEVEL new_level);
+        int Level() const {
+            return level.load(std::memory_order_relaxed);
+        }
+
+        // file and function are expected to be __FILE__ and __func__, so they
+        // are taken as plain pointers to avoid building std::string
+        // temporaries on every call
+        void Log(LOG_LEVEL record_level, const char* file, const char* function, int line, const char* message);
+        void LogAtSite(LOG_LEVEL record_level, int site_id, const char* message);
+
+        // Sends arguments captured by EncodeLogArgs for the format string of
+        // a LOGF site; the server formats them
+        void LogArgsAtSite(LOG_LEVEL record_level, int site_id, const char* format, const char* args, size_t len);
+
+        // Records dropped because the queue or ring was full
+        unsigned long DroppedCount() const;
+};
+
+// The Logger behind the functions and macros below
+extern Logger default_logger;
+
+// Call sites are interned once per process and shared by every Logger; each
+// Logger tells its server about a site the first time it logs from there
+int RegisterLogSite(const char* file, const char* function, int line, const char* format = nullptr);
+const LogSite* GetLogSite(int site_id);
+
+inline void InitializeLog(const LogConfig& config = LogConfig()) {
+    default_logger.Open(config);
+}
+inline void SetLogLevel(LOG_LEVEL level) {
+    default_logger.SetLevel(level);
+}
+inline void Log(LOG_LEVEL level, const char* file, const char* function, int line, const char* message) {
+    default_logger.Log(level, file, function, line, message);
+}
+inline void Log(LOG_LEVEL level, const char* file, const char* function, int line, const std::string& message) {
+    default_logger.Log(level, file, function, line, message.c_str());
+}
+inline void ExitLog() {
+    default_logger.Close();
+}
+inline unsigned long LogDroppedCount() {
+    return default_logger.DroppedCount();
+}
+inline void LogAtSite(LOG_LEVEL level, int site_id, const char* message) {
+    default_logger.LogAtSite(level, site_id, message);
+}
+inline void LogAtSite(LOG_LEVEL level, int site_id, const std::string& message) {
+    default_logger.LogAtSite(level, site_id, message.c_str());
+}
+inline void LogArgsAtSite(LOG_LEVEL level, int site_id, const char* format, const char* args, size_t len) {
+    default_logger.LogArgsAtSite(level, site_id, format, args, len);
+}
+inline void LogAtSite(Logger& logger, LOG_LEVEL level, int site_id, const char* message) {
+    logger.LogAtSite(level, site_id, message);
+}
+inline void LogAtSite(Logger& logger, LOG_LEVEL level, int site_id, const std::string& message) {
+    logger.LogAtSite(level, site_id, message.c_str());
+}
+
+template <typename... Args>
+inline void LogFormatAtSite(Logger& logger, LOG_LEVEL level, int site_id, const char* format, const Args&... args) {
+    char buf[LOG_RECORD_MAX_LEN - LOG_RECORD_HEADER_LEN];
+    logger.LogArgsAtSite(level, site_id, format, buf, EncodeLogArgs(buf, sizeof(buf), args...));
+}
+
+// Never called; lets the compiler check LOGF arguments against the format
+inline void LogFormatCheck(const char*, ...) __attribute__((format(printf, 1, 2)));
+inline void LogFormatCheck(const char*, ...) {}
+
+// The runtime level is checked before the message expression is evaluated and
+// the site is registered the first time the call actually logs. LOG_WITH and
+// LOGF_WITH log through the given Logger, the others through default_logger.
+#define LOG_WITH(logger, level, message) \
+    do { \
+        if ((level) >= (logger).Level()) { \
+            static const int log_site_id = RegisterLogSite(__FILE__, __func__, __LINE__); \
+            LogAtSite((logger), (level), log_site_id, (message)); \
+        } \
+    } while (0)
+#define LOG_AT(level, message) LOG_WITH(default_logger, level, message)
+
+// printf-style logging that formats nothing at the call site: the arguments
+// are copied into the record as they are and the format string, which must be
+// a literal, is sent once with the call site
+#define LOGF_WITH(logger, level, format, ...) \
+    do { \
+        if ((level) >= (logger).Level()) { \
+            if (false) { \
+                LogFormatCheck(format, ##__VA_ARGS__); \
+            } \
+            static const int log_site_id = RegisterLogSite(__FILE__, __func__, __LINE__, "" format); \
+            LogFormatAtSite((logger), (level), log_site_id, format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#define LOGF_AT(level, format, ...) LOGF_WITH(default_logger, level, format, ##__VA_ARGS__)
+
+#if LOG_MIN_LEVEL <= 0
+#define LOG_DEBUG(message) LOG_AT(DEBUG, message)
+#else
+#define LOG_DEBUG(message) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 0
+#define LOGF_DEBUG(...) LOGF_AT(DEBUG, __VA_ARGS__)
+#else
+#define LOGF_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= 1
+#define LOG_WARNING(message) LOG_AT(WARNING, message)
+#else
+#define LOG_WARNING(message) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 1
+#define LOGF_WARNING(...) LOGF_AT(WARNING, __VA_ARGS__)
+#else
+#define LOGF_WARNING(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= 2
+#define LOG_ERROR(message) LOG_AT(ERROR, message)
+#else
+#define LOG_ERROR(message) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= 2
+#define LOGF_ERROR(...) LOGF_AT(ERROR, __VA_ARGS__)
+#else
+#define LOGF_ERROR(...) ((void)0)
+#endif
+
+#define LOG_CRITICAL(message) LOG_AT(CRITICAL, message)
+#define LOGF_CRITICAL(...) LOGF_AT(CRITICAL, __VA_ARGS__)
 
@@ -29,7 +29,7 @@ int main()
     Automobile *car2 = new Automobile("Honda", "Civic", "red", 2012);
     Automobile *car3 = new Automobile("Chevrolet", "Impala", "blue", 2008);
     Automobile *car4 = new Automobile("Cadillac", "Escalade", "black", 2016);
-    Log(DEBUG, __FILE__, __func__, __LINE__, "Created the objects");
+    LOG_DEBUG("Created the objects");
         
     isRunning=true;
     int track=1;
@@ -42,7 +42,7 @@ int main()
         car2->addFuel(50.0);
         car3->addFuel(50.0);
         car4->addFuel(50.0);
-        Log(DEBUG, __FILE__, __func__, __LINE__, "Added the fuel");
+        LOG_DEBUG("Added the fuel");
         
         //Set fuel efficiency for city driving then drive
 	int cityDistance = track*100.0;
@@ -54,13 +54,13 @@ int main()
         car3->drive(cityDistance);
         car4->setFuelEfficiency(17.29);
         car4->drive(cityDistance);
-        Log(DEBUG, __FILE__, __func__, __LINE__, "Set the efficiency");
+        LOG_DEBUG("Set the efficiency");
 
         car1->addFuel(50.0);
         car2->addFuel(50.0);
         car3->addFuel(50.0);
         car4->addFuel(50.0);
-        Log(DEBUG, __FILE__, __func__, __LINE__, "Added the fuel again");
+        LOG_DEBUG("Added the fuel again");
         //Set fuel efficiency for highway driving then drive
 	int highwayDistance = 500.0-cityDistance;
         car1->setFuelEfficiency(6.2);
@@ -71,7 +71,7 @@ int main()
         car3->drive(highwayDistance);
         car4->setFuelEfficiency(12.5);
         car4->drive(highwayDistance);
-        Log(DEBUG, __FILE__, __func__, __LINE__, "Drove the cars");
+        LOG_DEBUG("Drove the cars");
 	track = (track+1)%5 + 1;
         sleep(1);
     }
@@ -81,13 +81,13 @@ int main()
     car2->displayReport();
     car3->displayReport();
     car4->displayReport();
-    Log(DEBUG, __FILE__, __func__, __LINE__, "Displayed the report");
+    LOG_DEBUG("Displayed the report");
 
     delete(car1);
     delete(car2);
     delete(car3);
     delete(car4);
-    Log(DEBUG, __FILE__, __func__, __LINE__, "Deleted the objects");
+    LOG_DEBUG("Deleted the objects");
 
     ExitLog();
 